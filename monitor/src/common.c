@@ -19,15 +19,385 @@
  */
 
 #include "common.h"
-#include <libsuperderpy.h>
+#include "protocol.h"
 #include <libwebsockets.h>
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+#include <math.h>
+#include <sys/time.h>
+#include <time.h>
 
-struct WebSocketConnectThreadData {
+#define WS_STOP_TIMEOUT 1.0 // seconds given to close the connection cleanly on WebSocketDisconnect
+#define WS_PING_MIN 0.5 // seconds, the shortest veto/ping_interval taken
+#define WS_REGISTER_TIMEOUT 5.0 // seconds to wait for the Z of a veto-bin registration before falling back to 0x01
+#define VETO_MONITOR_FLAGS 0x07 // of the 0x0a registration: timestamps, live tally and leaderboard, see server/proto.js
+
+struct WebSocketThreadData {
 	struct Game* game;
-	struct lws_client_connect_info* ccinfo;
+	const char* host;
+	struct lws_client_connect_info ccinfo;
 };
 
+// Outbound queue. Pushed to by the render thread, drained by the network thread.
+
+static unsigned int SendRingDepth(struct WebSocketSendQueue* queue) {
+	return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
+
+static unsigned int SendQueueDepth(struct WebSocketSendQueue* queue) {
+	return SendRingDepth(queue) + queue->overflow_length;
+}
+
+static bool SendRingPush(struct WebSocketSendQueue* queue, const void* data, size_t length, bool binary) {
+	unsigned int head = queue->head;
+	if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= WS_SEND_QUEUE_LENGTH) {
+		return false;
+	}
+
+	struct WebSocketSendSlot* slot = &queue->slots[head % WS_SEND_QUEUE_LENGTH];
+	if (length <= WS_SEND_SLOT_SIZE) {
+		memcpy(slot->buffer + LWS_PRE, data, length);
+		slot->large = NULL;
+	} else {
+		slot->large = malloc(LWS_PRE + length);
+		memcpy(slot->large + LWS_PRE, data, length);
+	}
+	slot->length = length;
+	slot->binary = binary;
+
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Moves as much of the overflow list into the ring as fits. Returns whether anything was moved.
+static bool SendQueueFlush(struct WebSocketSendQueue* queue) {
+	bool moved = false;
+	while (queue->overflow && SendRingPush(queue, queue->overflow->data, queue->overflow->length, queue->overflow->binary)) {
+		struct WebSocketSendOverflow* node = queue->overflow;
+		queue->overflow = node->next;
+		if (!queue->overflow) {
+			queue->overflow_last = NULL;
+		}
+		queue->overflow_length--;
+		free(node);
+		moved = true;
+	}
+	return moved;
+}
+
+static void SendQueuePush(struct Game* game, struct WebSocketSendQueue* queue, const void* data, size_t length, bool binary) {
+	SendQueueFlush(queue);
+
+	// once something went to the overflow list, everything after it has to follow to keep the order
+	if (queue->overflow || !SendRingPush(queue, data, length, binary)) {
+		queue->stalls++;
+		PrintConsole(game, "[ws] Send queue full, spilling %d bytes", (int)length);
+
+		struct WebSocketSendOverflow* node = malloc(sizeof(struct WebSocketSendOverflow) + length);
+		node->next = NULL;
+		node->length = length;
+		node->binary = binary;
+		memcpy(node->data, data, length);
+		if (queue->overflow_last) {
+			queue->overflow_last->next = node;
+		} else {
+			queue->overflow = node;
+		}
+		queue->overflow_last = node;
+		queue->overflow_length++;
+	}
+
+	unsigned int depth = SendQueueDepth(queue);
+	if (depth > queue->depth_max) {
+		queue->depth_max = depth;
+	}
+}
+
+// Writes the oldest queued message. Returns false on write error.
+static bool SendQueueWriteOne(struct Game* game, struct WebSocketSendQueue* queue, struct lws* wsi) {
+	unsigned int tail = queue->tail;
+	if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
+
+	struct WebSocketSendSlot* slot = &queue->slots[tail % WS_SEND_QUEUE_LENGTH];
+	unsigned char* buffer = slot->large ? slot->large : slot->buffer;
+
+	if (slot->binary) {
+		VetoLog(game, "[ws] sending %d bytes", (int)slot->length);
+	} else {
+		VetoLog(game, "[ws] sending %.*s", (int)slot->length, buffer + LWS_PRE);
+	}
+	int written = lws_write(wsi, buffer + LWS_PRE, slot->length, slot->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+	__atomic_add_fetch(&game->data->ws_stats.tx_messages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&game->data->ws_stats.tx_bytes, slot->length, __ATOMIC_RELAXED);
+
+	free(slot->large);
+	slot->large = NULL;
+	queue->sent++;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return written >= 0;
+}
+
+// Hands everything queued over to the embedded server, which is where it would end up anyway.
+static void SendQueueDeliverLocal(struct Game* game, struct WebSocketSendQueue* queue) {
+	unsigned int tail = queue->tail;
+	for (; tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE); tail++) {
+		struct WebSocketSendSlot* slot = &queue->slots[tail % WS_SEND_QUEUE_LENGTH];
+		unsigned char* buffer = slot->large ? slot->large : slot->buffer;
+
+		EmbeddedServerMonitorCommand(game, buffer + LWS_PRE, slot->length, slot->binary);
+
+		free(slot->large);
+		slot->large = NULL;
+		queue->sent++;
+		__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+// Only safe to call while the network thread isn't running.
+static void SendQueueClear(struct WebSocketSendQueue* queue) {
+	while (queue->overflow) {
+		struct WebSocketSendOverflow* node = queue->overflow;
+		queue->overflow = node->next;
+		free(node);
+	}
+	queue->overflow_last = NULL;
+	queue->overflow_length = 0;
+	for (; queue->tail != queue->head; queue->tail++) {
+		struct WebSocketSendSlot* slot = &queue->slots[queue->tail % WS_SEND_QUEUE_LENGTH];
+		free(slot->large);
+		slot->large = NULL;
+	}
+}
+
+// Receive buffers. Acquired by the network thread, released by whoever drops the last reference.
+
+struct WebSocketBuffer* BufferAcquire(struct WebSocketBufferPool* pool) {
+	al_lock_mutex(pool->mutex);
+	struct WebSocketBuffer* buffer = pool->free;
+	if (buffer) {
+		pool->free = buffer->next;
+		pool->count--;
+	}
+	al_unlock_mutex(pool->mutex);
+
+	if (!buffer) {
+		buffer = calloc(1, sizeof(struct WebSocketBuffer));
+		buffer->capacity = WS_BUFFER_INITIAL_CAPACITY;
+		buffer->data = malloc(buffer->capacity);
+	}
+	buffer->length = 0;
+	buffer->refs = 1;
+	buffer->next = NULL;
+	return buffer;
+}
+
+void BufferAppend(struct WebSocketBuffer* buffer, const void* data, size_t length) {
+	if (buffer->length + length + 1 > buffer->capacity) {
+		while (buffer->length + length + 1 > buffer->capacity) {
+			buffer->capacity *= 2;
+		}
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+}
+
+static void BufferRef(struct WebSocketBuffer* buffer) {
+	__atomic_add_fetch(&buffer->refs, 1, __ATOMIC_RELAXED);
+}
+
+void BufferRelease(struct WebSocketBufferPool* pool, struct WebSocketBuffer* buffer) {
+	if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	al_lock_mutex(pool->mutex);
+	if (pool->count < WS_BUFFER_POOL_SIZE && buffer->capacity <= WS_BUFFER_MAX_POOLED_CAPACITY) {
+		buffer->next = pool->free;
+		pool->free = buffer;
+		pool->count++;
+		buffer = NULL;
+	}
+	al_unlock_mutex(pool->mutex);
+
+	if (buffer) {
+		free(buffer->data);
+		free(buffer);
+	}
+}
+
+static void BufferPoolDestroy(struct WebSocketBufferPool* pool) {
+	while (pool->free) {
+		struct WebSocketBuffer* buffer = pool->free;
+		pool->free = buffer->next;
+		free(buffer->data);
+		free(buffer);
+	}
+	pool->count = 0;
+	al_destroy_mutex(pool->mutex);
+}
+
+static void BufferEventDestructor(ALLEGRO_USER_EVENT* ev) {
+	struct Game* game = (struct Game*)ev->data4;
+	BufferRelease(&game->data->ws_pool, (struct WebSocketBuffer*)ev->data3);
+}
+
+// Emits an event pointing into the buffer; the buffer stays alive until the event is destroyed.
+static void EmitBufferEvent(struct Game* game, ALLEGRO_EVENT* ev, struct WebSocketBuffer* buffer) {
+	BufferRef(buffer);
+	ev->user.data3 = (intptr_t)buffer;
+	ev->user.data4 = (intptr_t)game;
+	al_emit_user_event(&(game->event_source), ev, BufferEventDestructor);
+}
+
+// Inbound queue. Pushed to by the network thread, drained by the render thread.
+
+void ReceiveQueuePush(struct Game* game, struct WebSocketBuffer* buffer) {
+	struct WebSocketReceiveQueue* queue = &game->data->ws_incoming;
+	unsigned int head = queue->head;
+
+	while (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= WS_RECEIVE_QUEUE_LENGTH) {
+		// the render thread is behind; rather wait for it than lose a message, unless it's disconnecting
+		if (al_get_thread_should_stop(game->data->ws_thread) || !__atomic_load_n(&game->data->ws, __ATOMIC_ACQUIRE)) {
+			BufferRelease(&game->data->ws_pool, buffer);
+			return;
+		}
+		al_rest(0.001);
+	}
+
+	queue->messages[head % WS_RECEIVE_QUEUE_LENGTH] = buffer;
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+	// wake up the render thread only once for everything queued before it gets to drain it
+	if (!__atomic_exchange_n(&queue->wakeup, true, __ATOMIC_ACQ_REL)) {
+		ALLEGRO_EVENT ev;
+		ev.user.type = WEBSOCKET_EVENT_INCOMING_MESSAGE;
+		al_emit_user_event(&(game->event_source), &ev, NULL);
+	}
+}
+
+// Only safe to call while the network thread isn't running.
+static void ReceiveQueueClear(struct Game* game) {
+	struct WebSocketReceiveQueue* queue = &game->data->ws_incoming;
+	for (; queue->tail != queue->head; queue->tail++) {
+		BufferRelease(&game->data->ws_pool, queue->messages[queue->tail % WS_RECEIVE_QUEUE_LENGTH]);
+	}
+	queue->wakeup = false;
+
+	if (game->data->ws_rx) {
+		BufferRelease(&game->data->ws_pool, game->data->ws_rx);
+		game->data->ws_rx = NULL;
+	}
+}
+
+static const struct {
+	const char* text;
+	unsigned char opcode; // veto-bin
+} VetoCommands[] = {
+	[VETO_COMMAND_MONITOR] = {"{\"type\":\"monitor\",\"batch\":true,\"timestamps\":true,\"live\":true,\"leaderboard\":true}", 0x0a},
+	[VETO_COMMAND_START] = {"{\"type\":\"start\"}", 0x02},
+	[VETO_COMMAND_VOTING] = {"{\"type\":\"voting\"}", 0x03},
+};
+
+// Every connection registers as the monitor before anything that got queued while it was down,
+// since the server ignores commands from unregistered connections. A veto-bin server that doesn't
+// take the options falls back to the plain 0x01 registration, see WebSocketThread.
+static bool WebSocketWriteGreeting(struct Game* game, struct lws* wsi) {
+	unsigned char buffer[LWS_PRE + 64];
+	const char* text = VetoCommands[VETO_COMMAND_MONITOR].text;
+	size_t length = 1;
+
+	if (game->data->ws_binary && game->data->ws_greet_basic) {
+		buffer[LWS_PRE] = 0x01;
+	} else if (game->data->ws_binary) {
+		buffer[LWS_PRE] = VetoCommands[VETO_COMMAND_MONITOR].opcode;
+		buffer[LWS_PRE + 1] = VETO_MONITOR_FLAGS;
+		length = 2;
+	} else {
+		length = strlen(text);
+		memcpy(buffer + LWS_PRE, text, length);
+	}
+	VetoLog(game, "[ws] registering as monitor");
+	game->data->ws_greet = false;
+	game->data->ws_greeted_at = al_get_time();
+	__atomic_add_fetch(&game->data->ws_stats.tx_messages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&game->data->ws_stats.tx_bytes, length, __ATOMIC_RELAXED);
+	return lws_write(wsi, buffer + LWS_PRE, length, game->data->ws_binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT) >= 0;
+}
+
+// Asks the server for its voting clock, which comes back in a K record along with the time
+// written here, see VetoClockSample.
+static bool WebSocketWriteClockProbe(struct Game* game, struct lws* wsi) {
+	unsigned char buffer[LWS_PRE + 64];
+	double now = al_get_time() * 1000;
+	size_t length = 1;
+
+	if (game->data->ws_binary) {
+		uintmax_t value = (uintmax_t)now * 2; // zigzag, never negative
+		buffer[LWS_PRE] = 0x0d;
+		while (value > 0x7f) {
+			buffer[LWS_PRE + length++] = (value & 0x7f) | 0x80;
+			value >>= 7;
+		}
+		buffer[LWS_PRE + length++] = value;
+	} else {
+		length = snprintf((char*)buffer + LWS_PRE, sizeof(buffer) - LWS_PRE, "{\"type\":\"clock\",\"time\":%.0f}", now);
+	}
+	game->data->ws_clock = false;
+	__atomic_add_fetch(&game->data->ws_stats.tx_messages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&game->data->ws_stats.tx_bytes, length, __ATOMIC_RELAXED);
+	return lws_write(wsi, buffer + LWS_PRE, length, game->data->ws_binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT) >= 0;
+}
+
+// Exponential backoff with jitter, so monitors dropped all at once by a server restart
+// don't come back all at once as well.
+static double WebSocketScheduleReconnect(struct Game* game) {
+	double delay = game->data->ws_backoff_min * (1u << (game->data->ws_retries < 16 ? game->data->ws_retries : 16));
+	if (delay > game->data->ws_backoff_max) {
+		delay = game->data->ws_backoff_max;
+	}
+	delay = delay / 2.0 + delay / 2.0 * (rand() / (double)RAND_MAX);
+
+	game->data->ws_retries++;
+	game->data->ws_retry_at = al_get_time() + delay;
+	return delay;
+}
+
+static void WebSocketConnectionLost(struct Game* game) {
+	// called on the network thread
+	if (!game->data->ws_established) {
+		// never got through, so the host may have moved; look it up again next time
+		game->data->ws_address[0] = '\0';
+	}
+	game->data->ws_established = false;
+	game->data->ws_socket = NULL;
+	if (game->data->ws_rx) {
+		// the rest of it is never going to arrive
+		BufferRelease(&game->data->ws_pool, game->data->ws_rx);
+		game->data->ws_rx = NULL;
+	}
+	if (!game->data->ws) {
+		// closed on purpose by WebSocketDisconnect
+		return;
+	}
+
+	ALLEGRO_EVENT ev;
+	ev.user.type = WEBSOCKET_EVENT_DISCONNECTED;
+	ev.user.data1 = game->data->ws_session;
+	ev.user.data2 = WebSocketScheduleReconnect(game) * 1000; // ms until the next attempt
+	al_emit_user_event(&(game->event_source), &ev, NULL);
+}
+
 static int WebSocketCallback(struct lws* wsi, enum lws_callback_reasons reason, void* user, void* in, size_t len) {
+	// called on the network thread
 	struct Game* game = user;
 	ALLEGRO_EVENT ev;
 
@@ -35,43 +405,79 @@ static int WebSocketCallback(struct lws* wsi, enum lws_callback_reasons reason,
 		return 0;
 	}
 
-	if (!game || !game->data->ws) {
+	if (!game) {
+		return 1;
+	}
+	if (!game->data->ws && reason != LWS_CALLBACK_CLOSED && reason != LWS_CALLBACK_CLIENT_CONNECTION_ERROR) {
 		return 1; // disconnect
 	}
 
 	switch (reason) {
 		case LWS_CALLBACK_CLIENT_ESTABLISHED:
+			game->data->ws_established = true;
+			game->data->ws_greet = true;
+			game->data->ws_greeted_at = 0;
+			__atomic_store_n(&game->data->ws_registered, 0, __ATOMIC_RELAXED);
+			game->data->ws_clock = true;
+			game->data->ws_pong = true;
+			game->data->ws_retries = 0;
 			ev.user.type = WEBSOCKET_EVENT_CONNECTED;
+			ev.user.data1 = game->data->ws_session;
+			ev.user.data2 = (al_get_time() - game->data->ws_attempt_at) * 1000; // ms to get connected
 			al_emit_user_event(&(game->event_source), &ev, NULL);
+			lws_callback_on_writable(wsi);
 			break;
 
 		case LWS_CALLBACK_CLIENT_WRITEABLE:
-			if (game->data->ws_buffer) {
-				PrintConsole(game, "[ws] sending %s", game->data->ws_buffer);
-
-				int length = strlen(game->data->ws_buffer);
-				unsigned char* buffer = malloc((LWS_SEND_BUFFER_PRE_PADDING + length + LWS_SEND_BUFFER_POST_PADDING) * sizeof(unsigned char));
-				memcpy(buffer + LWS_SEND_BUFFER_PRE_PADDING, game->data->ws_buffer, length);
-
-				lws_write(wsi, buffer + LWS_SEND_BUFFER_PRE_PADDING, length, LWS_WRITE_TEXT);
-
-				free(buffer);
-				free(game->data->ws_buffer);
-				game->data->ws_buffer = NULL;
+			// one frame per writeable callback; ask for another one while there's more to send
+			if (game->data->ws_greet) {
+				if (!WebSocketWriteGreeting(game, wsi)) {
+					return -1;
+				}
+			} else if (game->data->ws_clock) {
+				if (!WebSocketWriteClockProbe(game, wsi)) {
+					return -1;
+				}
+			} else if (game->data->ws_ping) {
+				unsigned char ping[LWS_PRE];
+				game->data->ws_ping = false;
+				game->data->ws_pong = false;
+				game->data->ws_ping_at = al_get_time();
+				if (lws_write(wsi, ping + LWS_PRE, 0, LWS_WRITE_PING) < 0) {
+					return -1;
+				}
+			} else if (!SendQueueWriteOne(game, &game->data->ws_queue, wsi)) {
+				return -1;
+			}
+			if (game->data->ws_clock || game->data->ws_ping || SendRingDepth(&game->data->ws_queue)) {
+				lws_callback_on_writable(wsi);
 			}
 			break;
 
 		case LWS_CALLBACK_CLIENT_RECEIVE:
-			ev.user.type = WEBSOCKET_EVENT_INCOMING_MESSAGE;
-			ev.user.data1 = (intptr_t)strdup(in); // TODO: memory leak
-			ev.user.data2 = len;
-			al_emit_user_event(&(game->event_source), &ev, NULL);
+			// messages may come in several fragments; hand them over only once complete
+			if (!game->data->ws_rx) {
+				game->data->ws_rx = BufferAcquire(&game->data->ws_pool);
+			}
+			BufferAppend(game->data->ws_rx, in, len);
+			__atomic_add_fetch(&game->data->ws_stats.rx_bytes, len, __ATOMIC_RELAXED);
+			if (lws_is_final_fragment(wsi) && !lws_remaining_packet_payload(wsi)) {
+				game->data->ws_rx->binary = lws_frame_is_binary(wsi);
+				game->data->ws_rx->received = al_get_time();
+				__atomic_add_fetch(&game->data->ws_stats.rx_messages, 1, __ATOMIC_RELAXED);
+				ReceiveQueuePush(game, game->data->ws_rx);
+				game->data->ws_rx = NULL;
+			}
+			break;
+
+		case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
+			game->data->ws_pong = true;
+			__atomic_store_n(&game->data->ws_stats.rtt, (unsigned int)((al_get_time() - game->data->ws_ping_at) * 1000000), __ATOMIC_RELAXED);
 			break;
 
 		case LWS_CALLBACK_CLOSED:
 		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
-			ev.user.type = WEBSOCKET_EVENT_DISCONNECTED;
-			al_emit_user_event(&(game->event_source), &ev, NULL);
+			WebSocketConnectionLost(game);
 			break;
 
 		default:
@@ -82,155 +488,853 @@ static int WebSocketCallback(struct lws* wsi, enum lws_callback_reasons reason,
 }
 
 static struct lws_protocols protocols[] = {
-	{.name = "veto", .callback = WebSocketCallback, .rx_buffer_size = 64},
+	{.name = "veto", .callback = WebSocketCallback, .rx_buffer_size = 1024},
+	{.name = "veto-bin", .callback = WebSocketCallback, .rx_buffer_size = 1024},
 	{.callback = NULL} /* terminator */
 };
 
-static void VetoProtocolHandler(struct Game* game, char* msg, int len) {
-	ALLEGRO_EVENT ev;
-	/*
-			ev.user.type = VETO_EVENT_INCOMING_MESSAGE;
-			ev.user.data1 = (intptr_t) in;
-			ev.user.data2 = len;
-			al_emit_user_event(&(game->event_source), &ev, NULL);
-	*/
+enum VetoRecordKind {
+	VETO_RECORD_UNKNOWN = 0,
+	VETO_RECORD_PLAIN, // no payload
+	VETO_RECORD_NUMBER, // integer payload in data1
+	VETO_RECORD_RESULT, // F/A payload as a bool in data1
+	VETO_RECORD_STRING, // string payload in data1
+	VETO_RECORD_WINNER, // single digit in data1, then string payload in data2
+	VETO_RECORD_SNAPSHOT, // struct VetoSnapshot* in data1
+	VETO_RECORD_TIMESTAMP, // server send time; not an event, goes to the link statistics
+	VETO_RECORD_NICK, // player id, then its nick; not an event, goes to the nick table
+	VETO_RECORD_PLAYER, // player id, emitted with the nick from the table as a string payload in data1
+	VETO_RECORD_TALLY, // three integers in data1, data2 and data3
+	VETO_RECORD_LEADERBOARD, // struct VetoLeaderboard* in data1
+	VETO_RECORD_DEADLINE, // voting clock deadline and ms left, emitted as the local time in data1
+	VETO_RECORD_CLOCK, // probe time and voting clock; not an event, goes to the clock offset
+	VETO_RECORD_REJECTED, // why the server rejected a message; not an event, goes to the console
+};
 
-	if (!msg) {
-		return;
-	}
-	if (!msg[0]) {
-		return;
+struct VetoRecord {
+	enum VetoRecordKind kind;
+	VETO_EVENT_TYPE type;
+	const char* log;
+};
+
+// indexed by the first character of a record
+static const struct VetoRecord VetoRecords[256] = {
+	['S'] = {VETO_RECORD_PLAIN, VETO_EVENT_START, "[veto] start"},
+	['V'] = {VETO_RECORD_PLAIN, VETO_EVENT_VOTING, "[veto] voting"},
+	['C'] = {VETO_RECORD_NUMBER, VETO_EVENT_COUNTER, "[veto] counter %d"},
+	['F'] = {VETO_RECORD_NUMBER, VETO_EVENT_VOTES_FOR, "[veto] votes for %d"},
+	['A'] = {VETO_RECORD_NUMBER, VETO_EVENT_VOTES_AGAINST, "[veto] votes against %d"},
+	['N'] = {VETO_RECORD_NUMBER, VETO_EVENT_VOTES_ABSTAINED, "[veto] votes abstained %d"},
+	['E'] = {VETO_RECORD_RESULT, VETO_EVENT_VOTE_RESULT, "[veto] vote result %d"},
+	['v'] = {VETO_RECORD_STRING, VETO_EVENT_VETO, "[veto] veto from %s"},
+	['P'] = {VETO_RECORD_NUMBER, VETO_EVENT_PLAYERS, "[veto] player count %d"},
+	['J'] = {VETO_RECORD_STRING, VETO_EVENT_JOIN, "[veto] player %s joined"},
+	['L'] = {VETO_RECORD_STRING, VETO_EVENT_LEAVE, "[veto] player %s left"},
+	['R'] = {VETO_RECORD_STRING, VETO_EVENT_RECONNECT, "[veto] player %s reconnected"},
+	['W'] = {VETO_RECORD_WINNER, VETO_EVENT_WINNER, "[veto] winner nr %d is %s"},
+	['T'] = {VETO_RECORD_STRING, VETO_EVENT_THE_END, "[veto] the end (veto from %s)"},
+	['t'] = {VETO_RECORD_TIMESTAMP, 0, NULL},
+	['I'] = {VETO_RECORD_NICK, 0, "[veto] player %d is %s"},
+	['j'] = {VETO_RECORD_PLAYER, VETO_EVENT_JOIN, "[veto] player %s joined"},
+	['l'] = {VETO_RECORD_PLAYER, VETO_EVENT_LEAVE, "[veto] player %s left"},
+	['r'] = {VETO_RECORD_PLAYER, VETO_EVENT_RECONNECT, "[veto] player %s reconnected"},
+	['Y'] = {VETO_RECORD_TALLY, VETO_EVENT_TALLY, "[veto] live tally %d/%d/%d"},
+	['B'] = {VETO_RECORD_LEADERBOARD, VETO_EVENT_LEADERBOARD, "[veto] leaderboard: %d players, best %s (%d)"},
+	['D'] = {VETO_RECORD_DEADLINE, VETO_EVENT_DEADLINE, "[veto] voting closes in %d ms"},
+	['K'] = {VETO_RECORD_CLOCK, 0, NULL},
+	['X'] = {VETO_RECORD_REJECTED, 0, NULL},
+	['Z'] = {VETO_RECORD_SNAPSHOT, VETO_EVENT_SNAPSHOT, "[veto] snapshot: %d players, round %d, started %d, voting %d, counter %d, votes %d/%d/%d, %d vetos"},
+};
+
+#define VETO_SNAPSHOT_NUMBERS 9
+
+static void WebSocketStatsTimestamp(struct Game* game, struct WebSocketBuffer* buffer, double sent) {
+	struct WebSocketStats* stats = &game->data->ws_stats;
+	stats->delay = buffer->received * 1000 + game->data->ws_wallclock_offset - sent;
+	if (!stats->delay_min || stats->delay < stats->delay_min) {
+		stats->delay_min = stats->delay;
 	}
+}
 
-	if (msg[0] == 'S') {
-		ev.user.type = VETO_EVENT_START;
-		PrintConsole(game, "[veto] start");
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+// The sample with the shortest round trip gives the best estimate of the offset, as the delay
+// can only be split evenly between both ways when it's short. Clocks drift apart, though, so the
+// one in use gets a bit worse with each new sample until a fresh one wins.
+static void VetoClockSample(struct Game* game, struct WebSocketBuffer* buffer, double sent, double clock) {
+	if (game->data->replay) {
+		// answers to probes of the process that made the capture, meaningless to this one
 		return;
 	}
-	if (msg[0] == 'V') {
-		ev.user.type = VETO_EVENT_VOTING;
-		PrintConsole(game, "[veto] voting");
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+	double received = buffer->received * 1000;
+	double rtt = received - sent;
+	if (rtt < 0) {
 		return;
 	}
-	if (msg[0] == 'C') {
-		ev.user.type = VETO_EVENT_COUNTER;
-		ev.user.data1 = strtol(msg + 1, NULL, 10);
-		PrintConsole(game, "[veto] counter %d", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+	game->data->ws_clock_rtt *= 1.05;
+	if (game->data->ws_clock_rtt >= 0 && rtt > game->data->ws_clock_rtt) {
 		return;
 	}
-	if (msg[0] == 'F') {
-		ev.user.type = VETO_EVENT_VOTES_FOR;
-		ev.user.data1 = strtol(msg + 1, NULL, 10);
-		PrintConsole(game, "[veto] votes for %d", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
-		return;
+	game->data->ws_clock_rtt = rtt;
+	game->data->ws_clock_offset = clock + rtt / 2 - received;
+	VetoLog(game, "[veto] voting clock offset %.1f ms, round trip %.1f ms", game->data->ws_clock_offset, rtt);
+}
+
+static void EmitDeadline(struct Game* game, struct WebSocketBuffer* buffer, const struct VetoRecord* record, intptr_t deadline, intptr_t left) {
+	ALLEGRO_EVENT ev;
+	ev.user.type = record->type;
+	if (game->data->ws_clock_rtt >= 0) {
+		ev.user.data1 = deadline - game->data->ws_clock_offset;
+	} else {
+		// no clock sample yet, so late by however long the record took to get here
+		ev.user.data1 = buffer->received * 1000 + left;
 	}
-	if (msg[0] == 'A') {
-		ev.user.type = VETO_EVENT_VOTES_AGAINST;
-		ev.user.data1 = strtol(msg + 1, NULL, 10);
-		PrintConsole(game, "[veto] votes against %d", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
-		return;
+	VetoLog(game, record->log, (int)(ev.user.data1 - al_get_time() * 1000));
+	al_emit_user_event(&(game->event_source), &ev, NULL);
+}
+
+// For events with a malloc'ed struct in data1 that points into the buffer.
+static void SnapshotEventDestructor(ALLEGRO_USER_EVENT* ev) {
+	free((void*)ev->data1);
+	BufferEventDestructor(ev);
+}
+
+// Anything but the registration only gets logged; if that's what got rejected, the network
+// thread registers again the plain way.
+static void VetoRejected(struct Game* game, const char* why) {
+	PrintConsole(game, "[veto] The server rejected a message: %s", why);
+	if (__atomic_load_n(&game->data->ws_registered, __ATOMIC_RELAXED) == 0) {
+		__atomic_store_n(&game->data->ws_registered, -1, __ATOMIC_RELAXED);
 	}
-	if (msg[0] == 'N') {
-		ev.user.type = VETO_EVENT_VOTES_ABSTAINED;
-		ev.user.data1 = strtol(msg + 1, NULL, 10);
-		PrintConsole(game, "[veto] votes abstained %d", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
-		return;
+}
+
+// Numbers come in the order they're sent in, see the Z record in server/server.js. It's the
+// answer to the registration, too.
+static void EmitSnapshot(struct Game* game, struct WebSocketBuffer* buffer, const struct VetoRecord* record, intptr_t numbers[VETO_SNAPSHOT_NUMBERS], char* winners[4]) {
+	struct VetoSnapshot* snapshot = calloc(1, sizeof(struct VetoSnapshot));
+	__atomic_store_n(&game->data->ws_registered, 1, __ATOMIC_RELAXED);
+	snapshot->players = numbers[0];
+	snapshot->round = numbers[1];
+	snapshot->started = numbers[2];
+	snapshot->voting = numbers[3];
+	snapshot->counter = numbers[4];
+	snapshot->votesFor = numbers[5];
+	snapshot->votesAgainst = numbers[6];
+	snapshot->abstained = numbers[7];
+	snapshot->vetos = numbers[8];
+	for (int i = 0; i < 4; i++) {
+		snapshot->winner[i] = winners[i];
 	}
-	if (msg[0] == 'E') {
-		ev.user.type = VETO_EVENT_VOTE_RESULT;
-		ev.user.data1 = (msg[1] == 'F');
-		PrintConsole(game, "[veto] vote result %d", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+	VetoLog(game, record->log, snapshot->players, snapshot->round, snapshot->started, snapshot->voting, snapshot->counter,
+		snapshot->votesFor, snapshot->votesAgainst, snapshot->abstained, snapshot->vetos);
+
+	ALLEGRO_EVENT ev;
+	ev.user.type = record->type;
+	ev.user.data1 = (intptr_t)snapshot;
+	BufferRef(buffer);
+	ev.user.data3 = (intptr_t)buffer;
+	ev.user.data4 = (intptr_t)game;
+	al_emit_user_event(&(game->event_source), &ev, SnapshotEventDestructor);
+}
+
+// Player ids let veto-bin skip repeating nicks; the server sends each one once per connection.
+static void VetoStoreNick(struct Game* game, const struct VetoRecord* record, intptr_t id, const char* nick) {
+	VetoLog(game, record->log, (int)id, nick);
+	if (id < 0) {
 		return;
 	}
-	if (msg[0] == 'v') {
-		ev.user.type = VETO_EVENT_VETO;
-		ev.user.data1 = (intptr_t)strdup(msg + 1);
-		PrintConsole(game, "[veto] veto from %s", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
-		return;
+	if ((size_t)id >= game->data->veto_nicks_count) {
+		size_t count = game->data->veto_nicks_count ? game->data->veto_nicks_count : 64;
+		while ((size_t)id >= count) {
+			count *= 2;
+		}
+		game->data->veto_nicks = realloc(game->data->veto_nicks, count * sizeof(char*));
+		memset(game->data->veto_nicks + game->data->veto_nicks_count, 0, (count - game->data->veto_nicks_count) * sizeof(char*));
+		game->data->veto_nicks_count = count;
 	}
+	free(game->data->veto_nicks[id]);
+	game->data->veto_nicks[id] = strdup(nick);
+}
 
-	if (msg[0] == 'P') {
-		ev.user.type = VETO_EVENT_PLAYERS;
-		ev.user.data1 = strtol(msg + 1, NULL, 10);
-		PrintConsole(game, "[veto] player count %d", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
-		return;
+static void PlayerEventDestructor(ALLEGRO_USER_EVENT* ev) {
+	free((char*)ev->data1);
+}
+
+// The event gets a copy, as the table entry may get replaced before it's handled.
+static void EmitPlayer(struct Game* game, const struct VetoRecord* record, intptr_t id) {
+	char buf[32];
+	const char* nick = NULL;
+	if (id >= 0 && (size_t)id < game->data->veto_nicks_count) {
+		nick = game->data->veto_nicks[id];
 	}
-	if (msg[0] == 'J') {
-		ev.user.type = VETO_EVENT_JOIN;
-		ev.user.data1 = (intptr_t)strdup(msg + 1);
-		PrintConsole(game, "[veto] player %s joined", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
-		return;
+	if (!nick) {
+		snprintf(buf, sizeof(buf), "#%d", (int)id);
+		nick = buf;
 	}
-	if (msg[0] == 'L') {
-		ev.user.type = VETO_EVENT_LEAVE;
-		ev.user.data1 = (intptr_t)strdup(msg + 1);
-		PrintConsole(game, "[veto] player %s left", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+	VetoLog(game, record->log, nick);
+
+	ALLEGRO_EVENT ev;
+	ev.user.type = record->type;
+	ev.user.data1 = (intptr_t)strdup(nick);
+	al_emit_user_event(&(game->event_source), &ev, PlayerEventDestructor);
+}
+
+// Takes ownership of leaderboard; the names point into the buffer.
+static void EmitLeaderboard(struct Game* game, struct WebSocketBuffer* buffer, const struct VetoRecord* record, struct VetoLeaderboard* leaderboard) {
+	VetoLog(game, record->log, leaderboard->count, leaderboard->count ? leaderboard->name[0] : "-", leaderboard->count ? leaderboard->score[0] : 0);
+
+	ALLEGRO_EVENT ev;
+	ev.user.type = record->type;
+	ev.user.data1 = (intptr_t)leaderboard;
+	BufferRef(buffer);
+	ev.user.data3 = (intptr_t)buffer;
+	ev.user.data4 = (intptr_t)game;
+	al_emit_user_event(&(game->event_source), &ev, SnapshotEventDestructor);
+}
+
+static void EmitTally(struct Game* game, const struct VetoRecord* record, intptr_t numbers[3]) {
+	VetoLog(game, record->log, (int)numbers[0], (int)numbers[1], (int)numbers[2]);
+
+	ALLEGRO_EVENT ev;
+	ev.user.type = record->type;
+	ev.user.data1 = numbers[0];
+	ev.user.data2 = numbers[1];
+	ev.user.data3 = numbers[2];
+	al_emit_user_event(&(game->event_source), &ev, NULL);
+}
+
+static inline intptr_t ParseNumber(const char* str) {
+	intptr_t value = 0;
+	bool negative = (*str == '-');
+	if (negative) {
+		str++;
+	}
+	while (*str >= '0' && *str <= '9') {
+		value = value * 10 + (*str - '0');
+		str++;
+	}
+	return negative ? -value : value;
+}
+
+// Comma-separated numbers; missing ones are left at 0.
+static void ParseNumbers(const char* pos, intptr_t* numbers, int count) {
+	for (int i = 0; i < count; i++) {
+		numbers[i] = ParseNumber(pos);
+		pos += strcspn(pos, ",");
+		if (*pos == ',') {
+			pos++;
+		}
+	}
+}
+
+static void EmitRecord(struct Game* game, struct WebSocketBuffer* buffer, const struct VetoRecord* record, intptr_t number, char* str) {
+	ALLEGRO_EVENT ev;
+	ev.user.type = record->type;
+
+	switch (record->kind) {
+		case VETO_RECORD_UNKNOWN:
+		case VETO_RECORD_SNAPSHOT:
+		case VETO_RECORD_TIMESTAMP:
+		case VETO_RECORD_NICK:
+		case VETO_RECORD_TALLY:
+		case VETO_RECORD_LEADERBOARD:
+		case VETO_RECORD_DEADLINE:
+		case VETO_RECORD_CLOCK:
+		case VETO_RECORD_REJECTED:
+			return;
+		case VETO_RECORD_PLAYER:
+			EmitPlayer(game, record, number);
+			return;
+		case VETO_RECORD_PLAIN:
+			VetoLog(game, record->log);
+			al_emit_user_event(&(game->event_source), &ev, NULL);
+			return;
+		case VETO_RECORD_NUMBER:
+		case VETO_RECORD_RESULT:
+			ev.user.data1 = number;
+			VetoLog(game, record->log, (int)number);
+			al_emit_user_event(&(game->event_source), &ev, NULL);
+			return;
+		case VETO_RECORD_STRING:
+			ev.user.data1 = (intptr_t)str;
+			VetoLog(game, record->log, str);
+			EmitBufferEvent(game, &ev, buffer);
+			return;
+		case VETO_RECORD_WINNER:
+			ev.user.data1 = number;
+			ev.user.data2 = (intptr_t)str;
+			VetoLog(game, record->log, (int)number, str);
+			EmitBufferEvent(game, &ev, buffer);
+			return;
+	}
+}
+
+static void VetoTextRecordHandler(struct Game* game, struct WebSocketBuffer* buffer, char* msg) {
+	const struct VetoRecord* record = &VetoRecords[(unsigned char)msg[0]];
+
+	switch (record->kind) {
+		case VETO_RECORD_UNKNOWN:
+			return;
+		case VETO_RECORD_PLAIN:
+			EmitRecord(game, buffer, record, 0, NULL);
+			return;
+		case VETO_RECORD_NUMBER:
+			EmitRecord(game, buffer, record, ParseNumber(msg + 1), NULL);
+			return;
+		case VETO_RECORD_RESULT:
+			EmitRecord(game, buffer, record, msg[1] == 'F', NULL);
+			return;
+		case VETO_RECORD_STRING:
+			EmitRecord(game, buffer, record, 0, msg + 1);
+			return;
+		case VETO_RECORD_WINNER:
+			if (msg[1]) {
+				EmitRecord(game, buffer, record, msg[1] - '0', msg + 2);
+			}
+			return;
+		case VETO_RECORD_SNAPSHOT: {
+			// comma-separated numbers, then the winners each prefixed with \x1f
+			intptr_t numbers[VETO_SNAPSHOT_NUMBERS] = {0};
+			char* winners[4] = {"", "", "", ""};
+			char* pos = msg + 1;
+			for (int i = 0; i < VETO_SNAPSHOT_NUMBERS; i++) {
+				numbers[i] = ParseNumber(pos);
+				pos += strcspn(pos, ",\x1f");
+				if (*pos == ',') {
+					pos++;
+				}
+			}
+			for (int i = 0; i < 4 && *pos == '\x1f'; i++) {
+				*pos++ = '\0';
+				winners[i] = pos;
+				pos += strcspn(pos, "\x1f");
+			}
+			EmitSnapshot(game, buffer, record, numbers, winners);
+			return;
+		}
+		case VETO_RECORD_TIMESTAMP:
+			WebSocketStatsTimestamp(game, buffer, strtod(msg + 1, NULL));
+			return;
+		case VETO_RECORD_NICK:
+			if (strchr(msg, ':')) {
+				VetoStoreNick(game, record, ParseNumber(msg + 1), strchr(msg, ':') + 1);
+			}
+			return;
+		case VETO_RECORD_PLAYER:
+			EmitPlayer(game, record, ParseNumber(msg + 1));
+			return;
+		case VETO_RECORD_TALLY: {
+			intptr_t numbers[3] = {0};
+			ParseNumbers(msg + 1, numbers, 3);
+			EmitTally(game, record, numbers);
+			return;
+		}
+		case VETO_RECORD_DEADLINE: {
+			intptr_t numbers[2] = {0};
+			ParseNumbers(msg + 1, numbers, 2);
+			EmitDeadline(game, buffer, record, numbers[0], numbers[1]);
+			return;
+		}
+		case VETO_RECORD_CLOCK: {
+			intptr_t numbers[2] = {0};
+			ParseNumbers(msg + 1, numbers, 2);
+			VetoClockSample(game, buffer, numbers[0], numbers[1]);
+			return;
+		}
+		case VETO_RECORD_REJECTED:
+			VetoRejected(game, msg + 1);
+			return;
+		case VETO_RECORD_LEADERBOARD: {
+			// each entry is \x1f, then the score, a colon and the nick
+			struct VetoLeaderboard* leaderboard = calloc(1, sizeof(struct VetoLeaderboard));
+			char* pos = msg + 1;
+			bool more = (*pos == '\x1f');
+			while (more && leaderboard->count < VETO_LEADERBOARD_SIZE) {
+				pos++;
+				leaderboard->score[leaderboard->count] = ParseNumber(pos);
+				pos += strcspn(pos, ":\x1f");
+				if (*pos == ':') {
+					pos++;
+				}
+				leaderboard->name[leaderboard->count++] = pos;
+				pos += strcspn(pos, "\x1f");
+				more = (*pos == '\x1f');
+				*pos = '\0';
+			}
+			EmitLeaderboard(game, buffer, record, leaderboard);
+			return;
+		}
+	}
+}
+
+// veto-bin frames hold one or more records: an opcode (the same character as the text protocol
+// uses) followed by a payload of a fixed shape. See server/proto.js.
+static void VetoBinaryHandler(struct Game* game, struct WebSocketBuffer* buffer) {
+	unsigned char* pos = (unsigned char*)buffer->data;
+	unsigned char* end = pos + buffer->length;
+
+	while (pos < end) {
+		unsigned char opcode = *pos++;
+		const struct VetoRecord* record = &VetoRecords[opcode];
+		uintmax_t value = 0;
+		intptr_t number = 0;
+		char* str = NULL;
+
+		switch (record->kind) {
+			case VETO_RECORD_UNKNOWN:
+				// not for the monitor, but as long as protocol.c knows its shape the rest still counts
+				if (!VetoSkipPayload(opcode, &pos, end)) {
+					VetoLog(game, "[veto] unknown opcode %d", opcode);
+					return;
+				}
+				continue;
+			case VETO_RECORD_PLAIN:
+				break;
+			case VETO_RECORD_NUMBER:
+			case VETO_RECORD_PLAYER:
+				if (!VetoReadVarint(&pos, end, &value)) {
+					return;
+				}
+				number = (intptr_t)(value >> 1) ^ -(intptr_t)(value & 1); // zigzag
+				break;
+			case VETO_RECORD_NICK:
+				if (!VetoReadVarint(&pos, end, &value) || !(str = VetoReadString(&pos, end))) {
+					return;
+				}
+				VetoStoreNick(game, record, (intptr_t)(value >> 1) ^ -(intptr_t)(value & 1), str);
+				continue;
+			case VETO_RECORD_TALLY: {
+				intptr_t numbers[3];
+				if (!VetoReadNumbers(&pos, end, numbers, 3)) {
+					return;
+				}
+				EmitTally(game, record, numbers);
+				continue;
+			}
+			case VETO_RECORD_DEADLINE:
+			case VETO_RECORD_CLOCK: {
+				intptr_t numbers[2];
+				if (!VetoReadNumbers(&pos, end, numbers, 2)) {
+					return;
+				}
+				if (record->kind == VETO_RECORD_DEADLINE) {
+					EmitDeadline(game, buffer, record, numbers[0], numbers[1]);
+				} else {
+					VetoClockSample(game, buffer, numbers[0], numbers[1]);
+				}
+				continue;
+			}
+			case VETO_RECORD_LEADERBOARD: {
+				struct VetoLeaderboard* leaderboard = calloc(1, sizeof(struct VetoLeaderboard));
+				uintmax_t count;
+				if (!VetoReadVarint(&pos, end, &count)) {
+					free(leaderboard);
+					return;
+				}
+				for (uintmax_t i = 0; i < count; i++) {
+					char* name;
+					if (!VetoReadVarint(&pos, end, &value) || !(name = VetoReadString(&pos, end))) {
+						free(leaderboard);
+						return;
+					}
+					if (leaderboard->count < VETO_LEADERBOARD_SIZE) {
+						leaderboard->score[leaderboard->count] = (intptr_t)(value >> 1) ^ -(intptr_t)(value & 1);
+						leaderboard->name[leaderboard->count++] = name;
+					}
+				}
+				EmitLeaderboard(game, buffer, record, leaderboard);
+				continue;
+			}
+			case VETO_RECORD_RESULT:
+			case VETO_RECORD_WINNER:
+				if (pos >= end) {
+					return;
+				}
+				number = *pos++;
+				if (record->kind == VETO_RECORD_WINNER && !(str = VetoReadString(&pos, end))) {
+					return;
+				}
+				break;
+			case VETO_RECORD_STRING:
+				if (!(str = VetoReadString(&pos, end))) {
+					return;
+				}
+				break;
+			case VETO_RECORD_REJECTED:
+				if (!(str = VetoReadString(&pos, end))) {
+					return;
+				}
+				VetoRejected(game, str);
+				continue;
+			case VETO_RECORD_SNAPSHOT: {
+				intptr_t numbers[VETO_SNAPSHOT_NUMBERS];
+				char* winners[4];
+				for (int i = 0; i < VETO_SNAPSHOT_NUMBERS; i++) {
+					if (!VetoReadVarint(&pos, end, &value)) {
+						return;
+					}
+					numbers[i] = (intptr_t)(value >> 1) ^ -(intptr_t)(value & 1);
+				}
+				for (int i = 0; i < 4; i++) {
+					if (!(winners[i] = VetoReadString(&pos, end))) {
+						return;
+					}
+				}
+				EmitSnapshot(game, buffer, record, numbers, winners);
+				continue;
+			}
+			case VETO_RECORD_TIMESTAMP:
+				if (!VetoReadVarint(&pos, end, &value)) {
+					return;
+				}
+				WebSocketStatsTimestamp(game, buffer, (double)(value >> 1)); // never negative
+				continue;
+		}
+		EmitRecord(game, buffer, record, number, str);
+	}
+}
+
+// A text frame holds one or more records separated by newlines. They are terminated in place,
+// so string events can point straight into the buffer.
+static void VetoProtocolHandler(struct Game* game, struct WebSocketBuffer* buffer) {
+	if (buffer->binary) {
+		VetoBinaryHandler(game, buffer);
 		return;
 	}
-	if (msg[0] == 'R') {
-		ev.user.type = VETO_EVENT_RECONNECT;
-		ev.user.data1 = (intptr_t)strdup(msg + 1);
-		PrintConsole(game, "[veto] player %s reconnected", ev.user.data1);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+
+	char* msg = buffer->data;
+	char* end = buffer->data + buffer->length;
+
+	while (msg < end) {
+		char* next = memchr(msg, '\n', end - msg);
+		if (next) {
+			*next = '\0';
+		} else {
+			next = end;
+		}
+		VetoTextRecordHandler(game, buffer, msg);
+		msg = next + 1;
+	}
+}
+
+// Capture files hold every message the monitor received, so a show can be played back later without
+// a server (--replay). After an 8 byte magic, each message is:
+//   32-bit LE - us since the previous one was received, 0 for the first
+//   32-bit LE - length, with the top bit set for binary messages
+//   the message itself
+
+#define CAPTURE_MAGIC "VETOCAP1"
+#define CAPTURE_BINARY 0x80000000u
+
+static void CaptureOpen(struct Game* game) {
+	char filename[64];
+	time_t now = time(NULL);
+	strftime(filename, sizeof(filename), "capture-%Y%m%d-%H%M%S.vcap", localtime(&now));
+	ALLEGRO_PATH* path = al_get_standard_path(ALLEGRO_USER_DATA_PATH);
+	al_make_directory(al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+	al_set_path_filename(path, filename);
+	game->data->capture = al_fopen(al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP), "wb");
+	if (game->data->capture) {
+		PrintConsole(game, "[ws] Capturing received messages to %s", al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+		al_fwrite(game->data->capture, CAPTURE_MAGIC, 8);
+		game->data->capture_at = 0;
+	} else {
+		PrintConsole(game, "[ws] Failed to open %s!", al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+	}
+	al_destroy_path(path);
+}
+
+static void CaptureMessage(struct Game* game, struct WebSocketBuffer* buffer) {
+	double delta = game->data->capture_at ? (buffer->received - game->data->capture_at) * 1000000 : 0;
+	if (delta < 0) {
+		delta = 0;
+	}
+	if (delta > UINT32_MAX) {
+		delta = UINT32_MAX;
+	}
+	game->data->capture_at = buffer->received;
+	al_fwrite32le(game->data->capture, (uint32_t)delta);
+	al_fwrite32le(game->data->capture, (uint32_t)buffer->length | (buffer->binary ? CAPTURE_BINARY : 0));
+	al_fwrite(game->data->capture, buffer->data, buffer->length);
+}
+
+static void ReceiveQueueProcess(struct Game* game) {
+	struct WebSocketReceiveQueue* queue = &game->data->ws_incoming;
+
+	// cleared before draining, so anything pushed from now on wakes us up again
+	__atomic_store_n(&queue->wakeup, false, __ATOMIC_SEQ_CST);
+
+	unsigned int tail = queue->tail;
+	while (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+		struct WebSocketBuffer* buffer = queue->messages[tail % WS_RECEIVE_QUEUE_LENGTH];
+		if (buffer->binary) {
+			VetoLog(game, "[ws] Incoming message (%d bytes)", (int)buffer->length);
+		} else {
+			VetoLog(game, "[ws] Incoming message (%d): %s", (int)buffer->length, buffer->data);
+		}
+		if (game->data->capture) {
+			CaptureMessage(game, buffer);
+		}
+		double dispatch = (al_get_time() - buffer->received) * 1000;
+		game->data->ws_stats.dispatch = dispatch;
+		if (dispatch > game->data->ws_stats.dispatch_max) {
+			game->data->ws_stats.dispatch_max = dispatch;
+		}
+		VetoProtocolHandler(game, buffer);
+		// events emitted from it hold their own references
+		BufferRelease(&game->data->ws_pool, buffer);
+		tail++;
+		__atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+// Link statistics. Counters are kept by the network thread; once per second the render thread turns
+// them into rates and optionally appends a line to the CSV.
+
+static ALLEGRO_FILE* OpenCSV(struct Game* game, const char* filename, const char* what) {
+	ALLEGRO_PATH* path = al_get_standard_path(ALLEGRO_USER_DATA_PATH);
+	al_make_directory(al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+	al_set_path_filename(path, filename);
+	ALLEGRO_FILE* csv = al_fopen(al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP), "w");
+	if (csv) {
+		PrintConsole(game, "Writing %s to %s", what, al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+	} else {
+		PrintConsole(game, "Failed to open %s!", al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+	}
+	al_destroy_path(path);
+	return csv;
+}
+
+static void WebSocketStatsOpenCSV(struct Game* game) {
+	game->data->ws_stats.csv = OpenCSV(game, "netstats.csv", "link statistics");
+	if (game->data->ws_stats.csv) {
+		al_fprintf(game->data->ws_stats.csv, "time,connected,rtt_ms,delay_ms,jitter_ms,dispatch_max_ms,rx_msgs_s,rx_bytes_s,tx_msgs_s,tx_bytes_s,send_queue,send_queue_max,receive_queue\n");
+	}
+}
+
+static void WebSocketStatsSample(struct Game* game) {
+	struct WebSocketStats* stats = &game->data->ws_stats;
+	double now = al_get_time();
+	double elapsed = now - stats->sampled_at;
+	if (elapsed < 1.0) {
 		return;
 	}
-	if (msg[0] == 'W') {
-		ev.user.type = VETO_EVENT_WINNER;
-		ev.user.data1 = msg[1] - '0';
-		ev.user.data2 = (intptr_t)strdup(msg + 2);
-		PrintConsole(game, "[veto] winner nr %d is %s", ev.user.data1, ev.user.data2);
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+	if (!stats->sampled_at && strtol(GetConfigOptionDefault(game, "veto", "netstats_csv", "0"), NULL, 10)) {
+		WebSocketStatsOpenCSV(game);
+	}
+
+	uint64_t rx_messages = __atomic_load_n(&stats->rx_messages, __ATOMIC_RELAXED);
+	uint64_t rx_bytes = __atomic_load_n(&stats->rx_bytes, __ATOMIC_RELAXED);
+	uint64_t tx_messages = __atomic_load_n(&stats->tx_messages, __ATOMIC_RELAXED);
+	uint64_t tx_bytes = __atomic_load_n(&stats->tx_bytes, __ATOMIC_RELAXED);
+	stats->rx_messages_rate = (rx_messages - stats->last_rx_messages) / elapsed;
+	stats->rx_bytes_rate = (rx_bytes - stats->last_rx_bytes) / elapsed;
+	stats->tx_messages_rate = (tx_messages - stats->last_tx_messages) / elapsed;
+	stats->tx_bytes_rate = (tx_bytes - stats->last_tx_bytes) / elapsed;
+	stats->last_rx_messages = rx_messages;
+	stats->last_rx_bytes = rx_bytes;
+	stats->last_tx_messages = tx_messages;
+	stats->last_tx_bytes = tx_bytes;
+
+	stats->send_depth = SendQueueDepth(&game->data->ws_queue);
+	stats->send_depth_max = game->data->ws_queue.depth_max;
+	stats->receive_depth = __atomic_load_n(&game->data->ws_incoming.head, __ATOMIC_ACQUIRE) - game->data->ws_incoming.tail;
+
+	if (stats->csv) {
+		al_fprintf(stats->csv, "%.3f,%d,%.3f,%.3f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%u,%u,%u\n", now, game->data->ws_connected,
+			__atomic_load_n(&stats->rtt, __ATOMIC_RELAXED) / 1000.0, stats->delay, stats->delay - stats->delay_min, stats->dispatch_max,
+			stats->rx_messages_rate, stats->rx_bytes_rate, stats->tx_messages_rate, stats->tx_bytes_rate,
+			stats->send_depth, stats->send_depth_max, stats->receive_depth);
+		al_fflush(stats->csv);
+	}
+	if (game->data->capture) {
+		al_fflush(game->data->capture);
+	}
+
+	stats->dispatch_max = 0; // worst case within each second
+	stats->sampled_at = now;
+}
+
+// Frame time profile. Durations of the sections go into fixed histograms with 8 buckets per octave,
+// so the percentiles are within 5% or so; once per second those become p50, p99 and max for the
+// overlay and optionally a line in the CSV. Meant for attributing hitches of the 60 Hz output.
+
+const char* ProfileSectionNames[PROFILE_SECTIONS] = {"frame", "logic", "timeline", "draw", "event", "protocol", "network"};
+
+static void ProfileRecord(struct ProfileSection* section, double us) {
+	unsigned int bucket = (us < 1) ? 0 : (unsigned int)(8 * log2(us)) + 1;
+	if (bucket >= PROFILE_BUCKETS) {
+		bucket = PROFILE_BUCKETS - 1;
+	}
+	__atomic_fetch_add(&section->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+	unsigned int value = us;
+	unsigned int max = __atomic_load_n(&section->max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&section->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+// start is the al_get_time() the section was entered at
+void ProfileEnd(struct Game* game, PROFILE_SECTION section, double start) {
+	ProfileRecord(&game->data->profile.sections[section], (al_get_time() - start) * 1000000);
+}
+
+// The engine calls these around Gamestate_Logic and Gamestate_Draw of all the running gamestates,
+// see main.c.
+void ProfilePreLogic(struct Game* game, double delta) {
+	struct Profile* profile = &game->data->profile;
+	profile->logic_at = al_get_time();
+	profile->timeline = 0;
+	profile->timelines = 0;
+}
+
+void ProfilePostLogic(struct Game* game, double delta) {
+	struct Profile* profile = &game->data->profile;
+	ProfileEnd(game, PROFILE_LOGIC, profile->logic_at);
+	if (profile->timelines) {
+		ProfileRecord(&profile->sections[PROFILE_TIMELINE], profile->timeline * 1000000);
+	}
+}
+
+void ProfilePreDraw(struct Game* game) {
+	struct Profile* profile = &game->data->profile;
+	double now = al_get_time();
+	if (profile->frame_at) {
+		ProfileRecord(&profile->sections[PROFILE_FRAME], (now - profile->frame_at) * 1000000);
+	}
+	profile->frame_at = now;
+}
+
+void ProfilePostDraw(struct Game* game) {
+	ProfileEnd(game, PROFILE_DRAW, game->data->profile.frame_at);
+}
+
+// For the gamestates to use instead of TM_Process; all of them within a logic tick add up to one
+// PROFILE_TIMELINE sample.
+void ProfileTimeline(struct Game* game, struct Timeline* timeline) {
+	double start = al_get_time();
+	TM_Process(timeline);
+	game->data->profile.timeline += al_get_time() - start;
+	game->data->profile.timelines++;
+}
+
+static double ThreadTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// One round of lws_service on the network thread, along with the embedded server's own work when
+// there's one. lws_service sleeps in poll until there's something to do or the timeout passes, so
+// it's the CPU time of the thread that counts as PROFILE_NETWORK rather than the wall clock.
+static void WebSocketService(struct Game* game) {
+	double start = ThreadTime();
+	if (game->data->ws_server) {
+		if (game->data->ws_established) {
+			SendQueueDeliverLocal(game, &game->data->ws_queue);
+		}
+		lws_service(game->data->ws_context, EmbeddedServerService(game, 50));
+		EmbeddedServerFlush(game);
+	} else {
+		// woken up early by lws_cancel_service
+		lws_service(game->data->ws_context, 50);
+	}
+	ProfileRecord(&game->data->profile.sections[PROFILE_NETWORK], (ThreadTime() - start) * 1000000);
+}
+
+// in ms, the middle of the bucket the given fraction of the samples falls into
+static double ProfilePercentile(struct ProfileSection* section, double fraction) {
+	unsigned int target = ceil(section->count * fraction), seen = 0;
+	if (!target) {
+		return 0;
+	}
+	for (int i = 0; i < PROFILE_BUCKETS; i++) {
+		seen += section->last[i];
+		if (seen >= target) {
+			double middle = i ? pow(2, (i - 0.5) / 8.0) / 1000.0 : 0;
+			return middle < section->worst ? middle : section->worst;
+		}
+	}
+	return section->worst;
+}
+
+static void ProfileOpenCSV(struct Game* game) {
+	ALLEGRO_FILE* csv = OpenCSV(game, "profile.csv", "frame time profile");
+	if (!csv) {
 		return;
 	}
-	if (msg[0] == 'T') {
-		ev.user.type = VETO_EVENT_THE_END;
-		ev.user.data1 = (intptr_t)strdup(msg + 1);
-		PrintConsole(game, "[veto] the end");
-		al_emit_user_event(&(game->event_source), &ev, NULL);
+	al_fprintf(csv, "time");
+	for (int i = 0; i < PROFILE_SECTIONS; i++) {
+		al_fprintf(csv, ",%s_count,%s_p50_ms,%s_p99_ms,%s_max_ms", ProfileSectionNames[i], ProfileSectionNames[i], ProfileSectionNames[i], ProfileSectionNames[i]);
+	}
+	al_fprintf(csv, "\n");
+	game->data->profile.csv = csv;
+}
+
+static void ProfileSample(struct Game* game) {
+	struct Profile* profile = &game->data->profile;
+	double now = al_get_time();
+	if (now - profile->sampled_at < 1.0) {
 		return;
 	}
+	if (!profile->sampled_at && strtol(GetConfigOptionDefault(game, "veto", "profile_csv", "0"), NULL, 10)) {
+		ProfileOpenCSV(game);
+	}
 
-	// TODO: fix memory leaks in strdup, possibly using event destructors
+	for (int i = 0; i < PROFILE_SECTIONS; i++) {
+		struct ProfileSection* section = &profile->sections[i];
+		section->count = 0;
+		for (int j = 0; j < PROFILE_BUCKETS; j++) {
+			section->last[j] = __atomic_exchange_n(&section->buckets[j], 0, __ATOMIC_RELAXED);
+			section->count += section->last[j];
+		}
+		section->worst = __atomic_exchange_n(&section->max, 0, __ATOMIC_RELAXED) / 1000.0;
+		section->p50 = ProfilePercentile(section, 0.5);
+		section->p99 = ProfilePercentile(section, 0.99);
+	}
+
+	if (profile->csv) {
+		al_fprintf(profile->csv, "%.3f", now);
+		for (int i = 0; i < PROFILE_SECTIONS; i++) {
+			struct ProfileSection* section = &profile->sections[i];
+			al_fprintf(profile->csv, ",%u,%.3f,%.3f,%.3f", section->count, section->p50, section->p99, section->worst);
+		}
+		al_fprintf(profile->csv, "\n");
+		al_fflush(profile->csv);
+	}
+
+	profile->sampled_at = now;
 }
 
 bool GlobalEventHandler(struct Game* game, ALLEGRO_EVENT* event) {
-	if (game->data->ws) {
-		lws_service(game->data->ws_context, 0);
+	WebSocketStatsSample(game);
+	ProfileSample(game);
+
+	if (game->data->ws && game->data->ws_queue.overflow) {
+		if (SendQueueFlush(&game->data->ws_queue)) {
+			lws_cancel_service(game->data->ws_context);
+		}
 	}
 
-	if (event->type == WEBSOCKET_EVENT_DISCONNECTED) {
+	if (event->type == WEBSOCKET_EVENT_DISCONNECTED && (unsigned int)event->user.data1 == game->data->ws_session) {
+		// the network thread keeps retrying on its own until WebSocketDisconnect
 		if (game->data->ws_connected) {
-			PrintConsole(game, "[ws] Disconnected!");
+			PrintConsole(game, "[ws] Disconnected! Reconnecting in %.1fs...", event->user.data2 / 1000.0);
 		} else {
-			PrintConsole(game, "[ws] Connection failed!");
+			PrintConsole(game, "[ws] Connection failed! Retrying in %.1fs...", event->user.data2 / 1000.0);
 		}
 		game->data->ws_connected = false;
-		if (game->data->ws) {
-			// reconnecting
-			game->data->ws = false;
-			//WebSocketConnect(game); TODO: schedule reconnection
-		}
 	}
-	if (event->type == WEBSOCKET_EVENT_CONNECTED) {
-		PrintConsole(game, "[ws] Connected!");
+	if (event->type == WEBSOCKET_EVENT_CONNECTED && (unsigned int)event->user.data1 == game->data->ws_session) {
+		game->data->ws_connect_time = event->user.data2 / 1000.0;
+		game->data->ws_clock_rtt = -1; // may be a restarted server with a clock of its own
+		PrintConsole(game, "[ws] Connected in %d ms!", (int)event->user.data2);
 		game->data->ws_connected = true;
 	}
-	if (event->type == WEBSOCKET_EVENT_INCOMING_MESSAGE) {
-		PrintConsole(game, "[ws] Incoming message (%d): %s", event->user.data2, event->user.data1);
-		VetoProtocolHandler(game, (char*)event->user.data1, event->user.data2);
+	if (event->type == WEBSOCKET_EVENT_INCOMING_MESSAGE && game->data->ws) {
+		double start = al_get_time();
+		ReceiveQueueProcess(game);
+		ProfileEnd(game, PROFILE_PROTOCOL, start);
 	}
-	if (event->type == WEBSOCKET_EVENT_CONNECTING) {
+	if (event->type == WEBSOCKET_EVENT_CONNECTING && (unsigned int)event->user.data1 == game->data->ws_session) {
 		PrintConsole(game, "[ws] Connecting...");
 	}
 
@@ -248,22 +1352,157 @@ bool GlobalEventHandler(struct Game* game, ALLEGRO_EVENT* event) {
 		PrintConsole(game, "Fullscreen toggled");
 	}
 
+	if ((event->type == ALLEGRO_EVENT_KEY_DOWN) && (event->keyboard.keycode == ALLEGRO_KEY_L)) {
+		game->data->verbose = !game->data->verbose;
+		SetConfigOption(game, "veto", "verbose", game->data->verbose ? "1" : "0");
+		PrintConsole(game, "Protocol logging %s", game->data->verbose ? "enabled" : "disabled");
+	}
+
+	if ((event->type == ALLEGRO_EVENT_KEY_DOWN) && (event->keyboard.keycode == ALLEGRO_KEY_I)) {
+		game->data->netstats = !game->data->netstats;
+		SetConfigOption(game, "veto", "netstats", game->data->netstats ? "1" : "0");
+	}
+
+	if ((event->type == ALLEGRO_EVENT_KEY_DOWN) && (event->keyboard.keycode == ALLEGRO_KEY_P)) {
+		game->data->profiling = !game->data->profiling;
+		SetConfigOption(game, "veto", "profile", game->data->profiling ? "1" : "0");
+	}
+
 	return false;
 }
 
-static void* WebSocketConnectThread(void* d) {
-	struct WebSocketConnectThreadData* data = d;
-	data->game->data->ws_socket = lws_client_connect_via_info(data->ccinfo);
-	free(data->ccinfo);
+// Looking the host up is the only blocking part of connecting, so it's done once and the address
+// gets reused by every following attempt until one of them fails.
+static bool WebSocketResolve(struct Game* game, const char* host) {
+	if (game->data->ws_address[0] && game->data->ws_address_host && strcmp(game->data->ws_address_host, host) == 0) {
+		return true;
+	}
+
+	double start = al_get_time();
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo* result = NULL;
+	if (getaddrinfo(host, NULL, &hints, &result) != 0 || !result) {
+		PrintConsole(game, "[ws] Failed to resolve %s!", host);
+		return false;
+	}
+	void* addr = (result->ai_family == AF_INET6) ? (void*)&((struct sockaddr_in6*)result->ai_addr)->sin6_addr : (void*)&((struct sockaddr_in*)result->ai_addr)->sin_addr;
+	bool success = inet_ntop(result->ai_family, addr, game->data->ws_address, sizeof(game->data->ws_address)) != NULL;
+	freeaddrinfo(result);
+	if (!success) {
+		game->data->ws_address[0] = '\0';
+		return false;
+	}
+
+	free(game->data->ws_address_host);
+	game->data->ws_address_host = strdup(host);
+	VetoLog(game, "[ws] %s resolved to %s in %d ms", host, game->data->ws_address, (int)((al_get_time() - start) * 1000));
+	return true;
+}
+
+static void WebSocketAttempt(struct Game* game, struct WebSocketThreadData* data) {
+	ALLEGRO_EVENT ev;
+	ev.user.type = WEBSOCKET_EVENT_CONNECTING;
+	ev.user.data1 = game->data->ws_session;
+	al_emit_user_event(&(game->event_source), &ev, NULL);
+
+	game->data->ws_attempt_at = al_get_time();
+	if (!WebSocketResolve(game, data->host)) {
+		WebSocketConnectionLost(game);
+		return;
+	}
+	data->ccinfo.address = game->data->ws_address;
+
+	// returns right away; the rest of the handshake happens in lws_service, bounded by veto/connect_timeout
+	game->data->ws_socket = lws_client_connect_via_info(&data->ccinfo);
+	// unless CONNECTION_ERROR has already been called from within and rescheduled it
+	if (!game->data->ws_socket && al_get_time() >= game->data->ws_retry_at) {
+		WebSocketConnectionLost(game);
+	}
+}
+
+static void* WebSocketThread(ALLEGRO_THREAD* thread, void* d) {
+	struct WebSocketThreadData* data = d;
+	struct Game* game = data->game;
+	double stop_at = 0;
+
+	while (true) {
+		if (al_get_thread_should_stop(thread)) {
+			// the context outlives this thread, so leave it without a connection
+			if (!stop_at) {
+				stop_at = al_get_time();
+			}
+			if (!game->data->ws_socket || al_get_time() - stop_at > WS_STOP_TIMEOUT) {
+				break;
+			}
+			// gets closed from the callback, as ws is already false
+			lws_callback_on_writable(game->data->ws_socket);
+		} else if (!game->data->ws_socket && al_get_time() >= game->data->ws_retry_at) {
+			WebSocketAttempt(game, data);
+		}
+		// the next ping only once the last one got its pong, or the round trip would be measured from the wrong one
+		if (game->data->ws_established && game->data->ws_ping_interval && !game->data->ws_ping && game->data->ws_pong &&
+			al_get_time() - game->data->ws_ping_at >= game->data->ws_ping_interval) {
+			game->data->ws_ping = true;
+			game->data->ws_clock = true;
+			lws_callback_on_writable(game->data->ws_socket);
+		}
+		if (game->data->ws_established && game->data->ws_binary && !game->data->ws_greet_basic && game->data->ws_greeted_at) {
+			// a server older than the 0x0a registration ignores or rejects it; ask the way it knows
+			int registered = __atomic_load_n(&game->data->ws_registered, __ATOMIC_RELAXED);
+			if (registered < 0 || (!registered && al_get_time() - game->data->ws_greeted_at > WS_REGISTER_TIMEOUT)) {
+				PrintConsole(game, "[ws] Server didn't take the monitor options, registering without them.");
+				game->data->ws_greet_basic = true;
+				game->data->ws_greet = true;
+				game->data->ws_greeted_at = 0;
+				lws_callback_on_writable(game->data->ws_socket);
+			}
+		}
+		if (game->data->ws_established && SendRingDepth(&game->data->ws_queue)) {
+			lws_callback_on_writable(game->data->ws_socket);
+		}
+		WebSocketService(game);
+	}
+
 	free(data);
 	return NULL;
 }
 
-void WebSocketConnect(struct Game* game) {
-	if (game->data->ws) {
-		return;
+// With the embedded server there's no connection of our own, just the server to run, and it has to
+// keep running while the monitor is disconnected or the players would freeze. So this thread lives
+// from the first WebSocketConnect until DestroyGameData, and connecting and disconnecting only
+// attach the in-memory monitor to the server and detach it again.
+static void* EmbeddedServerThread(ALLEGRO_THREAD* thread, void* d) {
+	struct Game* game = d;
+
+	while (!al_get_thread_should_stop(thread)) {
+		al_lock_mutex(game->data->ws_monitor_mutex);
+		bool attached = game->data->ws;
+		if (attached && !game->data->ws_established) {
+			ALLEGRO_EVENT ev;
+			ev.user.type = WEBSOCKET_EVENT_CONNECTED;
+			ev.user.data1 = game->data->ws_session;
+			ev.user.data2 = 0;
+			al_emit_user_event(&(game->event_source), &ev, NULL);
+			EmbeddedServerMonitorCommand(game, VetoCommands[VETO_COMMAND_MONITOR].text, strlen(VetoCommands[VETO_COMMAND_MONITOR].text), false);
+		} else if (!attached && game->data->ws_established) {
+			EmbeddedServerDetachMonitor(game);
+		}
+		// WebSocketDisconnect waits for this to go false
+		__atomic_store_n(&game->data->ws_established, attached, __ATOMIC_RELEASE);
+		al_unlock_mutex(game->data->ws_monitor_mutex);
+
+		WebSocketService(game);
 	}
+	return NULL;
+}
+
+static const struct lws_extension extensions[] = {
+	{"permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate; client_max_window_bits"},
+	{NULL, NULL, NULL} /* terminator */
+};
 
+// The context is created once and kept for the whole run, shared by all the connections.
+static bool WebSocketCreateContext(struct Game* game) {
 	lws_set_log_level(LLL_ERR | LLL_WARN, NULL); // ERR | WARN
 
 	struct lws_context_creation_info info = {};
@@ -272,47 +1511,243 @@ void WebSocketConnect(struct Game* game) {
 	info.protocols = protocols;
 	info.gid = -1;
 	info.uid = -1;
+	info.timeout_secs = strtol(GetConfigOptionDefault(game, "veto", "connect_timeout", "10"), NULL, 10);
+	if (strtol(GetConfigOptionDefault(game, "veto", "deflate", "1"), NULL, 10)) {
+		// offered to the server, which decides on the parameters
+		info.extensions = extensions;
+	}
+
+	if (strtol(GetConfigOptionDefault(game, "veto", "embedded_server", "0"), NULL, 10)) {
+		// players connect straight to us; the server gets a vhost of its own, see server.c
+		info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+		info.user = game;
+	}
 
 	game->data->ws_context = lws_create_context(&info);
+	if (!game->data->ws_context) {
+		PrintConsole(game, "[ws] Failed to create context!");
+		return false;
+	}
+	if (info.options & LWS_SERVER_OPTION_EXPLICIT_VHOSTS) {
+		game->data->ws_server = EmbeddedServerCreate(game, game->data->ws_context);
+		if (!game->data->ws_server) {
+			lws_context_destroy(game->data->ws_context);
+			game->data->ws_context = NULL;
+			return false;
+		}
+	}
+	return true;
+}
 
-	struct lws_client_connect_info* ccinfo = calloc(1, sizeof(struct lws_client_connect_info));
+// The clock timeline delays and --replay go by: al_get_time(), unless veto-headless skipped it ahead
+// over time that would only have been waited through.
+double GameTime(struct Game* game) {
+	return al_get_time() + __atomic_load_n(&game->data->time_skipped, __ATOMIC_ACQUIRE) / 1000000.0;
+}
+
+void SkipTime(struct Game* game, double until) {
+	al_lock_mutex(game->data->time_mutex);
+	double skip = until - GameTime(game);
+	if (skip > 0) {
+		__atomic_add_fetch(&game->data->time_skipped, (int64_t)ceil(skip * 1000000), __ATOMIC_ACQ_REL);
+		al_broadcast_cond(game->data->time_skipped_cond);
+	}
+	al_unlock_mutex(game->data->time_mutex);
+}
 
+// Stands in for the network thread with --replay: feeds a capture to the render thread the same way,
+// paced by its timestamps divided by replay_speed. Whatever gets sent meanwhile is dropped.
+static void* ReplayThread(ALLEGRO_THREAD* thread, void* d) {
+	struct Game* game = d;
+	ALLEGRO_EVENT ev;
+	unsigned int count = 0;
+	char magic[8];
+
+	ALLEGRO_FILE* file = al_fopen(game->data->replay, "rb");
+	if (!file || al_fread(file, magic, 8) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+		PrintConsole(game, "[replay] %s is not a capture file!", game->data->replay);
+	} else {
+		ev.user.type = WEBSOCKET_EVENT_CONNECTED;
+		ev.user.data1 = game->data->ws_session;
+		ev.user.data2 = 0;
+		al_emit_user_event(&(game->event_source), &ev, NULL);
+
+		double start = al_get_time(), due = GameTime(game);
+		char chunk[4096];
+		while (!al_get_thread_should_stop(thread)) {
+			uint32_t delta = al_fread32le(file);
+			uint32_t header = al_fread32le(file);
+			if (al_feof(file) || al_ferror(file)) {
+				break;
+			}
+
+			struct WebSocketBuffer* buffer = BufferAcquire(&game->data->ws_pool);
+			size_t length = header & ~CAPTURE_BINARY;
+			while (buffer->length < length) {
+				size_t size = length - buffer->length < sizeof(chunk) ? length - buffer->length : sizeof(chunk);
+				size_t read = al_fread(file, chunk, size);
+				BufferAppend(buffer, chunk, read);
+				if (read < size) {
+					break;
+				}
+			}
+			if (buffer->length < length) {
+				// cut short, like the last message of a capture that didn't get closed
+				BufferRelease(&game->data->ws_pool, buffer);
+				break;
+			}
+			buffer->binary = header & CAPTURE_BINARY;
+
+			if (game->data->replay_speed > 0) {
+				due += delta / 1000000.0 / game->data->replay_speed;
+				// in small steps, a capture may have gaps of hours; SkipTime cuts them short
+				al_lock_mutex(game->data->time_mutex);
+				__atomic_store_n(&game->data->replay_due, (int64_t)(due * 1000000), __ATOMIC_RELEASE);
+				double wait;
+				while ((wait = due - GameTime(game)) > 0 && !al_get_thread_should_stop(thread)) {
+					ALLEGRO_TIMEOUT timeout;
+					al_init_timeout(&timeout, wait < 0.05 ? wait : 0.05);
+					al_wait_cond_until(game->data->time_skipped_cond, game->data->time_mutex, &timeout);
+				}
+				__atomic_store_n(&game->data->replay_due, -1, __ATOMIC_RELEASE);
+				al_unlock_mutex(game->data->time_mutex);
+			}
+
+			buffer->received = al_get_time();
+			__atomic_add_fetch(&game->data->ws_stats.rx_bytes, length, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&game->data->ws_stats.rx_messages, 1, __ATOMIC_RELAXED);
+			ReceiveQueuePush(game, buffer);
+			count++;
+		}
+		PrintConsole(game, "[replay] %u messages in %.1f s", count, al_get_time() - start);
+
+		// so REPLAY_DONE comes after the events of the last messages, not before they're decoded
+		struct WebSocketReceiveQueue* queue = &game->data->ws_incoming;
+		while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) != queue->head && !al_get_thread_should_stop(thread)) {
+			al_rest(0.001);
+		}
+	}
+	__atomic_store_n(&game->data->replay_due, 0, __ATOMIC_RELEASE);
+	if (file) {
+		al_fclose(file);
+	}
+
+	ev.user.type = WEBSOCKET_EVENT_REPLAY_DONE;
+	ev.user.data1 = game->data->ws_session;
+	ev.user.data2 = count;
+	al_emit_user_event(&(game->event_source), &ev, NULL);
+	return NULL;
+}
+
+void WebSocketConnect(struct Game* game) {
+	if (game->data->ws) {
+		return;
+	}
+
+	if (game->data->replay) {
+		game->data->ws = true;
+		game->data->ws_session++;
+		// nothing is to be skipped over until the first message is read and waited for
+		game->data->replay_due = game->data->replay_speed > 0 ? -1 : 0;
+		game->data->ws_thread = al_create_thread(ReplayThread, game);
+		al_start_thread(game->data->ws_thread);
+		return;
+	}
+
+	if (!game->data->capture && strtol(GetConfigOptionDefault(game, "veto", "capture", "0"), NULL, 10)) {
+		CaptureOpen(game);
+	}
+
+	if (!game->data->ws_context && !WebSocketCreateContext(game)) {
+		return;
+	}
+	game->data->ws_binary = (strcmp(GetConfigOptionDefault(game, "veto", "protocol", "veto"), "veto-bin") == 0);
+
+	if (game->data->ws_server) {
+		game->data->ws_session++;
+		al_lock_mutex(game->data->ws_monitor_mutex);
+		game->data->ws = true;
+		al_unlock_mutex(game->data->ws_monitor_mutex);
+		if (!game->data->ws_thread) {
+			game->data->ws_thread = al_create_thread(EmbeddedServerThread, game);
+			al_start_thread(game->data->ws_thread);
+		}
+		lws_cancel_service(game->data->ws_context);
+		return;
+	}
+
+	struct WebSocketThreadData* data = calloc(1, sizeof(struct WebSocketThreadData));
+	struct lws_client_connect_info* ccinfo = &data->ccinfo;
+
+	data->host = GetConfigOptionDefault(game, "veto", "host", "dosowisko.net");
 	ccinfo->context = game->data->ws_context;
-	ccinfo->address = GetConfigOptionDefault(game, "veto", "host", "dosowisko.net");
+	// address is filled in with the resolved one for each attempt
 	ccinfo->port = strtol(GetConfigOptionDefault(game, "veto", "port", "8889"), NULL, 10);
 	ccinfo->path = GetConfigOptionDefault(game, "veto", "path", "/");
-	ccinfo->host = lws_canonical_hostname(game->data->ws_context);
+	ccinfo->host = data->host;
 	ccinfo->origin = "veto-monitor";
-	ccinfo->protocol = protocols[0].name;
+	ccinfo->protocol = protocols[game->data->ws_binary ? 1 : 0].name;
 	ccinfo->ietf_version_or_minus_one = -1;
 	ccinfo->userdata = game;
 
-	game->data->ws = true;
-	game->data->ws_buffer = NULL;
+	game->data->ws_backoff_min = strtod(GetConfigOptionDefault(game, "veto", "reconnect_min", "0.5"), NULL);
+	game->data->ws_backoff_max = strtod(GetConfigOptionDefault(game, "veto", "reconnect_max", "30"), NULL);
+	if (game->data->ws_backoff_min < 0.1) {
+		game->data->ws_backoff_min = 0.1;
+	}
+	game->data->ws_retries = 0;
+	game->data->ws_retry_at = 0;
+	game->data->ws_ping_interval = strtod(GetConfigOptionDefault(game, "veto", "ping_interval", "2"), NULL);
+	if (game->data->ws_ping_interval <= 0) {
+		game->data->ws_ping_interval = 0;
+	} else if (game->data->ws_ping_interval < WS_PING_MIN) {
+		game->data->ws_ping_interval = WS_PING_MIN;
+	}
 
-	ALLEGRO_EVENT ev;
-	ev.user.type = WEBSOCKET_EVENT_CONNECTING;
-	al_emit_user_event(&(game->event_source), &ev, NULL);
+	game->data->ws = true;
+	game->data->ws_session++;
 
-	struct WebSocketConnectThreadData* data = malloc(sizeof(struct WebSocketConnectThreadData));
 	data->game = game;
-	data->ccinfo = ccinfo;
-	al_run_detached_thread(WebSocketConnectThread, data);
+	game->data->ws_thread = al_create_thread(WebSocketThread, data);
+	al_start_thread(game->data->ws_thread);
 }
 
 void WebSocketSend(struct Game* game, char* msg) {
-	if (!game->data->ws_socket) {
+	if (!game->data->ws) {
 		PrintConsole(game, "[ws] Trying to send with no active connection: %s", msg);
 		return;
 	}
-	if (game->data->ws_buffer) {
-		PrintConsole(game, "[ws] Discarding previous buffer value! %s", game->data->ws_buffer);
-		free(game->data->ws_buffer);
-		game->data->ws_buffer = NULL;
+	if (game->data->replay) {
+		VetoLog(game, "[replay] No server to send to: %s", msg);
+		return;
+	}
+
+	// queued even while still connecting; flushed once the connection gets established
+	SendQueuePush(game, &game->data->ws_queue, msg, strlen(msg), false);
+	lws_cancel_service(game->data->ws_context);
+}
+
+void VetoSendCommand(struct Game* game, VETO_COMMAND_TYPE command) {
+	if (!game->data->ws || !game->data->ws_binary || game->data->replay) {
+		WebSocketSend(game, (char*)VetoCommands[command].text);
+		return;
 	}
-	game->data->ws_buffer = strdup(msg);
+	SendQueuePush(game, &game->data->ws_queue, &VetoCommands[command].opcode, 1, true);
+	lws_cancel_service(game->data->ws_context);
+}
 
-	lws_callback_on_writable(game->data->ws_socket);
+unsigned int WebSocketQueueDepth(struct Game* game) {
+	return SendQueueDepth(&game->data->ws_queue);
+}
+
+static void WebSocketStopThread(struct Game* game) {
+	al_set_thread_should_stop(game->data->ws_thread);
+	if (game->data->ws_context) {
+		lws_cancel_service(game->data->ws_context);
+	}
+	al_join_thread(game->data->ws_thread, NULL);
+	al_destroy_thread(game->data->ws_thread);
+	game->data->ws_thread = NULL;
 }
 
 void WebSocketDisconnect(struct Game* game) {
@@ -320,16 +1755,87 @@ void WebSocketDisconnect(struct Game* game) {
 		return;
 	}
 
-	lws_context_destroy(game->data->ws_context);
-	game->data->ws = false;
+	if (game->data->ws_server) {
+		// the server stays up for the players; only wait for the monitor to get detached from it
+		al_lock_mutex(game->data->ws_monitor_mutex);
+		game->data->ws = false;
+		al_unlock_mutex(game->data->ws_monitor_mutex);
+		lws_cancel_service(game->data->ws_context);
+		while (__atomic_load_n(&game->data->ws_established, __ATOMIC_ACQUIRE)) {
+			al_rest(0.001);
+		}
+	} else {
+		// from now on the callback closes the connection instead of handling it
+		game->data->ws = false;
+		WebSocketStopThread(game);
+	}
+
+	// the network thread is either gone or leaves the queues alone, so it's safe to touch what it owned
+	if (game->data->ws_socket) {
+		// didn't get closed in time; the only way left to get rid of it is taking the context down with it
+		PrintConsole(game, "[ws] Connection didn't close cleanly, recreating the context.");
+		lws_context_destroy(game->data->ws_context);
+		game->data->ws_context = NULL;
+		game->data->ws_socket = NULL;
+	}
+	game->data->ws_established = false;
+	game->data->ws_greet = false;
+	game->data->ws_ping = false;
+	game->data->ws_clock = false;
+
+	game->data->ws_connected = false;
+	SendQueueClear(&game->data->ws_queue);
+	ReceiveQueueClear(game);
 }
 
 struct CommonResources* CreateGameData(struct Game* game) {
 	struct CommonResources* data = calloc(1, sizeof(struct CommonResources));
+	data->ws_pool.mutex = al_create_mutex();
+	data->ws_monitor_mutex = al_create_mutex();
+	data->time_mutex = al_create_mutex();
+	data->time_skipped_cond = al_create_cond();
+	data->verbose = strtol(GetConfigOptionDefault(game, "veto", "verbose", "0"), NULL, 10);
+	data->netstats = strtol(GetConfigOptionDefault(game, "veto", "netstats", "0"), NULL, 10);
+	data->profiling = strtol(GetConfigOptionDefault(game, "veto", "profile", "0"), NULL, 10);
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	data->ws_wallclock_offset = now.tv_sec * 1000.0 + now.tv_usec / 1000.0 - al_get_time() * 1000;
+	data->ws_clock_rtt = -1;
 
 	return data;
 }
 
 void DestroyGameData(struct Game* game) {
+	WebSocketDisconnect(game);
+	if (game->data->ws_thread) {
+		// the embedded server's, see EmbeddedServerThread
+		WebSocketStopThread(game);
+	}
+	al_destroy_mutex(game->data->ws_monitor_mutex);
+	al_destroy_mutex(game->data->time_mutex);
+	al_destroy_cond(game->data->time_skipped_cond);
+	if (game->data->ws_context) {
+		lws_context_destroy(game->data->ws_context);
+	}
+	if (game->data->ws_server) {
+		EmbeddedServerDestroy(game, game->data->ws_server);
+	}
+	free(game->data->ws_address_host);
+	for (size_t i = 0; i < game->data->veto_nicks_count; i++) {
+		free(game->data->veto_nicks[i]);
+	}
+	free(game->data->veto_nicks);
+	if (game->data->ws_stats.csv) {
+		al_fclose(game->data->ws_stats.csv);
+	}
+	if (game->data->profile.csv) {
+		al_fclose(game->data->profile.csv);
+	}
+	if (game->data->capture) {
+		al_fclose(game->data->capture);
+	}
+	SendQueueClear(&game->data->ws_queue);
+	BufferPoolDestroy(&game->data->ws_pool);
 	free(game->data);
 }
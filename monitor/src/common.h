@@ -16,23 +16,211 @@
  */
 
 #define LIBSUPERDERPY_DATA_TYPE struct CommonResources
+#ifdef VETO_HEADLESS
+#include "headless.h"
+#else
 #include <libsuperderpy.h>
+#endif
 #include <libwebsockets.h>
 
+#define WS_SEND_QUEUE_LENGTH 32
+#define WS_SEND_SLOT_SIZE 256
+#define WS_RECEIVE_QUEUE_LENGTH 1024
+#define WS_BUFFER_POOL_SIZE 64
+#define WS_BUFFER_INITIAL_CAPACITY 256
+#define WS_BUFFER_MAX_POOLED_CAPACITY 16384
+
+struct WebSocketSendSlot {
+	unsigned char buffer[LWS_PRE + WS_SEND_SLOT_SIZE];
+	unsigned char* large; // LWS_PRE-padded heap copy for messages that don't fit into the buffer
+	size_t length;
+	bool binary;
+};
+
+struct WebSocketSendOverflow {
+	struct WebSocketSendOverflow* next;
+	size_t length;
+	bool binary;
+	unsigned char data[];
+};
+
+struct WebSocketSendQueue {
+	// single-producer (render thread), single-consumer (network thread) ring
+	// of preallocated slots, drained in order by LWS_CALLBACK_CLIENT_WRITEABLE
+	struct WebSocketSendSlot slots[WS_SEND_QUEUE_LENGTH];
+	unsigned int head, tail;
+	// messages that didn't fit into the ring; owned by the producer, never dropped,
+	// moved into the ring as soon as there's space for them
+	struct WebSocketSendOverflow *overflow, *overflow_last;
+	unsigned int overflow_length;
+
+	// stats
+	unsigned int depth_max;
+	unsigned int stalls; // sends that found the ring full
+	unsigned int sent;
+};
+
+struct WebSocketBuffer {
+	// one received message, reassembled from all of its fragments and null-terminated
+	char* data;
+	size_t length, capacity;
+	bool binary;
+	double received; // al_get_time() of its last fragment
+	unsigned int refs; // events pointing into data hold a reference each
+	struct WebSocketBuffer* next;
+};
+
+struct WebSocketBufferPool {
+	struct WebSocketBuffer* free;
+	unsigned int count;
+	ALLEGRO_MUTEX* mutex; // shared by the network thread (acquire) and event destructors (release)
+};
+
+struct WebSocketReceiveQueue {
+	// single-producer (network thread), single-consumer (render thread) ring
+	struct WebSocketBuffer* messages[WS_RECEIVE_QUEUE_LENGTH];
+	unsigned int head, tail;
+	bool wakeup; // whether the render thread has already been woken up for what's queued
+};
+
+struct WebSocketStats {
+	// written by the network thread, read atomically by the render thread
+	uint64_t rx_messages, rx_bytes, tx_messages, tx_bytes;
+	unsigned int rtt; // us, round trip of the last ping
+
+	// owned by the render thread, updated once per second by WebSocketStatsSample
+	double sampled_at;
+	uint64_t last_rx_messages, last_rx_bytes, last_tx_messages, last_tx_bytes;
+	double rx_messages_rate, rx_bytes_rate, tx_messages_rate, tx_bytes_rate; // per second
+	double delay, delay_min; // ms from server send timestamps to receiving; includes the clock offset
+	double dispatch, dispatch_max; // ms from receiving a message to handling it on the render thread
+	unsigned int send_depth, send_depth_max, receive_depth;
+	ALLEGRO_FILE* csv; // periodic dump to netstats.csv in the user data dir (veto/netstats_csv)
+};
+
+#define PROFILE_BUCKETS 160 // 8 per octave from 1 us, so the last one takes anything above ~0.9 s
+
+typedef enum {
+	PROFILE_FRAME, // from one frame drawn to the next, what ends up on the projector
+	PROFILE_LOGIC, // Gamestate_Logic of all the running gamestates, PROFILE_TIMELINE included
+	PROFILE_TIMELINE, // the timelines processed with ProfileTimeline within a logic tick
+	PROFILE_DRAW, // Gamestate_Draw of all the running gamestates
+	PROFILE_EVENT, // Gamestate_ProcessEvent of parliament; the engine has no hooks around those
+	PROFILE_PROTOCOL, // handling received messages in GlobalEventHandler
+	PROFILE_NETWORK, // CPU time of the network thread's lws_service rounds
+	PROFILE_SECTIONS
+} PROFILE_SECTION;
+
+struct ProfileSection {
+	// durations within the current second, updated atomically as PROFILE_NETWORK comes from the network thread
+	unsigned int buckets[PROFILE_BUCKETS];
+	unsigned int max; // us
+
+	// owned by the render thread, updated once per second by ProfileSample
+	unsigned int last[PROFILE_BUCKETS]; // the whole last second, for the overlay
+	unsigned int count;
+	double p50, p99, worst; // ms
+};
+
+struct Profile {
+	struct ProfileSection sections[PROFILE_SECTIONS];
+	double sampled_at;
+	double frame_at; // al_get_time() the last frame started being drawn at
+	double logic_at; // al_get_time() the current logic tick started at
+	double timeline; // seconds in ProfileTimeline within the current logic tick
+	unsigned int timelines; // ProfileTimeline calls within the current logic tick
+	ALLEGRO_FILE* csv; // once per second to profile.csv in the user data dir (veto/profile_csv)
+};
+
+struct VetoSnapshot {
+	// full game state, sent by the server right after the monitor registers
+	int players, round, counter;
+	int votesFor, votesAgainst, abstained;
+	int vetos;
+	bool started, voting;
+	char* winner[4]; // empty if not announced yet
+};
+
+#define VETO_LEADERBOARD_SIZE 10
+
+struct VetoLeaderboard {
+	// best players first, sent by the server whenever scores change
+	int count;
+	int score[VETO_LEADERBOARD_SIZE];
+	char* name[VETO_LEADERBOARD_SIZE];
+};
+
 struct CommonResources {
 	// Fill in with common data accessible from all gamestates.
+	bool verbose; // per-message protocol logging
+	bool netstats; // link statistics overlay (veto/netstats, toggled with I)
+	bool profiling; // frame time overlay (veto/profile, toggled with P)
+	struct Profile profile;
+	bool headless; // veto-headless: no assets, sound or drawing, just the game logic and a report on stdout
+	int64_t time_skipped; // us GameTime is ahead of al_get_time(), only ever skipped by veto-headless
+	ALLEGRO_MUTEX* time_mutex; // with time_skipped_cond, wakes up ReplayThread when GameTime gets skipped
+	ALLEGRO_COND* time_skipped_cond;
 	bool ws;
-	struct lws* ws_socket;
-	struct lws_context* ws_context;
+	bool ws_binary; // speaking veto-bin instead of the text protocol
 	bool ws_connected;
-	char* ws_buffer;
+	double ws_connect_time; // seconds it took the last connection attempt to get through
+	unsigned int ws_session; // increased with each WebSocketConnect, tags connection events
+	double ws_backoff_min, ws_backoff_max; // reconnection delay bounds in seconds (veto/reconnect_min, veto/reconnect_max)
+	struct WebSocketSendQueue ws_queue;
+	struct WebSocketReceiveQueue ws_incoming;
+	struct WebSocketBufferPool ws_pool;
+	struct WebSocketStats ws_stats;
+	double ws_wallclock_offset; // ms to add to al_get_time() * 1000 to get the Unix time
+	double ws_clock_offset; // ms to add to al_get_time() * 1000 to get the server's voting clock
+	double ws_clock_rtt; // ms, round trip of the K record ws_clock_offset comes from; negative until there's one
+	int ws_registered; // 1 once the Z answering the registration came, -1 if an X came instead, 0 until then
+	char** veto_nicks; // by player id, filled in from I records
+	size_t veto_nicks_count;
+
+	// owned by the network thread
+	ALLEGRO_THREAD* ws_thread;
+	struct lws_context* ws_context; // kept across connections, see WebSocketCreateContext
+	struct lws* ws_socket;
+	bool ws_established;
+	struct WebSocketBuffer* ws_rx; // message being reassembled
+	bool ws_greet; // monitor registration still has to be written on this connection
+	bool ws_greet_basic; // register with a plain 0x01, the server didn't take 0x0a; sticks across connections
+	double ws_greeted_at; // al_get_time() the registration was written, 0 if it wasn't yet
+	bool ws_ping; // a ping is due to be written
+	bool ws_clock; // a voting clock probe is due to be written; goes with every ping
+	double ws_ping_at; // al_get_time() of the last ping
+	bool ws_pong; // the last ping got answered, or there wasn't one yet on this connection
+	double ws_ping_interval; // seconds (veto/ping_interval), 0 for no pings; the voting clock is then only probed on connecting
+	unsigned int ws_retries; // failed attempts since the last established connection
+	double ws_retry_at; // al_get_time() of the next connection attempt
+	double ws_attempt_at; // al_get_time() of the current connection attempt
+	char ws_address[64]; // cached resolved address of ws_address_host, empty if it has to be looked up
+	char* ws_address_host;
+	struct VetoServer* ws_server; // embedded game server (veto/embedded_server), see server.c
+	ALLEGRO_MUTEX* ws_monitor_mutex; // orders ws against the monitor getting attached to ws_server, see EmbeddedServerThread
+
+	// capture and replay, see CaptureMessage and ReplayThread
+	ALLEGRO_FILE* capture; // every received message gets recorded here (veto/capture)
+	double capture_at; // received time of the last captured message
+	const char* replay; // capture file played back instead of connecting (--replay)
+	double replay_speed; // 1 in real time, n times faster, 0 as fast as it can be handled (--replay-speed)
+	int64_t replay_due; // GameTime in us ReplayThread waits for, -1 while it's delivering a message, 0 if neither
 };
 
+// Per-message logging; arguments aren't even evaluated unless enabled (veto/verbose, toggled with L).
+#define VetoLog(game, ...) \
+	do { \
+		if ((game)->data->verbose) { \
+			PrintConsole((game), __VA_ARGS__); \
+		} \
+	} while (0)
+
 typedef enum {
 	WEBSOCKET_EVENT_INCOMING_MESSAGE = 2048,
 	WEBSOCKET_EVENT_CONNECTING,
 	WEBSOCKET_EVENT_CONNECTED,
 	WEBSOCKET_EVENT_DISCONNECTED,
+	WEBSOCKET_EVENT_REPLAY_DONE, // data1 is the session, data2 the number of messages played back
 } WEBSOCKET_EVENT_TYPE;
 
 typedef enum {
@@ -49,12 +237,49 @@ typedef enum {
 	VETO_EVENT_RECONNECT,
 	VETO_EVENT_VETO,
 	VETO_EVENT_WINNER,
-	VETO_EVENT_THE_END
+	VETO_EVENT_THE_END,
+	VETO_EVENT_SNAPSHOT, // data1 is a struct VetoSnapshot*
+	VETO_EVENT_TALLY, // live tally while voting: data1 for, data2 against, data3 not voted yet
+	VETO_EVENT_LEADERBOARD, // data1 is a struct VetoLeaderboard*
+	VETO_EVENT_DEADLINE, // data1 is the al_get_time() in ms at which the voting closes
 } VETO_EVENT_TYPE;
 
+typedef enum {
+	VETO_COMMAND_MONITOR,
+	VETO_COMMAND_START,
+	VETO_COMMAND_VOTING,
+} VETO_COMMAND_TYPE;
+
 struct CommonResources* CreateGameData(struct Game* game);
 void DestroyGameData(struct Game* game);
 void WebSocketConnect(struct Game* game);
 void WebSocketDisconnect(struct Game* game);
 void WebSocketSend(struct Game* game, char* msg);
+unsigned int WebSocketQueueDepth(struct Game* game);
+void VetoSendCommand(struct Game* game, VETO_COMMAND_TYPE command);
 bool GlobalEventHandler(struct Game* game, ALLEGRO_EVENT* event);
+double GameTime(struct Game* game);
+void SkipTime(struct Game* game, double until);
+
+// frame time profile, see ProfileSample
+extern const char* ProfileSectionNames[PROFILE_SECTIONS];
+void ProfileEnd(struct Game* game, PROFILE_SECTION section, double start);
+void ProfileTimeline(struct Game* game, struct Timeline* timeline);
+void ProfilePreLogic(struct Game* game, double delta);
+void ProfilePostLogic(struct Game* game, double delta);
+void ProfilePreDraw(struct Game* game);
+void ProfilePostDraw(struct Game* game);
+
+// shared with server.c
+struct WebSocketBuffer* BufferAcquire(struct WebSocketBufferPool* pool);
+void BufferAppend(struct WebSocketBuffer* buffer, const void* data, size_t length);
+void BufferRelease(struct WebSocketBufferPool* pool, struct WebSocketBuffer* buffer);
+void ReceiveQueuePush(struct Game* game, struct WebSocketBuffer* buffer);
+
+// server.c, only called from the network thread
+struct VetoServer* EmbeddedServerCreate(struct Game* game, struct lws_context* context);
+void EmbeddedServerDestroy(struct Game* game, struct VetoServer* server);
+void EmbeddedServerMonitorCommand(struct Game* game, const void* data, size_t length, bool binary);
+void EmbeddedServerDetachMonitor(struct Game* game);
+int EmbeddedServerService(struct Game* game, int timeout);
+void EmbeddedServerFlush(struct Game* game);
@@ -95,7 +95,7 @@ static bool Type(struct Game* game, struct TM_Action* action, enum TM_ActionStat
 //==================================Timeline manager actions END
 
 void Gamestate_Logic(struct Game* game, struct GamestateResources* data) {
-	TM_Process(data->timeline);
+	ProfileTimeline(game, data->timeline);
 	data->tick++;
 	if (data->tick == 30) {
 		data->underscore = !data->underscore;
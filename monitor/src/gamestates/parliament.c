@@ -19,7 +19,6 @@
  */
 
 #include "../common.h"
-#include <libsuperderpy.h>
 #include <math.h>
 
 #define BILLS 25
@@ -27,7 +26,7 @@
 struct GamestateResources {
 	// This struct is for every resource allocated and used by your gamestate.
 	// It gets created on load and then gets passed around to all other function calls.
-	ALLEGRO_FONT *font, *statusfont, *vetofont;
+	ALLEGRO_FONT *font, *statusfont, *vetofont, *infofont;
 
 	int counter;
 	char* content;
@@ -45,6 +44,12 @@ struct GamestateResources {
 	int players;
 	char* status;
 	int votesFor, votesAgainst, abstrained, timeLeft;
+	double deadline; // al_get_time() in ms at which the voting closes, 0 when not counting down
+	int liveFor, liveAgainst, liveAbstained;
+	bool liveTally; // got a live tally during the current voting
+
+	struct VetoLeaderboard leaderboard; // names are owned here
+	bool leaderboardShown; // toggled with B
 
 	bool showFor, showAgainst, showAbstrained;
 
@@ -60,6 +65,11 @@ struct GamestateResources {
 	int speechdelay;
 
 	bool skip;
+
+	// veto-headless reporting, see HeadlessReport
+	uint64_t handled, handledReported; // protocol events
+	double reportedAt, reportInterval;
+	unsigned int timelineMax, statusMax;
 };
 
 int Gamestate_ProgressCount = 9; // number of loading steps as reported by Gamestate_Load
@@ -72,16 +82,37 @@ static bool ShowStatus(struct Game* game, struct TM_Action* action, enum TM_Acti
 		}
 		data->status = TM_GetArg(action->arguments, 1);
 	}
+	if (state == TM_ACTIONSTATE_DESTROY) {
+		char* status = TM_GetArg(action->arguments, 1);
+		if (status != data->status) {
+			free(status); // the queue got cleaned before it was shown
+		}
+	}
 	return true;
 }
 
+static ALLEGRO_AUDIO_STREAM* LoadSpeech(struct Game* game, char* filename) {
+	// headless, speeches are silent and take no time at all
+	if (game->data->headless) {
+		return NULL;
+	}
+	return al_load_audio_stream(GetDataFilePath(game, filename), 4, 1024);
+}
+
+// Characters aren't there when headless
+static void Pose(struct Game* game, struct Character* character, char* name) {
+	if (character) {
+		SelectSpritesheet(game, character, name);
+	}
+}
+
 static bool Speak(struct Game* game, struct TM_Action* action, enum TM_ActionState state) {
 	struct GamestateResources* data = TM_GetArg(action->arguments, 0);
 	ALLEGRO_AUDIO_STREAM* stream = TM_GetArg(action->arguments, 1);
 	//char *text = TM_GetArg(action->arguments, 2);
 	struct Character* character = TM_GetArg(action->arguments, 2);
 
-	if (state == TM_ACTIONSTATE_INIT) {
+	if (state == TM_ACTIONSTATE_INIT && stream) {
 		al_set_audio_stream_playing(stream, false);
 		al_set_audio_stream_playmode(stream, ALLEGRO_PLAYMODE_ONCE);
 	}
@@ -90,8 +121,10 @@ static bool Speak(struct Game* game, struct TM_Action* action, enum TM_ActionSta
 		data->skip = false;
 		data->speechdelay = 8;
 		//al_rewind_audio_stream(stream);
-		al_attach_audio_stream_to_mixer(stream, game->audio.voice);
-		al_set_audio_stream_playing(stream, true);
+		if (stream) {
+			al_attach_audio_stream_to_mixer(stream, game->audio.voice);
+			al_set_audio_stream_playing(stream, true);
+		}
 
 		//data->text = text;
 	}
@@ -104,11 +137,13 @@ static bool Speak(struct Game* game, struct TM_Action* action, enum TM_ActionSta
 				character->angle = ((rand() / (float)RAND_MAX) * 2 - 1) / 4.0;
 			}
 		}
-		return !al_get_audio_stream_playing(stream) || data->skip;
+		return !stream || !al_get_audio_stream_playing(stream) || data->skip;
 	}
 
 	if (state == TM_ACTIONSTATE_DESTROY) {
-		al_destroy_audio_stream(stream);
+		if (stream) {
+			al_destroy_audio_stream(stream);
+		}
 		if (character) {
 			character->angle = 0;
 		}
@@ -122,7 +157,7 @@ static bool ShowDeputy(struct Game* game, struct TM_Action* action, enum TM_Acti
 	if (state == TM_ACTIONSTATE_RUNNING) {
 		data->deputyShown = true;
 		char* deputies[] = {"pang", "ping1", "ping2", "zubr"};
-		SelectSpritesheet(game, data->deputy, deputies[rand() % (sizeof(deputies) / sizeof(char*))]);
+		Pose(game, data->deputy, deputies[rand() % (sizeof(deputies) / sizeof(char*))]);
 	}
 	return true;
 }
@@ -132,6 +167,7 @@ static bool ShowBill(struct Game* game, struct TM_Action* action, enum TM_Action
 	if (state == TM_ACTIONSTATE_RUNNING) {
 		data->billShown = true;
 		data->timeLeft = -1;
+		data->deadline = 0;
 	}
 	return true;
 }
@@ -180,7 +216,7 @@ static bool HideDeputy(struct Game* game, struct TM_Action* action, enum TM_Acti
 static bool StartVote(struct Game* game, struct TM_Action* action, enum TM_ActionState state) {
 	//struct GamestateResources *data = TM_GetArg(action->arguments, 0);
 	if (state == TM_ACTIONSTATE_RUNNING) {
-		WebSocketSend(game, "{\"type\":\"voting\"}");
+		VetoSendCommand(game, VETO_COMMAND_VOTING);
 	}
 	return true;
 }
@@ -197,7 +233,7 @@ static bool Start(struct Game* game, struct TM_Action* action, enum TM_ActionSta
 static bool ShowFor(struct Game* game, struct TM_Action* action, enum TM_ActionState state) {
 	struct GamestateResources* data = TM_GetArg(action->arguments, 0);
 	if (state == TM_ACTIONSTATE_RUNNING) {
-		SelectSpritesheet(game, data->borsuk, "up");
+		Pose(game, data->borsuk, "up");
 		data->showFor = true;
 	}
 	return true;
@@ -206,7 +242,7 @@ static bool ShowFor(struct Game* game, struct TM_Action* action, enum TM_ActionS
 static bool ShowAgainst(struct Game* game, struct TM_Action* action, enum TM_ActionState state) {
 	struct GamestateResources* data = TM_GetArg(action->arguments, 0);
 	if (state == TM_ACTIONSTATE_RUNNING) {
-		SelectSpritesheet(game, data->jezyk, "up");
+		Pose(game, data->jezyk, "up");
 		data->showAgainst = true;
 	}
 	return true;
@@ -224,7 +260,7 @@ static bool StartProcess(struct Game* game, struct TM_Action* action, enum TM_Ac
 static bool ShowAbstrained(struct Game* game, struct TM_Action* action, enum TM_ActionState state) {
 	struct GamestateResources* data = TM_GetArg(action->arguments, 0);
 	if (state == TM_ACTIONSTATE_RUNNING) {
-		SelectSpritesheet(game, data->lisek, "up");
+		Pose(game, data->lisek, "up");
 		data->showAbstrained = true;
 	}
 	return true;
@@ -233,11 +269,11 @@ static bool ShowAbstrained(struct Game* game, struct TM_Action* action, enum TM_
 static bool HideResults(struct Game* game, struct TM_Action* action, enum TM_ActionState state) {
 	struct GamestateResources* data = TM_GetArg(action->arguments, 0);
 	if (state == TM_ACTIONSTATE_RUNNING) {
-		SelectSpritesheet(game, data->lisek, "down");
+		Pose(game, data->lisek, "down");
 		data->showFor = false;
-		SelectSpritesheet(game, data->borsuk, "down");
+		Pose(game, data->borsuk, "down");
 		data->showAgainst = false;
-		SelectSpritesheet(game, data->jezyk, "down");
+		Pose(game, data->jezyk, "down");
 		data->showAbstrained = false;
 	}
 	return true;
@@ -301,33 +337,96 @@ static void StartLegislativeProcess(struct Game* game, struct GamestateResources
 	data->content = content;
 
 	TM_AddAction(data->timeline, &ShowDeputy, TM_AddToArgs(NULL, 1, data), "showdeputy");
-	TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/read.flac"), 4, 1024), data->bobr), "speak");
+	TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/read.flac"), data->bobr), "speak");
 	TM_AddDelay(data->timeline, 100);
 	TM_AddAction(data->timeline, &ShowBill, TM_AddToArgs(NULL, 1, data), "showbill");
 	TM_AddDelay(data->timeline, 100);
-	TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, buf), 4, 1024), data->deputy), "speak");
+	TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, buf), data->deputy), "speak");
 	TM_AddDelay(data->timeline, 500);
 	TM_AddAction(data->timeline, &HideDeputy, TM_AddToArgs(NULL, 1, data), "hidedeputy");
 	TM_AddDelay(data->timeline, 200);
-	TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/voting.flac"), 4, 1024), data->bobr), "speak");
+	TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/voting.flac"), data->bobr), "speak");
 	TM_AddDelay(data->timeline, 100);
 	TM_AddAction(data->timeline, &StartVote, TM_AddToArgs(NULL, 1, data), "startvote");
 }
 
+static unsigned int TimelineDepth(struct Timeline* timeline) {
+	unsigned int depth = 0;
+	for (struct TM_Action* action = timeline->queue; action; action = action->next) {
+		depth++;
+	}
+	for (struct TM_Action* action = timeline->background; action; action = action->next) {
+		depth++;
+	}
+	return depth;
+}
+
+// In veto-headless, a line to stdout every veto/headless_report seconds, so a long soak run against
+// veto-loadgen shows whether the timelines, the network queues or the memory keep growing
+static void HeadlessReport(struct Game* game, struct GamestateResources* data, bool force) {
+	unsigned int timeline = TimelineDepth(data->timeline), status = TimelineDepth(data->statustm);
+	if (timeline > data->timelineMax) {
+		data->timelineMax = timeline;
+	}
+	if (status > data->statusMax) {
+		data->statusMax = status;
+	}
+
+	double now = al_get_time();
+	if (!data->reportedAt) {
+		data->reportedAt = now;
+		return;
+	}
+	double elapsed = now - data->reportedAt;
+	if (!force && elapsed < data->reportInterval) {
+		return;
+	}
+
+	long rss = 0; // kB, stays 0 without /proc
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		long pages;
+		if (fscanf(statm, "%*d %ld", &pages) == 1) {
+			rss = pages * (sysconf(_SC_PAGESIZE) / 1024);
+		}
+		fclose(statm);
+	}
+
+	struct WebSocketStats* stats = &game->data->ws_stats;
+	printf("headless: %s, %.1f events/s (%llu in total), %.1f msg/s in, timeline %u (max %u), status %u (max %u), receive queue %u, send queue %u (max %u), rss %ld kB\n",
+		game->data->ws_connected ? "connected" : "disconnected", elapsed > 0 ? (data->handled - data->handledReported) / elapsed : 0,
+		(unsigned long long)data->handled, stats->rx_messages_rate, timeline, data->timelineMax, status, data->statusMax,
+		stats->receive_depth, stats->send_depth, stats->send_depth_max, rss);
+	fflush(stdout);
+
+	data->handledReported = data->handled;
+	data->reportedAt = now;
+}
+
 void Gamestate_Logic(struct Game* game, struct GamestateResources* data) {
 	// Called 60 times per second. Here you should do all your game logic.
+	if (game->data->headless) {
+		HeadlessReport(game, data, false);
+	}
 	if (!game->data->ws_connected) {
 		return;
 	}
 	data->counter += 3;
-	TM_Process(data->timeline);
-	TM_Process(data->statustm);
+	if (data->deadline) {
+		// whole seconds left, the way the server's C records count them: 5 down to 0
+		int left = ceil((data->deadline - al_get_time() * 1000) / 1000.0) - 1;
+		data->timeLeft = left > 0 ? left : 0;
+	}
+	ProfileTimeline(game, data->timeline);
+	ProfileTimeline(game, data->statustm);
 }
 
 void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 	// Called as soon as possible, but no sooner than next Gamestate_Logic call.
 	// Draw everything to the screen here.
-
+	if (game->data->headless) {
+		return;
+	}
 	al_draw_bitmap(data->bg, 0, 0, 0);
 
 	if ((data->started) && (data->deputyShown)) {
@@ -369,6 +468,19 @@ void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 
 		if (data->timeLeft >= 0) {
 			al_draw_textf(data->font, al_map_rgb(0, 0, 0), 1920 / 2.8, 666, ALLEGRO_ALIGN_CENTER, "%d", data->timeLeft);
+
+			if (data->liveTally) {
+				// how the vote is swinging, from the live tally
+				int total = data->liveFor + data->liveAgainst + data->liveAbstained;
+				float width = 1920 / 1.4 - 200;
+				float forWidth = total > 0 ? width * data->liveFor / total : 0;
+				float againstWidth = total > 0 ? width * data->liveAgainst / total : 0;
+				al_draw_filled_rectangle(100, 900, 100 + width, 940, al_map_rgba(128, 128, 128, 128));
+				al_draw_filled_rectangle(100, 900, 100 + forWidth, 940, al_map_rgb(60, 160, 60));
+				al_draw_filled_rectangle(100 + width - againstWidth, 900, 100 + width, 940, al_map_rgb(200, 60, 60));
+				al_draw_textf(data->infofont, al_map_rgb(0, 0, 0), 100, 950, ALLEGRO_ALIGN_LEFT, "%d", data->liveFor);
+				al_draw_textf(data->infofont, al_map_rgb(0, 0, 0), 100 + width, 950, ALLEGRO_ALIGN_RIGHT, "%d", data->liveAgainst);
+			}
 		}
 	}
 
@@ -404,6 +516,64 @@ void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 		al_draw_textf(data->statusfont, al_map_rgb(255, 255, 255), 1905, 5, ALLEGRO_ALIGN_RIGHT, "%d", data->players);
 	}
 
+	if (data->leaderboardShown) {
+		al_draw_filled_rectangle(1400, 120, 1900, 180 + VETO_LEADERBOARD_SIZE * 40, al_map_rgba(0, 0, 0, 160));
+		for (int i = 0; i < data->leaderboard.count; i++) {
+			al_draw_textf(data->infofont, al_map_rgb(255, 255, 255), 1420, 140 + i * 40, ALLEGRO_ALIGN_LEFT, "%d. %s", i + 1, data->leaderboard.name[i]);
+			al_draw_textf(data->infofont, al_map_rgb(255, 255, 255), 1880, 140 + i * 40, ALLEGRO_ALIGN_RIGHT, "%d", data->leaderboard.score[i]);
+		}
+	}
+
+	if (game->data->netstats) {
+		struct WebSocketStats* stats = &game->data->ws_stats;
+		al_draw_filled_rectangle(0, 120, 700, 330, al_map_rgba(0, 0, 0, 160));
+		al_draw_textf(data->infofont, al_map_rgb(255, 255, 255), 20, 130, ALLEGRO_ALIGN_LEFT, "rtt %.1f ms, connected in %d ms",
+		  stats->rtt / 1000.0, (int)(game->data->ws_connect_time * 1000));
+		al_draw_textf(data->infofont, al_map_rgb(255, 255, 255), 20, 170, ALLEGRO_ALIGN_LEFT, "delay %.1f ms (jitter %.1f), dispatch %.1f ms",
+		  stats->delay, stats->delay - stats->delay_min, stats->dispatch);
+		al_draw_textf(data->infofont, al_map_rgb(255, 255, 255), 20, 210, ALLEGRO_ALIGN_LEFT, "in %.0f msg/s, %.1f kB/s",
+		  stats->rx_messages_rate, stats->rx_bytes_rate / 1024.0);
+		al_draw_textf(data->infofont, al_map_rgb(255, 255, 255), 20, 250, ALLEGRO_ALIGN_LEFT, "out %.0f msg/s, %.1f kB/s",
+		  stats->tx_messages_rate, stats->tx_bytes_rate / 1024.0);
+		al_draw_textf(data->infofont, al_map_rgb(255, 255, 255), 20, 290, ALLEGRO_ALIGN_LEFT, "queues: send %u (max %u), receive %u",
+		  stats->send_depth, stats->send_depth_max, stats->receive_depth);
+	}
+
+	if (game->data->profiling) {
+		// p50/p99/max over the last second and its histogram, log scale from 1 us; the line is the 60 Hz frame
+		struct Profile* profile = &game->data->profile;
+		ALLEGRO_COLOR white = al_map_rgb(255, 255, 255), red = al_map_rgb(255, 90, 90);
+		al_draw_filled_rectangle(0, 340, 1120, 400 + PROFILE_SECTIONS * 40, al_map_rgba(0, 0, 0, 160));
+		al_draw_text(data->infofont, white, 20, 350, ALLEGRO_ALIGN_LEFT, "ms");
+		al_draw_text(data->infofont, white, 300, 350, ALLEGRO_ALIGN_RIGHT, "p50");
+		al_draw_text(data->infofont, white, 440, 350, ALLEGRO_ALIGN_RIGHT, "p99");
+		al_draw_text(data->infofont, white, 580, 350, ALLEGRO_ALIGN_RIGHT, "max");
+		int frame = 8 * log2(1000000 / 60.0) + 1;
+		al_draw_line(620 + frame * 3, 390, 620 + frame * 3, 390 + PROFILE_SECTIONS * 40, al_map_rgba(255, 90, 90, 160), 2);
+		for (int i = 0; i < PROFILE_SECTIONS; i++) {
+			struct ProfileSection* section = &profile->sections[i];
+			int y = 390 + i * 40;
+			ALLEGRO_COLOR color = section->worst > 1000 / 60.0 ? red : white;
+			al_draw_text(data->infofont, white, 20, y, ALLEGRO_ALIGN_LEFT, ProfileSectionNames[i]);
+			al_draw_textf(data->infofont, white, 300, y, ALLEGRO_ALIGN_RIGHT, "%.2f", section->p50);
+			al_draw_textf(data->infofont, color, 440, y, ALLEGRO_ALIGN_RIGHT, "%.2f", section->p99);
+			al_draw_textf(data->infofont, color, 580, y, ALLEGRO_ALIGN_RIGHT, "%.2f", section->worst);
+			unsigned int most = 1;
+			for (int j = 0; j < PROFILE_BUCKETS; j++) {
+				if (section->last[j] > most) {
+					most = section->last[j];
+				}
+			}
+			for (int j = 0; j < PROFILE_BUCKETS; j++) {
+				if (section->last[j]) {
+					// at least a pixel, a single hitch is what this is for
+					float height = 1 + 30.0 * section->last[j] / most;
+					al_draw_filled_rectangle(620 + j * 3, y + 34 - height, 622 + j * 3, y + 34, color);
+				}
+			}
+		}
+	}
+
 	//	al_draw_text(data->statusfont, al_map_rgb(0,0,0), 1920/2+5, 980+5, ALLEGRO_ALIGN_CENTER, "http://veto.dosowisko.net/");
 	al_draw_filled_rounded_rectangle(1920 / 2 - 470, 980, 1920 / 2 + 470, 1500, 20, 20, al_map_rgba(0, 0, 0, 128));
 	al_draw_text(data->statusfont, al_map_rgb(255, 255, 255), 1920 / 2, 985, ALLEGRO_ALIGN_CENTER, "http://veto.dosowisko.net/"); // TODO: https?
@@ -419,10 +589,15 @@ void Gamestate_Draw(struct Game* game, struct GamestateResources* data) {
 void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data, ALLEGRO_EVENT* ev) {
 	// Called for each event in Allegro event queue.
 	// Here you can handle user input, expiring timers etc.
+	double start = al_get_time();
 
 	TM_HandleEvent(data->timeline, ev);
 	TM_HandleEvent(data->statustm, ev);
 
+	if (ev->type >= VETO_EVENT_START && ev->type <= VETO_EVENT_DEADLINE) {
+		data->handled++;
+	}
+
 	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_ESCAPE)) {
 		UnloadCurrentGamestate(game); // mark this gamestate to be stopped and unloaded
 		// When there are no active gamestates, the engine will quit.
@@ -435,17 +610,16 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 		WebSocketDisconnect(game);
 	}
 	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_S)) {
-		WebSocketSend(game, "{\"type\":\"start\"}");
+		VetoSendCommand(game, VETO_COMMAND_START);
 	}
 	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_V)) {
-		WebSocketSend(game, "{\"type\":\"voting\"}");
+		VetoSendCommand(game, VETO_COMMAND_VOTING);
 	}
 	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_FULLSTOP)) {
 		data->skip = true;
 	}
-
-	if (ev->type == WEBSOCKET_EVENT_CONNECTED) {
-		WebSocketSend(game, "{\"type\":\"monitor\"}");
+	if ((ev->type == ALLEGRO_EVENT_KEY_DOWN) && (ev->keyboard.keycode == ALLEGRO_KEY_B)) {
+		data->leaderboardShown = !data->leaderboardShown;
 	}
 
 	if (ev->type == VETO_EVENT_JOIN) {
@@ -469,6 +643,11 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 		TM_AddDelay(data->statustm, 2000);
 		TM_AddAction(data->statustm, &ShowStatus, TM_AddToArgs(NULL, 2, data, NULL), "clearstatus");
 	}
+	if (ev->type == WEBSOCKET_EVENT_REPLAY_DONE && (unsigned int)ev->user.data1 == game->data->ws_session && game->data->headless) {
+		// a headless replay is a benchmark run, which is over now
+		HeadlessReport(game, data, true);
+		UnloadCurrentGamestate(game);
+	}
 	if (ev->type == VETO_EVENT_PLAYERS) {
 		data->players = ev->user.data1;
 	}
@@ -481,7 +660,7 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 		}
 
 		TM_AddAction(data->timeline, &Start, TM_AddToArgs(NULL, 1, data), "start");
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/start.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/start.flac"), data->bobr), "speak");
 		TM_AddDelay(data->timeline, 200);
 		TM_AddAction(data->timeline, &StartProcess, TM_AddToArgs(NULL, 1, data), "startprocess");
 	}
@@ -498,29 +677,52 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 	if (ev->type == VETO_EVENT_COUNTER) {
 		data->timeLeft = ev->user.data1;
 	}
+	if (ev->type == VETO_EVENT_DEADLINE) {
+		data->deadline = ev->user.data1;
+	}
+	if (ev->type == VETO_EVENT_TALLY) {
+		data->liveFor = ev->user.data1;
+		data->liveAgainst = ev->user.data2;
+		data->liveAbstained = ev->user.data3;
+		data->liveTally = true;
+	}
 	if (ev->type == VETO_EVENT_VOTING) {
+		data->liveTally = false;
+	}
+	if (ev->type == VETO_EVENT_LEADERBOARD) {
+		struct VetoLeaderboard* leaderboard = (struct VetoLeaderboard*)ev->user.data1;
+		for (int i = 0; i < data->leaderboard.count; i++) {
+			free(data->leaderboard.name[i]);
+		}
+		data->leaderboard = *leaderboard;
+		for (int i = 0; i < data->leaderboard.count; i++) {
+			data->leaderboard.name[i] = strdup(leaderboard->name[i]);
+		}
+	}
+	if (ev->type == VETO_EVENT_VOTE_RESULT || ev->type == VETO_EVENT_VETO || ev->type == VETO_EVENT_THE_END) {
+		data->deadline = 0;
 	}
 	if (ev->type == VETO_EVENT_VOTE_RESULT) {
 		TM_AddAction(data->timeline, &HideBill, TM_AddToArgs(NULL, 1, data), "hidebill");
 		TM_AddDelay(data->timeline, 100);
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/end.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/end.flac"), data->bobr), "speak");
 		TM_AddDelay(data->timeline, 100);
 		TM_AddAction(data->timeline, &ShowFor, TM_AddToArgs(NULL, 1, data), "showfor");
 		TM_AddDelay(data->timeline, 100);
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/for.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/for.flac"), data->bobr), "speak");
 		TM_AddDelay(data->timeline, 100);
 		TM_AddAction(data->timeline, &ShowAgainst, TM_AddToArgs(NULL, 1, data), "showfor");
 		TM_AddDelay(data->timeline, 100);
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/against.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/against.flac"), data->bobr), "speak");
 		TM_AddDelay(data->timeline, 100);
 		TM_AddAction(data->timeline, &ShowAbstrained, TM_AddToArgs(NULL, 1, data), "showabstrained");
 		TM_AddDelay(data->timeline, 100);
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/abstrained.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/abstrained.flac"), data->bobr), "speak");
 		TM_AddDelay(data->timeline, 300);
 		if (ev->user.data1) {
-			TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/passed.flac"), 4, 1024), data->bobr), "speak");
+			TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/passed.flac"), data->bobr), "speak");
 		} else {
-			TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/rejected.flac"), 4, 1024), data->bobr), "speak");
+			TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/rejected.flac"), data->bobr), "speak");
 		}
 		TM_AddDelay(data->timeline, 100);
 		TM_AddAction(data->timeline, &HideResults, TM_AddToArgs(NULL, 1, data), "hideresults");
@@ -537,15 +739,58 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 		TM_AddAction(data->timeline, &HideBill, TM_AddToArgs(NULL, 1, data), "hidebill");
 		TM_AddAction(data->timeline, &ShowVeto, TM_AddToArgs(NULL, 1, data), "showveto");
 
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/veto.flac"), 4, 1024), NULL), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/veto.flac"), NULL), "speak");
 		TM_AddDelay(data->timeline, 500);
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/rejected.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/rejected.flac"), data->bobr), "speak");
 		TM_AddAction(data->timeline, &HideVeto, TM_AddToArgs(NULL, 1, data), "hideveto");
 		TM_AddDelay(data->timeline, 200);
 		TM_AddAction(data->timeline, &StartProcess, TM_AddToArgs(NULL, 1, data), "startprocess");
 	}
 	if (ev->type == VETO_EVENT_WINNER) {
-		data->winner[ev->user.data1] = (char*)ev->user.data2;
+		// the event points into a receive buffer that gets reused once the event is gone
+		if (ev->user.data1 >= 0 && ev->user.data1 < 4) {
+			free(data->winner[ev->user.data1]);
+			data->winner[ev->user.data1] = strdup((char*)ev->user.data2);
+		}
+	}
+	if (ev->type == VETO_EVENT_SNAPSHOT) {
+		// comes after every (re)connection, so whatever happened while we were away gets applied at once
+		struct VetoSnapshot* snapshot = (struct VetoSnapshot*)ev->user.data1;
+		data->players = snapshot->players;
+		data->votesFor = snapshot->votesFor;
+		data->votesAgainst = snapshot->votesAgainst;
+		data->abstrained = snapshot->abstained;
+		data->timeLeft = snapshot->voting ? snapshot->counter : -1;
+		data->deadline = 0; // a D follows if it's still going
+		for (int i = 0; i < 4; i++) {
+			if (snapshot->winner[i][0]) {
+				free(data->winner[i]);
+				data->winner[i] = strdup(snapshot->winner[i]);
+			}
+		}
+
+		if (snapshot->vetos >= 3) {
+			// the game has ended in the meantime
+			TM_CleanQueue(data->timeline);
+			data->billShown = false;
+			data->vetoShown = false;
+			data->started = false;
+			data->resultsShown = true;
+		} else if (snapshot->started && !data->started) {
+			// joining a game that's already going; a running vote ends with its result, which queues up the next bill
+			TM_CleanQueue(data->timeline);
+			TM_AddAction(data->timeline, &Start, TM_AddToArgs(NULL, 1, data), "start");
+			if (!snapshot->voting) {
+				TM_AddAction(data->timeline, &StartProcess, TM_AddToArgs(NULL, 1, data), "startprocess");
+			}
+		} else if (!snapshot->started && data->started) {
+			// the server has lost the game, so wait for a new one to start
+			TM_CleanQueue(data->timeline);
+			data->billShown = false;
+			data->deputyShown = false;
+			data->vetoShown = false;
+			data->started = false;
+		}
 	}
 	if (ev->type == VETO_EVENT_THE_END) {
 		char* buf = malloc(255 * sizeof(char));
@@ -557,23 +802,35 @@ void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data,
 		TM_AddAction(data->timeline, &HideBill, TM_AddToArgs(NULL, 1, data), "hidebill");
 		TM_AddAction(data->timeline, &ShowVeto, TM_AddToArgs(NULL, 1, data), "showveto");
 
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/veto.flac"), 4, 1024), NULL), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/veto.flac"), NULL), "speak");
 		TM_AddDelay(data->timeline, 500);
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/rejected.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/rejected.flac"), data->bobr), "speak");
 		TM_AddAction(data->timeline, &HideVeto, TM_AddToArgs(NULL, 1, data), "hideveto");
 		TM_AddDelay(data->timeline, 200);
 		TM_AddAction(data->timeline, &ShowResults, TM_AddToArgs(NULL, 1, data), "showresults");
-		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, al_load_audio_stream(GetDataFilePath(game, "sounds/theend.flac"), 4, 1024), data->bobr), "speak");
+		TM_AddAction(data->timeline, &Speak, TM_AddToArgs(NULL, 3, data, LoadSpeech(game, "sounds/theend.flac"), data->bobr), "speak");
 	}
+
+	ProfileEnd(game, PROFILE_EVENT, start);
 }
 
 void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	// Called once, when the gamestate library is being loaded.
 	// Good place for allocating memory, loading bitmaps etc.
-	struct GamestateResources* data = malloc(sizeof(struct GamestateResources));
+	struct GamestateResources* data = calloc(1, sizeof(struct GamestateResources));
+	data->timeline = TM_Init(game, "timeline");
+	data->statustm = TM_Init(game, "status");
+
+	if (game->data->headless) {
+		// just the game logic; no fonts, bitmaps, characters or music to decode
+		data->reportInterval = strtod(GetConfigOptionDefault(game, "veto", "headless_report", "10"), NULL);
+		return data;
+	}
+
 	data->font = al_load_font(GetDataFilePath(game, "fonts/TrashHand.ttf"), 192 + 30, 0);
 	data->vetofont = al_load_font(GetDataFilePath(game, "fonts/TrashHand.ttf"), 400, 0);
 	data->statusfont = al_load_font(GetDataFilePath(game, "fonts/TrashHand.ttf"), 64 + 30, 0);
+	data->infofont = al_load_font(GetDataFilePath(game, "fonts/TrashHand.ttf"), 42, 0);
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
 
 	data->bg = al_load_bitmap(GetDataFilePath(game, "bg.png"));
@@ -586,9 +843,6 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 	data->trawka3 = al_load_bitmap(GetDataFilePath(game, "trawka3.png"));
 	progress(game); // report that we progressed with the loading, so the engine can draw a progress bar
 
-	data->timeline = TM_Init(game, "timeline");
-	data->statustm = TM_Init(game, "status");
-
 	//	struct Character *bobr, *borsuk, *deputy, *jezyk, *lisek;
 
 	data->bobr = CreateCharacter(game, "bobr");
@@ -646,29 +900,39 @@ void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*)) {
 void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 	// Called when the gamestate library is being unloaded.
 	// Good place for freeing all allocated memory and resources.
-	al_destroy_font(data->font);
-	al_destroy_font(data->statusfont);
-	al_destroy_font(data->vetofont);
-	al_destroy_audio_stream(data->music);
-	al_destroy_bitmap(data->bg);
-	al_destroy_bitmap(data->galaz);
-	al_destroy_bitmap(data->pienki);
-	al_destroy_bitmap(data->trawka1);
-	al_destroy_bitmap(data->trawka2);
-	al_destroy_bitmap(data->trawka3);
-
 	TM_Destroy(data->timeline);
 	TM_Destroy(data->statustm);
 
-	DestroyCharacter(game, data->bobr);
-	DestroyCharacter(game, data->borsuk);
-	DestroyCharacter(game, data->deputy);
-	DestroyCharacter(game, data->jezyk);
-	DestroyCharacter(game, data->lisek);
+	if (!game->data->headless) {
+		al_destroy_font(data->font);
+		al_destroy_font(data->statusfont);
+		al_destroy_font(data->vetofont);
+		al_destroy_font(data->infofont);
+		al_destroy_audio_stream(data->music);
+		al_destroy_bitmap(data->bg);
+		al_destroy_bitmap(data->galaz);
+		al_destroy_bitmap(data->pienki);
+		al_destroy_bitmap(data->trawka1);
+		al_destroy_bitmap(data->trawka2);
+		al_destroy_bitmap(data->trawka3);
+
+		DestroyCharacter(game, data->bobr);
+		DestroyCharacter(game, data->borsuk);
+		DestroyCharacter(game, data->deputy);
+		DestroyCharacter(game, data->jezyk);
+		DestroyCharacter(game, data->lisek);
+	}
 
 	if (data->status) {
 		free(data->status);
 	}
+	free(data->content);
+	for (int i = 0; i < 4; i++) {
+		free(data->winner[i]);
+	}
+	for (int i = 0; i < data->leaderboard.count; i++) {
+		free(data->leaderboard.name[i]);
+	}
 
 	free(data);
 }
@@ -676,7 +940,9 @@ void Gamestate_Unload(struct Game* game, struct GamestateResources* data) {
 void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
 	// Called when this gamestate gets control. Good place for initializing state,
 	// playing music etc.
-	al_set_audio_stream_playing(data->music, true);
+	if (data->music) {
+		al_set_audio_stream_playing(data->music, true);
+	}
 	data->counter = 0;
 	WebSocketConnect(game);
 	data->players = 0;
@@ -685,22 +951,25 @@ void Gamestate_Start(struct Game* game, struct GamestateResources* data) {
 	data->deputyShown = false;
 	data->billShown = false;
 	data->timeLeft = -1;
+	data->deadline = 0;
 	data->showAbstrained = false;
 	data->showAgainst = false;
 	data->showFor = false;
 	data->content = NULL;
 	data->vetoShown = false;
 	data->resultsShown = false;
-	data->winner[0] = NULL;
-	data->winner[1] = NULL;
-	data->winner[2] = NULL;
-	data->winner[3] = NULL;
+	for (int i = 0; i < 4; i++) {
+		free(data->winner[i]);
+		data->winner[i] = NULL;
+	}
 }
 
 void Gamestate_Stop(struct Game* game, struct GamestateResources* data) {
 	// Called when gamestate gets stopped. Stop timers, music etc. here.
 	WebSocketDisconnect(game);
-	al_set_audio_stream_playing(data->music, false);
+	if (data->music) {
+		al_set_audio_stream_playing(data->music, false);
+	}
 }
 
 void Gamestate_Pause(struct Game* game, struct GamestateResources* data) {
@@ -0,0 +1,372 @@
+/*! \file headless.c
+ *  \brief The parts of libsuperderpy the monitor's game logic uses, for veto-headless.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <stdarg.h>
+
+#ifndef VETO_DATA_DIR
+#define VETO_DATA_DIR "data"
+#endif
+
+// veto-headless links main.c, common.c and parliament.c against this instead of the engine, for soak
+// runs on a box without a GPU: al_init and an event queue, but no display, no audio device, no
+// fonts or bitmaps. The loop isn't held to 60 Hz either; it goes on as soon as there's something to
+// do, and skips GameTime ahead over whatever would only be waited for, so timeline delays and the
+// gaps in a --replay take no time at all while still coming in the order they would in real time.
+
+void* Gamestate_Load(struct Game* game, void (*progress)(struct Game*));
+void Gamestate_Unload(struct Game* game, struct GamestateResources* data);
+void Gamestate_Start(struct Game* game, struct GamestateResources* data);
+void Gamestate_Stop(struct Game* game, struct GamestateResources* data);
+void Gamestate_Logic(struct Game* game, struct GamestateResources* data);
+void Gamestate_ProcessEvent(struct Game* game, struct GamestateResources* data, ALLEGRO_EVENT* ev);
+
+// Timelines
+
+struct Timeline* TM_Init(struct Game* game, const char* name) {
+	struct Timeline* timeline = calloc(1, sizeof(struct Timeline));
+	timeline->game = game;
+	timeline->name = strdup(name);
+	timeline->next = game->_priv.timelines;
+	game->_priv.timelines = timeline;
+	return timeline;
+}
+
+static void TM_Append(struct Timeline* timeline, struct TM_Action* action) {
+	struct TM_Action** last = &timeline->queue;
+	while (*last) {
+		last = &(*last)->next;
+	}
+	*last = action;
+}
+
+void TM_AddAction(struct Timeline* timeline, bool (*function)(struct Game*, struct TM_Action*, enum TM_ActionState), struct TM_Arguments* arguments, const char* name) {
+	struct TM_Action* action = calloc(1, sizeof(struct TM_Action));
+	action->function = function;
+	action->arguments = arguments;
+	action->name = strdup(name);
+	function(timeline->game, action, TM_ACTIONSTATE_INIT);
+	TM_Append(timeline, action);
+}
+
+void TM_AddDelay(struct Timeline* timeline, int delay) {
+	struct TM_Action* action = calloc(1, sizeof(struct TM_Action));
+	action->name = strdup("delay");
+	action->delay = delay;
+	TM_Append(timeline, action);
+}
+
+static void TM_DestroyAction(struct Timeline* timeline, struct TM_Action* action) {
+	if (action->function) {
+		action->function(timeline->game, action, TM_ACTIONSTATE_DESTROY);
+	}
+	while (action->arguments) {
+		struct TM_Arguments* next = action->arguments->next;
+		free(action->arguments);
+		action->arguments = next;
+	}
+	free(action->name);
+	free(action);
+}
+
+// Unlike the engine's, goes on with the next action as soon as one is over instead of on the next
+// tick, until one is still running or a delay isn't over yet.
+void TM_Process(struct Timeline* timeline) {
+	struct TM_Action* action;
+	while ((action = timeline->queue)) {
+		if (action->function) {
+			if (!action->active) {
+				action->active = true;
+				action->function(timeline->game, action, TM_ACTIONSTATE_START);
+			}
+			if (!action->function(timeline->game, action, TM_ACTIONSTATE_RUNNING)) {
+				return;
+			}
+		} else {
+			double now = GameTime(timeline->game);
+			if (!action->active) {
+				action->active = true;
+				action->due = now + action->delay / 1000.0;
+			}
+			if (now < action->due) {
+				return;
+			}
+		}
+		timeline->queue = action->next;
+		TM_DestroyAction(timeline, action);
+	}
+}
+
+// Delays aren't timers here, there's nothing to handle.
+void TM_HandleEvent(struct Timeline* timeline, ALLEGRO_EVENT* ev) {}
+
+void TM_CleanQueue(struct Timeline* timeline) {
+	while (timeline->queue) {
+		struct TM_Action* action = timeline->queue;
+		timeline->queue = action->next;
+		TM_DestroyAction(timeline, action);
+	}
+}
+
+void TM_Destroy(struct Timeline* timeline) {
+	TM_CleanQueue(timeline);
+	struct Timeline** link = &timeline->game->_priv.timelines;
+	while (*link != timeline) {
+		link = &(*link)->next;
+	}
+	*link = timeline->next;
+	free(timeline->name);
+	free(timeline);
+}
+
+struct TM_Arguments* TM_AddToArgs(struct TM_Arguments* arguments, int num, ...) {
+	struct TM_Arguments** last = &arguments;
+	while (*last) {
+		last = &(*last)->next;
+	}
+	va_list ap;
+	va_start(ap, num);
+	for (int i = 0; i < num; i++) {
+		*last = calloc(1, sizeof(struct TM_Arguments));
+		(*last)->value = va_arg(ap, void*);
+		last = &(*last)->next;
+	}
+	va_end(ap);
+	return arguments;
+}
+
+void* TM_GetArg(struct TM_Arguments* arguments, int num) {
+	for (int i = 0; arguments && i < num; i++) {
+		arguments = arguments->next;
+	}
+	return arguments ? arguments->value : NULL;
+}
+
+// GameTime the earliest running delay is over at, 0 if none is running.
+static double TimelinesDue(struct Game* game) {
+	double due = 0;
+	for (struct Timeline* timeline = game->_priv.timelines; timeline; timeline = timeline->next) {
+		struct TM_Action* action = timeline->queue;
+		if (action && !action->function && action->active && (!due || action->due < due)) {
+			due = action->due;
+		}
+	}
+	return due;
+}
+
+// Characters
+
+struct Character* CreateCharacter(struct Game* game, const char* name) {
+	return NULL;
+}
+
+void DestroyCharacter(struct Game* game, struct Character* character) {}
+void RegisterSpritesheet(struct Game* game, struct Character* character, const char* name) {}
+void LoadSpritesheets(struct Game* game, struct Character* character) {}
+void SelectSpritesheet(struct Game* game, struct Character* character, const char* name) {}
+void SetCharacterPosition(struct Game* game, struct Character* character, int x, int y, int angle) {}
+void SetCharacterPivotPoint(struct Game* game, struct Character* character, float x, float y) {}
+void DrawCharacter(struct Game* game, struct Character* character, ALLEGRO_COLOR tint, int flags) {}
+
+// Utilities
+
+// To stderr, stdout is for HeadlessReport.
+void PrintConsole(struct Game* game, const char* format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+// The engine's settings file, so veto-headless goes by the same veto/ options.
+static ALLEGRO_PATH* ConfigPath(void) {
+	ALLEGRO_PATH* path = al_get_standard_path(ALLEGRO_USER_SETTINGS_PATH);
+	al_set_path_filename(path, "SuperDerpy.ini");
+	return path;
+}
+
+const char* GetConfigOptionDefault(struct Game* game, const char* section, const char* name, const char* def) {
+	const char* value = al_get_config_value(game->_priv.config, section, name);
+	return value ? value : def;
+}
+
+void SetConfigOption(struct Game* game, const char* section, const char* name, const char* value) {
+	al_set_config_value(game->_priv.config, section, name, value);
+	ALLEGRO_PATH* path = ConfigPath();
+	ALLEGRO_PATH* dir = al_clone_path(path);
+	al_set_path_filename(dir, NULL);
+	al_make_directory(al_path_cstr(dir, ALLEGRO_NATIVE_PATH_SEP));
+	al_destroy_path(dir);
+	al_save_config_file(al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP), game->_priv.config);
+	al_destroy_path(path);
+}
+
+// Next to the executable, where it gets installed, or in the source tree it was built from.
+const char* GetDataFilePath(struct Game* game, const char* filename) {
+	static char found[4096];
+	ALLEGRO_PATH* resources = al_get_standard_path(ALLEGRO_RESOURCES_PATH);
+	const char* dir = al_path_cstr(resources, ALLEGRO_NATIVE_PATH_SEP);
+	char share[1024];
+	snprintf(share, sizeof(share), "%s../share/%s/data/", dir, game->_priv.name);
+	char local[1024];
+	snprintf(local, sizeof(local), "%sdata/", dir);
+	const char* dirs[] = {local, share, "data/", VETO_DATA_DIR "/"};
+
+	bool exists = false;
+	for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]) && !exists; i++) {
+		snprintf(found, sizeof(found), "%s%s", dirs[i], filename);
+		exists = al_filename_exists(found);
+	}
+	al_destroy_path(resources);
+	if (!exists) {
+		PrintConsole(game, "%s not found in any data directory!", filename);
+		return filename;
+	}
+	return found;
+}
+
+void SetupViewport(struct Game* game, struct Viewport config) {}
+void DrawWrappedText(ALLEGRO_FONT* font, ALLEGRO_COLOR color, int x, int y, int width, int flags, const char* text) {}
+
+// Gamestates; parliament is the only one linked in
+
+static void Progress(struct Game* game) {}
+
+void LoadGamestate(struct Game* game, const char* name) {
+	if (strcmp(name, "parliament") != 0) {
+		PrintConsole(game, "Gamestate \"%s\" isn't a part of veto-headless!", name);
+		return;
+	}
+	game->_priv.loaded = true;
+}
+
+void StartGamestate(struct Game* game, const char* name) {
+	if (strcmp(name, "parliament") == 0) {
+		game->_priv.started = true;
+	}
+}
+
+void UnloadCurrentGamestate(struct Game* game) {
+	game->_priv.unload = true;
+}
+
+// Initialization and the loop
+
+struct Game* libsuperderpy_init(int argc, char** argv, const char* name, struct Viewport viewport) {
+	if (!al_init()) {
+		fprintf(stderr, "failed to initialize allegro!\n");
+		return NULL;
+	}
+
+	struct Game* game = calloc(1, sizeof(struct Game));
+	game->_priv.name = name;
+	game->viewport = game->viewport_config = viewport;
+
+	ALLEGRO_PATH* path = ConfigPath();
+	game->_priv.config = al_load_config_file(al_path_cstr(path, ALLEGRO_NATIVE_PATH_SEP));
+	if (!game->_priv.config) {
+		game->_priv.config = al_create_config();
+	}
+	al_destroy_path(path);
+
+	al_init_user_event_source(&game->event_source);
+	game->_priv.event_queue = al_create_event_queue();
+	al_register_event_source(game->_priv.event_queue, &game->event_source);
+	return game;
+}
+
+static void Dispatch(struct Game* game, ALLEGRO_EVENT* ev) {
+	if (!game->handlers.event || !game->handlers.event(game, ev)) {
+		Gamestate_ProcessEvent(game, game->_priv.gamestate, ev);
+	}
+	if (ALLEGRO_EVENT_TYPE_IS_USER(ev->type)) {
+		al_unref_user_event(&ev->user);
+	}
+}
+
+int libsuperderpy_run(struct Game* game) {
+	if (game->_priv.loaded) {
+		game->_priv.gamestate = Gamestate_Load(game, &Progress);
+		if (game->_priv.started) {
+			Gamestate_Start(game, game->_priv.gamestate);
+		}
+	}
+
+	double logic_at = GameTime(game);
+	while (game->_priv.gamestate && game->_priv.started && !game->_priv.unload) {
+		ALLEGRO_EVENT ev;
+		while (al_get_next_event(game->_priv.event_queue, &ev)) {
+			Dispatch(game, &ev);
+		}
+
+		double now = GameTime(game);
+		if (game->handlers.prelogic) {
+			game->handlers.prelogic(game, now - logic_at);
+		}
+		Gamestate_Logic(game, game->_priv.gamestate);
+		if (game->handlers.postlogic) {
+			game->handlers.postlogic(game, now - logic_at);
+		}
+		logic_at = now;
+
+		// Nothing to do but wait for the next delay to be over or the next message of a replay to be
+		// due: skip right to it, unless a message is being delivered and has to come first. The
+		// replay moves on only after emitting the events of the last one, so once it's read they're
+		// in the queue.
+		int64_t replay = __atomic_load_n(&game->data->replay_due, __ATOMIC_ACQUIRE);
+		if (!al_is_event_queue_empty(game->_priv.event_queue)) {
+			continue;
+		}
+		now = GameTime(game);
+		double due = TimelinesDue(game);
+		bool delivering = replay < 0 || (replay > 0 && replay / 1000000.0 <= now);
+		if (!delivering) {
+			if (replay > 0 && (!due || replay / 1000000.0 < due)) {
+				due = replay / 1000000.0;
+			}
+			if (due > now) {
+				SkipTime(game, due);
+				continue;
+			}
+		}
+		if (due && due <= now) {
+			continue;
+		}
+		// a live connection, or the replay, has to come up with something; Logic still gets to run
+		// every now and then for the report
+		al_wait_for_event_timed(game->_priv.event_queue, NULL, 0.1);
+	}
+
+	if (game->_priv.gamestate) {
+		if (game->_priv.started) {
+			Gamestate_Stop(game, game->_priv.gamestate);
+		}
+		Gamestate_Unload(game, game->_priv.gamestate);
+	}
+	if (game->handlers.destroy) {
+		game->handlers.destroy(game);
+	}
+	al_destroy_event_queue(game->_priv.event_queue);
+	al_destroy_user_event_source(&game->event_source);
+	al_destroy_config(game->_priv.config);
+	free(game);
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*! \file headless.h
+ *  \brief The parts of libsuperderpy the monitor's game logic uses, for veto-headless.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Included by common.h instead of <libsuperderpy.h> when building veto-headless. The names are
+// the engine's, so main.c, common.c and parliament.c build against either one as they are; the
+// implementation in headless.c never creates a display or touches the audio device.
+
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_audio.h>
+#include <allegro5/allegro_font.h>
+#include <allegro5/allegro_primitives.h>
+#include <allegro5/allegro_ttf.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct GamestateResources;
+
+struct Viewport {
+	int width, height;
+};
+
+struct Game {
+	ALLEGRO_DISPLAY* display; // stays NULL
+	ALLEGRO_EVENT_SOURCE event_source;
+	struct {
+		bool fullscreen, debug;
+	} config;
+	struct {
+		ALLEGRO_MIXER *voice, *music; // stay NULL, there's no audio device
+	} audio;
+	struct Viewport viewport, viewport_config;
+	struct {
+		bool (*event)(struct Game* game, ALLEGRO_EVENT* ev);
+		void (*destroy)(struct Game* game);
+		void (*prelogic)(struct Game* game, double delta);
+		void (*postlogic)(struct Game* game, double delta);
+		void (*predraw)(struct Game* game);
+		void (*postdraw)(struct Game* game);
+	} handlers;
+	LIBSUPERDERPY_DATA_TYPE* data;
+
+	struct {
+		const char* name;
+		ALLEGRO_EVENT_QUEUE* event_queue;
+		ALLEGRO_CONFIG* config;
+		struct Timeline* timelines; // all of them, for the loop to know what they wait for
+		struct GamestateResources* gamestate; // parliament's, the only one linked in
+		bool loaded, started, unload;
+	} _priv;
+};
+
+// Timelines. Delays run on GameTime, which the loop skips ahead over them.
+
+enum TM_ActionState {
+	TM_ACTIONSTATE_INIT,
+	TM_ACTIONSTATE_START,
+	TM_ACTIONSTATE_RUNNING,
+	TM_ACTIONSTATE_DESTROY,
+};
+
+struct TM_Arguments {
+	void* value;
+	struct TM_Arguments* next;
+};
+
+struct TM_Action {
+	bool (*function)(struct Game* game, struct TM_Action* action, enum TM_ActionState state); // NULL for a delay
+	struct TM_Arguments* arguments;
+	char* name;
+	int delay; // ms
+	double due; // GameTime the delay is over at, once it's active
+	bool active;
+	struct TM_Action* next;
+};
+
+struct Timeline {
+	struct TM_Action *queue, *background; // nothing runs in the background here
+	struct Game* game;
+	char* name;
+	struct Timeline* next;
+};
+
+struct Timeline* TM_Init(struct Game* game, const char* name);
+void TM_AddAction(struct Timeline* timeline, bool (*function)(struct Game*, struct TM_Action*, enum TM_ActionState), struct TM_Arguments* arguments, const char* name);
+void TM_AddDelay(struct Timeline* timeline, int delay);
+void TM_Process(struct Timeline* timeline);
+void TM_HandleEvent(struct Timeline* timeline, ALLEGRO_EVENT* ev);
+void TM_CleanQueue(struct Timeline* timeline);
+void TM_Destroy(struct Timeline* timeline);
+struct TM_Arguments* TM_AddToArgs(struct TM_Arguments* arguments, int num, ...);
+void* TM_GetArg(struct TM_Arguments* arguments, int num);
+
+// Characters never get created without assets.
+
+struct Character {
+	float angle;
+};
+
+struct Character* CreateCharacter(struct Game* game, const char* name);
+void DestroyCharacter(struct Game* game, struct Character* character);
+void RegisterSpritesheet(struct Game* game, struct Character* character, const char* name);
+void LoadSpritesheets(struct Game* game, struct Character* character);
+void SelectSpritesheet(struct Game* game, struct Character* character, const char* name);
+void SetCharacterPosition(struct Game* game, struct Character* character, int x, int y, int angle);
+void SetCharacterPivotPoint(struct Game* game, struct Character* character, float x, float y);
+void DrawCharacter(struct Game* game, struct Character* character, ALLEGRO_COLOR tint, int flags);
+
+void PrintConsole(struct Game* game, const char* format, ...);
+const char* GetConfigOptionDefault(struct Game* game, const char* section, const char* name, const char* def);
+void SetConfigOption(struct Game* game, const char* section, const char* name, const char* value);
+const char* GetDataFilePath(struct Game* game, const char* filename);
+void SetupViewport(struct Game* game, struct Viewport config);
+void DrawWrappedText(ALLEGRO_FONT* font, ALLEGRO_COLOR color, int x, int y, int width, int flags, const char* text);
+
+void LoadGamestate(struct Game* game, const char* name);
+void StartGamestate(struct Game* game, const char* name);
+void UnloadCurrentGamestate(struct Game* game);
+
+struct Game* libsuperderpy_init(int argc, char** argv, const char* name, struct Viewport viewport);
+int libsuperderpy_run(struct Game* game);
@@ -0,0 +1,711 @@
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// veto-loadgen - a crowd of simulated players, to find out what a server can take before the
+// audience does.
+//
+// Registers as the monitor of a room, connects -n players to it, starts the game and runs -v
+// votings. Players vote for or against at a random moment within -d seconds after V, abstain,
+// drop their connection and reconnect with their cookie, or veto when they can, in the
+// proportions given. Then reports, as percentiles:
+//   connect - ms from opening a connection to the end of the handshake
+//   join - ms from sending join to getting the cookie
+//   reconnect - ms from opening the connection again to getting ok for the cookie
+//   result - ms from the voting deadline (from the D record) to a player getting E
+//   msgs/s, records/s - received by all the players together, every second of the votings
+//
+// It speaks to the server the way the monitor does, over libwebsockets with one context and no
+// Allegro, so it runs on any box that can reach the server. veto-bin records are decoded with the
+// monitor's own protocol.c.
+
+#include "protocol.h"
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOADGEN_VOTING_TIME 6.0 // s from V to E on the server, including the D grace second
+#define LOADGEN_SETTLE 1.5 // s given to late E records before the next voting
+#define LOADGEN_RETRY 1.0 // s before a dropped player connects again
+
+static struct {
+	const char* host;
+	int port;
+	const char* path;
+	unsigned int players, votings, handshakes;
+	int binary, abstain, reconnect, veto; // % of the players
+	double delay;
+} options = {
+	.host = "127.0.0.1",
+	.port = 8889,
+	.path = "/",
+	.players = 1000,
+	.votings = 5,
+	.handshakes = 100,
+	.binary = 0,
+	.abstain = 10,
+	.reconnect = 5,
+	.veto = 50,
+	.delay = 3,
+};
+
+enum ClientAction {
+	ACTION_NONE,
+	ACTION_OPEN,
+	ACTION_VOTE,
+	ACTION_VETO,
+	ACTION_RECONNECT,
+};
+
+struct Client {
+	struct lws* wsi;
+	unsigned int index; // 0 is the monitor
+	bool binary; // speaking veto-bin
+	bool closing; // closed on purpose, to reconnect
+	bool joined, ended;
+	char cookie[64];
+	double opened_at; // Now() of opening the current connection
+	double sent_at; // Now() of sending join
+
+	// the one command waiting to be written
+	unsigned char out[LWS_PRE + 128];
+	size_t out_length;
+
+	enum ClientAction action;
+	double action_at;
+	bool choice;
+
+	// message being reassembled
+	char* rx;
+	size_t rx_length, rx_capacity;
+};
+
+struct Samples {
+	double* values;
+	size_t count, capacity;
+};
+
+static struct {
+	struct lws_context* context;
+	struct Client* clients; // the monitor, then the players
+	unsigned int opened, connecting, joined, failed, dropped, ended;
+	unsigned int voting; // votings started so far
+	double deadline; // Now() at which the current voting closes, 0 until the monitor gets D
+	double over_at; // Now() at which the monitor got E, v or T for the current voting, 0 before
+	unsigned int expected, results; // players that got V and E in the current voting
+	bool game_over;
+	uint64_t rx_messages, rx_records;
+	struct Samples connect, join, reconnect, result, messages, records;
+} load;
+
+static double Now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool Roll(int percent) {
+	return rand() % 100 < percent;
+}
+
+static double Within(double seconds) {
+	return seconds * (rand() / (double)RAND_MAX);
+}
+
+static void SampleAdd(struct Samples* samples, double value) {
+	if (samples->count == samples->capacity) {
+		samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+		samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+	}
+	samples->values[samples->count++] = value;
+}
+
+static int CompareSamples(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double Percentile(struct Samples* samples, double p) {
+	size_t i = samples->count * p;
+	return samples->values[i < samples->count ? i : samples->count - 1];
+}
+
+static void SampleReport(const char* name, struct Samples* samples) {
+	if (!samples->count) {
+		printf("%-10s %8d\n", name, 0);
+		return;
+	}
+	qsort(samples->values, samples->count, sizeof(double), CompareSamples);
+	printf("%-10s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, samples->count, samples->values[0],
+		Percentile(samples, 0.5), Percentile(samples, 0.9), Percentile(samples, 0.99), samples->values[samples->count - 1]);
+	free(samples->values);
+	samples->values = NULL;
+	samples->count = samples->capacity = 0;
+}
+
+static void ClientLost(struct Client* client);
+
+static void ClientOpen(struct Client* client) {
+	struct lws_client_connect_info ccinfo = {};
+	ccinfo.context = load.context;
+	ccinfo.address = options.host;
+	ccinfo.port = options.port;
+	ccinfo.path = options.path;
+	ccinfo.host = options.host;
+	ccinfo.origin = "veto-loadgen";
+	ccinfo.protocol = client->binary ? "veto-bin" : "veto";
+	ccinfo.ietf_version_or_minus_one = -1;
+	ccinfo.userdata = client;
+
+	client->action = ACTION_NONE;
+	client->closing = false;
+	client->out_length = 0;
+	client->rx_length = 0;
+	client->opened_at = Now();
+	unsigned int connecting = ++load.connecting;
+	// returns right away; the rest of the handshake happens in lws_service
+	client->wsi = lws_client_connect_via_info(&ccinfo);
+	// unless CONNECTION_ERROR has already been called from within
+	if (!client->wsi && load.connecting == connecting) {
+		load.connecting--;
+		ClientLost(client);
+	}
+}
+
+// Queues a command. text is the JSON, with a %s for string if there is one; opcode and string
+// make the veto-bin version of it.
+static void ClientSend(struct Client* client, const char* text, unsigned char opcode, const char* string) {
+	unsigned char* buffer = client->out + LWS_PRE;
+	size_t length = 0;
+
+	if (client->binary) {
+		buffer[length++] = opcode;
+		if (string) {
+			size_t size = strlen(string);
+			buffer[length++] = size; // nicks and cookies are shorter than 128 bytes, so it's a one byte varint
+			memcpy(buffer + length, string, size);
+			length += size;
+		}
+	} else {
+		length = snprintf((char*)buffer, sizeof(client->out) - LWS_PRE, text, string);
+	}
+	client->out_length = length;
+	if (client->wsi) {
+		lws_callback_on_writable(client->wsi);
+	}
+}
+
+static void ClientAct(struct Client* client) {
+	enum ClientAction action = client->action;
+	client->action = ACTION_NONE;
+
+	switch (action) {
+		case ACTION_OPEN:
+			ClientOpen(client);
+			break;
+		case ACTION_VOTE:
+			if (client->choice) {
+				ClientSend(client, "{\"type\":\"vote\",\"choice\":true}", 0x07, NULL);
+			} else {
+				ClientSend(client, "{\"type\":\"vote\",\"choice\":false}", 0x08, NULL);
+			}
+			break;
+		case ACTION_VETO:
+			ClientSend(client, "{\"type\":\"veto\"}", 0x04, NULL);
+			break;
+		case ACTION_RECONNECT:
+			// closed from the callback, then opened again once it's gone
+			client->closing = true;
+			if (client->wsi) {
+				lws_callback_on_writable(client->wsi);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static void ClientSchedule(struct Client* client, enum ClientAction action, double at) {
+	client->action = action;
+	client->action_at = at;
+}
+
+enum Record {
+	RECORD_OTHER,
+	RECORD_COOKIE,
+	RECORD_OK,
+	RECORD_ERR,
+	RECORD_VOTING,
+	RECORD_DEADLINE,
+	RECORD_CAN_VETO,
+	RECORD_END,
+	RECORD_RESULT,
+	RECORD_VETO,
+	RECORD_THE_END,
+	RECORD_REJECTED,
+};
+
+// str is the payload of cookie and X records, left the ms until the deadline of D records
+static void HandleRecord(struct Client* client, enum Record record, const char* str, intptr_t left) {
+	double now = Now();
+	load.rx_records++;
+
+	if (record == RECORD_REJECTED) {
+		fprintf(stderr, "%s %u: rejected by the server: %s\n", client->index ? "player" : "monitor", client->index, str);
+		return;
+	}
+
+	if (client->index == 0) {
+		// the monitor keeps track of the votings
+		switch (record) {
+			case RECORD_DEADLINE:
+				load.deadline = now + left / 1000.0;
+				break;
+			case RECORD_RESULT:
+			case RECORD_VETO:
+				load.over_at = now;
+				break;
+			case RECORD_THE_END:
+				load.over_at = now;
+				load.game_over = true;
+				break;
+			default:
+				break;
+		}
+		return;
+	}
+
+	switch (record) {
+		case RECORD_COOKIE:
+			if (client->joined) {
+				break;
+			}
+			snprintf(client->cookie, sizeof(client->cookie), "%s", str);
+			client->joined = true;
+			load.joined++;
+			SampleAdd(&load.join, (now - client->sent_at) * 1000);
+			break;
+		case RECORD_OK:
+			SampleAdd(&load.reconnect, (now - client->opened_at) * 1000);
+			break;
+		case RECORD_ERR:
+			fprintf(stderr, "player %u: cookie not accepted\n", client->index);
+			client->ended = true;
+			break;
+		case RECORD_VOTING:
+			if (client->ended) {
+				break;
+			}
+			load.expected++;
+			if (Roll(options.reconnect)) {
+				ClientSchedule(client, ACTION_RECONNECT, now + Within(options.delay));
+			} else if (!Roll(options.abstain)) {
+				client->choice = rand() % 2;
+				ClientSchedule(client, ACTION_VOTE, now + Within(options.delay));
+			}
+			break;
+		case RECORD_CAN_VETO:
+			if (Roll(options.veto)) {
+				ClientSchedule(client, ACTION_VETO, now + Within(options.delay));
+			}
+			break;
+		case RECORD_END:
+			if (!client->ended) {
+				client->ended = true;
+				load.ended++;
+			}
+			break;
+		case RECORD_RESULT:
+			load.results++;
+			if (load.deadline) {
+				SampleAdd(&load.result, (now - load.deadline) * 1000);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static void HandleText(struct Client* client, char* msg) {
+	// batched frames carry several records separated by newlines
+	char* line = msg;
+	while (line) {
+		char* next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		}
+		if (strncmp(line, "cookie:", 7) == 0) {
+			HandleRecord(client, RECORD_COOKIE, line + 7, 0);
+		} else if (strcmp(line, "ok") == 0) {
+			HandleRecord(client, RECORD_OK, NULL, 0);
+		} else if (strcmp(line, "err") == 0) {
+			HandleRecord(client, RECORD_ERR, NULL, 0);
+		} else if (strcmp(line, "canVeto") == 0) {
+			HandleRecord(client, RECORD_CAN_VETO, NULL, 0);
+		} else if (strcmp(line, "end") == 0) {
+			HandleRecord(client, RECORD_END, NULL, 0);
+		} else if (strcmp(line, "V") == 0) {
+			HandleRecord(client, RECORD_VOTING, NULL, 0);
+		} else if (line[0] == 'D') {
+			// D{deadline},{left}
+			char* comma = strchr(line, ',');
+			HandleRecord(client, RECORD_DEADLINE, NULL, comma ? strtol(comma + 1, NULL, 10) : 0);
+		} else if (line[0] == 'E') {
+			HandleRecord(client, RECORD_RESULT, NULL, 0);
+		} else if (line[0] == 'v') {
+			HandleRecord(client, RECORD_VETO, NULL, 0);
+		} else if (line[0] == 'T') {
+			HandleRecord(client, RECORD_THE_END, NULL, 0);
+		} else if (line[0] == 'X') {
+			HandleRecord(client, RECORD_REJECTED, line + 1, 0);
+		} else if (line[0]) {
+			HandleRecord(client, RECORD_OTHER, NULL, 0);
+		}
+		line = next;
+	}
+}
+
+static void HandleBinary(struct Client* client, unsigned char* pos, unsigned char* end) {
+	while (pos < end) {
+		unsigned char opcode = *pos++;
+		intptr_t numbers[2] = {0};
+		char* str = NULL;
+		bool ok;
+
+		// payloads of interest get decoded, the rest skipped over by their shape
+		switch (opcode) {
+			case 'k':
+			case 'X':
+				ok = (str = VetoReadString(&pos, end)) != NULL;
+				break;
+			case 'D':
+				ok = VetoReadNumbers(&pos, end, numbers, 2);
+				break;
+			default:
+				ok = VetoSkipPayload(opcode, &pos, end);
+				break;
+		}
+		if (!ok) {
+			fprintf(stderr, "player %u: malformed veto-bin record 0x%02x\n", client->index, opcode);
+			return;
+		}
+
+		switch (opcode) {
+			case 'k':
+				HandleRecord(client, RECORD_COOKIE, str, 0);
+				break;
+			case 'X':
+				HandleRecord(client, RECORD_REJECTED, str, 0);
+				break;
+			case 'o':
+				HandleRecord(client, RECORD_OK, NULL, 0);
+				break;
+			case '!':
+				HandleRecord(client, RECORD_ERR, NULL, 0);
+				break;
+			case 'x':
+				HandleRecord(client, RECORD_CAN_VETO, NULL, 0);
+				break;
+			case 'e':
+				HandleRecord(client, RECORD_END, NULL, 0);
+				break;
+			case 'V':
+				HandleRecord(client, RECORD_VOTING, NULL, 0);
+				break;
+			case 'D':
+				HandleRecord(client, RECORD_DEADLINE, NULL, numbers[1]);
+				break;
+			case 'E':
+				HandleRecord(client, RECORD_RESULT, NULL, 0);
+				break;
+			case 'v':
+				HandleRecord(client, RECORD_VETO, NULL, 0);
+				break;
+			case 'T':
+				HandleRecord(client, RECORD_THE_END, NULL, 0);
+				break;
+			default:
+				HandleRecord(client, RECORD_OTHER, NULL, 0);
+				break;
+		}
+	}
+}
+
+static void ClientLost(struct Client* client) {
+	client->wsi = NULL;
+	client->action = ACTION_NONE;
+	if (client->closing) {
+		ClientSchedule(client, ACTION_OPEN, Now());
+	} else if (client->index == 0) {
+		fprintf(stderr, "monitor: connection lost\n");
+		load.game_over = true;
+		load.over_at = 0; // nothing more to wait for
+	} else if (client->joined && !client->ended) {
+		// like a phone would
+		load.dropped++;
+		ClientSchedule(client, ACTION_OPEN, Now() + LOADGEN_RETRY);
+	} else if (!client->joined) {
+		load.failed++;
+	}
+}
+
+static int LoadCallback(struct lws* wsi, enum lws_callback_reasons reason, void* user, void* in, size_t len) {
+	struct Client* client = user;
+
+	if (reason == LWS_CALLBACK_PROTOCOL_INIT || !client) {
+		return 0;
+	}
+
+	switch (reason) {
+		case LWS_CALLBACK_CLIENT_ESTABLISHED:
+			load.connecting--;
+			if (client->index == 0) {
+				ClientSend(client, "{\"type\":\"monitor\",\"batch\":true}", 0x01, NULL);
+			} else if (client->joined) {
+				ClientSend(client, "{\"type\":\"reconnect\",\"cookie\":\"%s\",\"batch\":true}", 0x06, client->cookie);
+			} else {
+				char nick[16];
+				snprintf(nick, sizeof(nick), "load%u", client->index);
+				SampleAdd(&load.connect, (Now() - client->opened_at) * 1000);
+				client->sent_at = Now();
+				ClientSend(client, "{\"type\":\"join\",\"nick\":\"%s\",\"batch\":true}", 0x05, nick);
+			}
+			break;
+
+		case LWS_CALLBACK_CLIENT_WRITEABLE:
+			if (client->closing) {
+				return -1;
+			}
+			if (client->out_length) {
+				size_t length = client->out_length;
+				client->out_length = 0;
+				if (lws_write(wsi, client->out + LWS_PRE, length, client->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT) < 0) {
+					return -1;
+				}
+			}
+			break;
+
+		case LWS_CALLBACK_CLIENT_RECEIVE:
+			// messages may come in several fragments; handled once complete
+			if (client->rx_length + len + 1 > client->rx_capacity) {
+				client->rx_capacity = (client->rx_length + len + 1) * 2;
+				client->rx = realloc(client->rx, client->rx_capacity);
+			}
+			memcpy(client->rx + client->rx_length, in, len);
+			client->rx_length += len;
+			if (lws_is_final_fragment(wsi) && !lws_remaining_packet_payload(wsi)) {
+				load.rx_messages++;
+				client->rx[client->rx_length] = '\0';
+				if (lws_frame_is_binary(wsi)) {
+					HandleBinary(client, (unsigned char*)client->rx, (unsigned char*)client->rx + client->rx_length);
+				} else {
+					HandleText(client, client->rx);
+				}
+				client->rx_length = 0;
+			}
+			break;
+
+		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+			load.connecting--;
+			ClientLost(client);
+			break;
+
+		case LWS_CALLBACK_CLOSED:
+		case LWS_CALLBACK_CLIENT_CLOSED:
+			ClientLost(client);
+			break;
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+static struct lws_protocols protocols[] = {
+	{.name = "veto", .callback = LoadCallback, .rx_buffer_size = 1024},
+	{.name = "veto-bin", .callback = LoadCallback, .rx_buffer_size = 1024},
+	{.callback = NULL} /* terminator */
+};
+
+static const struct lws_extension extensions[] = {
+	{"permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate; client_max_window_bits"},
+	{NULL, NULL, NULL} /* terminator */
+};
+
+static void Usage(const char* name) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -H host       server address (%s)\n"
+		"  -p port       server port (%d)\n"
+		"  -u path       room (%s)\n"
+		"  -n players    simulated players (%u)\n"
+		"  -v votings    votings to run (%u)\n"
+		"  -c count      handshakes in flight at a time while joining (%u)\n"
+		"  -d seconds    votes and vetos come within this long after V (%.1f)\n"
+		"  -b percent    players speaking veto-bin instead of veto (%d)\n"
+		"  -a percent    players abstaining in a voting (%d)\n"
+		"  -r percent    players dropping and reconnecting with their cookie in a voting (%d)\n"
+		"  -x percent    players using the veto when they can (%d)\n",
+		name, options.host, options.port, options.path, options.players, options.votings, options.handshakes,
+		options.delay, options.binary, options.abstain, options.reconnect, options.veto);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:u:n:v:c:d:b:a:r:x:")) != -1) {
+		switch (opt) {
+			case 'H': options.host = optarg; break;
+			case 'p': options.port = strtol(optarg, NULL, 10); break;
+			case 'u': options.path = optarg; break;
+			case 'n': options.players = strtoul(optarg, NULL, 10); break;
+			case 'v': options.votings = strtoul(optarg, NULL, 10); break;
+			case 'c': options.handshakes = strtoul(optarg, NULL, 10); break;
+			case 'd': options.delay = strtod(optarg, NULL); break;
+			case 'b': options.binary = strtol(optarg, NULL, 10); break;
+			case 'a': options.abstain = strtol(optarg, NULL, 10); break;
+			case 'r': options.reconnect = strtol(optarg, NULL, 10); break;
+			case 'x': options.veto = strtol(optarg, NULL, 10); break;
+			default:
+				Usage(argv[0]);
+				return 1;
+		}
+	}
+	if (options.delay > LOADGEN_VOTING_TIME - 1) {
+		options.delay = LOADGEN_VOTING_TIME - 1; // or the votes would miss the deadline
+	}
+	if (!options.handshakes) {
+		options.handshakes = 1;
+	}
+
+	srand(time(NULL));
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	struct lws_context_creation_info info = {};
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.protocols = protocols;
+	info.extensions = extensions;
+	info.gid = -1;
+	info.uid = -1;
+	info.timeout_secs = 10;
+	load.context = lws_create_context(&info);
+	if (!load.context) {
+		fprintf(stderr, "Failed to create context!\n");
+		return 1;
+	}
+
+	load.clients = calloc(options.players + 1, sizeof(struct Client));
+	unsigned int binary = 0;
+	for (unsigned int i = 0; i <= options.players; i++) {
+		load.clients[i].index = i;
+		load.clients[i].binary = i && Roll(options.binary);
+		binary += load.clients[i].binary;
+	}
+	struct Client* monitor = &load.clients[0];
+	ClientOpen(monitor);
+
+	double start = Now();
+	double next_sample = start + 1, next_voting = 0, voting_at = 0;
+	uint64_t last_messages = 0, last_records = 0;
+	bool started = false;
+
+	while (!load.game_over || load.over_at) {
+		lws_service(load.context, 10);
+		double now = Now();
+
+		// joining, at most options.handshakes at a time
+		while (load.opened < options.players && load.connecting < options.handshakes) {
+			ClientOpen(&load.clients[++load.opened]);
+		}
+
+		for (unsigned int i = 0; i <= options.players; i++) {
+			if (load.clients[i].action && now >= load.clients[i].action_at) {
+				ClientAct(&load.clients[i]);
+			}
+		}
+
+		if (now >= next_sample) {
+			if (voting_at) {
+				SampleAdd(&load.messages, load.rx_messages - last_messages);
+				SampleAdd(&load.records, load.rx_records - last_records);
+			}
+			last_messages = load.rx_messages;
+			last_records = load.rx_records;
+			next_sample += 1;
+		}
+
+		if (!started) {
+			if (monitor->wsi && load.opened == options.players && load.joined + load.failed == options.players) {
+				printf("%u players joined in %.1f s, %u failed\n", load.joined, now - start, load.failed);
+				ClientSend(monitor, "{\"type\":\"start\"}", 0x02, NULL);
+				started = true;
+				next_voting = now + LOADGEN_SETTLE;
+			} else if (!load.connecting && load.opened == options.players && now - start > 60) {
+				fprintf(stderr, "gave up waiting for the players to join\n");
+				break;
+			}
+			continue;
+		}
+
+		if (next_voting) {
+			if (now < next_voting) {
+				continue;
+			}
+			if (load.voting == options.votings || load.game_over) {
+				break;
+			}
+			load.voting++;
+			load.deadline = 0;
+			load.over_at = 0;
+			load.expected = 0;
+			load.results = 0;
+			voting_at = now;
+			next_voting = 0;
+			ClientSend(monitor, "{\"type\":\"voting\"}", 0x03, NULL);
+			continue;
+		}
+
+		// until all the E records are in, or it's clear some won't come
+		if ((load.over_at && (load.results >= load.expected || now - load.over_at > LOADGEN_SETTLE)) ||
+			now - voting_at > LOADGEN_VOTING_TIME + 10) {
+			printf("voting %u: %u of %u players got the result, %u ended, %u dropped so far\n", load.voting, load.results,
+				load.expected, load.ended, load.dropped);
+			next_voting = now + LOADGEN_SETTLE;
+		}
+	}
+
+	printf("\n%u players (%u veto-bin), %u votings, %u failed to join, %u drops\n", options.players, binary, load.voting,
+		load.failed, load.dropped);
+	printf("%-10s %8s %10s %10s %10s %10s %10s\n", "", "samples", "min", "p50", "p90", "p99", "max");
+	SampleReport("connect", &load.connect);
+	SampleReport("join", &load.join);
+	SampleReport("reconnect", &load.reconnect);
+	SampleReport("result", &load.result);
+	SampleReport("msgs/s", &load.messages);
+	SampleReport("records/s", &load.records);
+
+	lws_context_destroy(load.context);
+	for (unsigned int i = 0; i <= options.players; i++) {
+		free(load.clients[i].rx);
+	}
+	free(load.clients);
+	return 0;
+}
@@ -20,9 +20,9 @@
 
 #include "common.h"
 #include "defines.h"
-#include <libsuperderpy.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 
 static void derp(int sig) {
 	ssize_t __attribute__((unused)) n = write(STDERR_FILENO, "Segmentation fault\nI just don't know what went wrong!\n", 54);
@@ -34,22 +34,72 @@ int main(int argc, char** argv) {
 
 	srand(time(NULL));
 
+	// veto-headless is this with headless.c in place of the engine: no intros, assets, sound or
+	// drawing, no display or audio device, for soak runs against veto-loadgen. --replay <file> plays
+	// a capture back instead of connecting, --replay-speed <n> times faster (0 as fast as possible).
+	// The engine doesn't know these, so they're taken out of argv (argv[argc] stays NULL).
+#ifdef VETO_HEADLESS
+	bool headless = true;
+#else
+	bool headless = false;
+#endif
+	char *replay = NULL, *speed = NULL;
+	for (int i = 1; i < argc; i++) {
+		int taken = 0;
+		if (strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+			taken = 1;
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay = argv[i + 1];
+			taken = 2;
+		} else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) {
+			speed = argv[i + 1];
+			taken = 2;
+		}
+		if (taken) {
+			memmove(&argv[i], &argv[i + taken], (argc - i - taken + 1) * sizeof(char*));
+			argc -= taken;
+			i--;
+		}
+	}
+
+#ifndef VETO_HEADLESS
+	if (headless) {
+		fprintf(stderr, "--headless: run veto-headless instead, it needs neither a display nor an audio device\n");
+		return 1;
+	}
+#endif
+
 	al_set_org_name("dosowisko.net");
 	al_set_app_name(LIBSUPERDERPY_GAMENAME_PRETTY);
 
 	struct Game* game = libsuperderpy_init(argc, argv, LIBSUPERDERPY_GAMENAME, (struct Viewport){.width = 1920, .height = 1080});
 	if (!game) { return 1; }
 
-	al_set_window_title(game->display, LIBSUPERDERPY_GAMENAME_PRETTY);
-
-	LoadGamestate(game, "dosowisko");
-	LoadGamestate(game, "holypangolin");
-	StartGamestate(game, "dosowisko");
+	if (game->display) {
+		al_set_window_title(game->display, LIBSUPERDERPY_GAMENAME_PRETTY);
+	}
 
 	game->data = CreateGameData(game);
+	game->data->headless = headless;
+	game->data->replay = replay;
+	game->data->replay_speed = speed ? strtod(speed, NULL) : 1;
+
+	if (headless || replay) {
+		LoadGamestate(game, "parliament");
+		StartGamestate(game, "parliament");
+	} else {
+		LoadGamestate(game, "dosowisko");
+		LoadGamestate(game, "holypangolin");
+		StartGamestate(game, "dosowisko");
+	}
 
 	game->handlers.event = &GlobalEventHandler;
 	game->handlers.destroy = &DestroyGameData;
+	game->handlers.prelogic = &ProfilePreLogic;
+	game->handlers.postlogic = &ProfilePostLogic;
+	game->handlers.predraw = &ProfilePreDraw;
+	game->handlers.postdraw = &ProfilePostDraw;
 
 	return libsuperderpy_run(game);
 }
@@ -0,0 +1,148 @@
+/*! \file protocol.c
+ *  \brief Decoding of veto-bin records, shared by the monitor and veto-loadgen.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "protocol.h"
+#include <string.h>
+
+// Kept free of Allegro and libwebsockets, so veto-loadgen builds it as it is and can't drift
+// from the protocol the monitor speaks.
+
+const enum VetoPayload VetoPayloads[256] = {
+	['S'] = VETO_PAYLOAD_NONE,
+	['V'] = VETO_PAYLOAD_NONE,
+	['e'] = VETO_PAYLOAD_NONE, // end
+	['x'] = VETO_PAYLOAD_NONE, // canVeto
+	['o'] = VETO_PAYLOAD_NONE, // ok
+	['!'] = VETO_PAYLOAD_NONE, // err
+	['C'] = VETO_PAYLOAD_INTEGER,
+	['F'] = VETO_PAYLOAD_INTEGER,
+	['A'] = VETO_PAYLOAD_INTEGER,
+	['N'] = VETO_PAYLOAD_INTEGER,
+	['P'] = VETO_PAYLOAD_INTEGER,
+	['t'] = VETO_PAYLOAD_INTEGER,
+	['s'] = VETO_PAYLOAD_INTEGER, // score
+	['j'] = VETO_PAYLOAD_INTEGER,
+	['l'] = VETO_PAYLOAD_INTEGER,
+	['r'] = VETO_PAYLOAD_INTEGER,
+	['E'] = VETO_PAYLOAD_BYTE,
+	['v'] = VETO_PAYLOAD_STRING,
+	['T'] = VETO_PAYLOAD_STRING,
+	['J'] = VETO_PAYLOAD_STRING,
+	['L'] = VETO_PAYLOAD_STRING,
+	['R'] = VETO_PAYLOAD_STRING,
+	['X'] = VETO_PAYLOAD_STRING,
+	['k'] = VETO_PAYLOAD_STRING, // cookie
+	['n'] = VETO_PAYLOAD_STRING, // nick
+	['W'] = VETO_PAYLOAD_WINNER,
+	['I'] = VETO_PAYLOAD_PLAYER,
+	['D'] = VETO_PAYLOAD_TWO,
+	['K'] = VETO_PAYLOAD_TWO,
+	['Y'] = VETO_PAYLOAD_THREE,
+	['Z'] = VETO_PAYLOAD_SNAPSHOT,
+	['B'] = VETO_PAYLOAD_BOARD,
+};
+
+bool VetoReadVarint(unsigned char** pos, unsigned char* end, uintmax_t* value) {
+	unsigned int shift = 0;
+	*value = 0;
+	while (*pos < end && shift < 64) {
+		unsigned char byte = *(*pos)++;
+		*value |= (uintmax_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+		shift += 7;
+	}
+	return false;
+}
+
+bool VetoReadNumbers(unsigned char** pos, unsigned char* end, intptr_t* numbers, int count) {
+	uintmax_t value;
+	for (int i = 0; i < count; i++) {
+		if (!VetoReadVarint(pos, end, &value)) {
+			return false;
+		}
+		numbers[i] = (intptr_t)(value >> 1) ^ -(intptr_t)(value & 1); // zigzag
+	}
+	return true;
+}
+
+// Strings are length-prefixed. To terminate one in place it gets moved over its own
+// length prefix, which frees at least one byte for the terminator within the record.
+char* VetoReadString(unsigned char** pos, unsigned char* end) {
+	unsigned char* start = *pos;
+	uintmax_t length;
+	if (!VetoReadVarint(pos, end, &length) || length > (uintmax_t)(end - *pos)) {
+		return NULL;
+	}
+	memmove(start, *pos, length);
+	start[length] = '\0';
+	*pos += length;
+	return (char*)start;
+}
+
+// Steps over the payload of a record that isn't of interest. False if the opcode is unknown or
+// the payload cut short; there's no way to know where the next record starts then.
+bool VetoSkipPayload(unsigned char opcode, unsigned char** pos, unsigned char* end) {
+	intptr_t numbers[9];
+	uintmax_t count;
+
+	switch (VetoPayloads[opcode]) {
+		case VETO_PAYLOAD_UNKNOWN:
+			return false;
+		case VETO_PAYLOAD_NONE:
+			return true;
+		case VETO_PAYLOAD_INTEGER:
+			return VetoReadNumbers(pos, end, numbers, 1);
+		case VETO_PAYLOAD_BYTE:
+			return (*pos)++ < end;
+		case VETO_PAYLOAD_STRING:
+			return VetoReadString(pos, end) != NULL;
+		case VETO_PAYLOAD_WINNER:
+			return (*pos)++ < end && VetoReadString(pos, end);
+		case VETO_PAYLOAD_PLAYER:
+			return VetoReadNumbers(pos, end, numbers, 1) && VetoReadString(pos, end);
+		case VETO_PAYLOAD_TWO:
+			return VetoReadNumbers(pos, end, numbers, 2);
+		case VETO_PAYLOAD_THREE:
+			return VetoReadNumbers(pos, end, numbers, 3);
+		case VETO_PAYLOAD_SNAPSHOT:
+			if (!VetoReadNumbers(pos, end, numbers, 9)) {
+				return false;
+			}
+			for (int i = 0; i < 4; i++) {
+				if (!VetoReadString(pos, end)) {
+					return false;
+				}
+			}
+			return true;
+		case VETO_PAYLOAD_BOARD:
+			if (!VetoReadVarint(pos, end, &count)) {
+				return false;
+			}
+			for (uintmax_t i = 0; i < count; i++) {
+				if (!VetoReadNumbers(pos, end, numbers, 1) || !VetoReadString(pos, end)) {
+					return false;
+				}
+			}
+			return true;
+	}
+	return false;
+}
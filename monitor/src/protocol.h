@@ -0,0 +1,46 @@
+/*! \file protocol.h
+ *  \brief Decoding of veto-bin records, shared by the monitor and veto-loadgen.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The shape of the payload after each server -> client opcode, see server/proto.js.
+enum VetoPayload {
+	VETO_PAYLOAD_UNKNOWN = 0,
+	VETO_PAYLOAD_NONE,
+	VETO_PAYLOAD_INTEGER,
+	VETO_PAYLOAD_BYTE, // E
+	VETO_PAYLOAD_STRING,
+	VETO_PAYLOAD_WINNER, // byte, then a string
+	VETO_PAYLOAD_PLAYER, // integer, then a string
+	VETO_PAYLOAD_TWO, // integers
+	VETO_PAYLOAD_THREE,
+	VETO_PAYLOAD_SNAPSHOT, // nine integers, then four strings
+	VETO_PAYLOAD_BOARD, // count, then that many pairs of an integer and a string
+};
+
+extern const enum VetoPayload VetoPayloads[256];
+
+bool VetoReadVarint(unsigned char** pos, unsigned char* end, uintmax_t* value);
+bool VetoReadNumbers(unsigned char** pos, unsigned char* end, intptr_t* numbers, int count);
+char* VetoReadString(unsigned char** pos, unsigned char* end);
+bool VetoSkipPayload(unsigned char opcode, unsigned char** pos, unsigned char* end);
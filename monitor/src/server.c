@@ -0,0 +1,1467 @@
+/*! \file server.c
+ *  \brief Embedded game server.
+ */
+/*
+ * Copyright (c) Sebastian Krzyszkowiak <dos@dosowisko.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include <libwebsockets.h>
+#include <math.h>
+
+// A port of server/server.js, enabled with veto/embedded_server. It listens on its own vhost of the
+// shared lws context and everything in here runs on the network thread. Players connect to it with
+// the same protocols as to the Node server, while the local monitor skips the socket: its commands
+// come straight from the send queue and its records get pushed to the receive queue.
+//
+// The rules follow server/room.js: votings close on a deadline (D, and C only with veto/counter),
+// players are found by cookie and ranked on a leaderboard (B), and the monitor gets the live tally (Y)
+// and timestamps (t) it asks for. Left out, as nothing a LAN game with a local monitor needs:
+// - rooms: every URL path plays the same game
+// - the journal: a restart starts over
+// - the sharded mode, the periodic audit of the counts and the debug command
+// - player ids (I, j, l, r): only veto-bin monitors use them and the local one speaks text;
+//   remote monitors aren't taken at all
+
+#define VETO_VOTING_TIME 5
+#define VETO_COOKIE_LENGTH 32
+#define VETO_NICK_LENGTH 64
+#define VETO_BOARD_SIZE 10 // entries in a B record
+
+// flags of the 0x0a registration, see server/proto.js
+#define VETO_MONITOR_TIMESTAMPS 1
+#define VETO_MONITOR_LIVE 2
+#define VETO_MONITOR_LEADERBOARD 4
+
+enum VetoServerPayload {
+	PAYLOAD_NONE,
+	PAYLOAD_INTEGER,
+	PAYLOAD_INTEGERS,
+	PAYLOAD_RESULT,
+	PAYLOAD_STRING,
+	PAYLOAD_WINNER,
+};
+
+enum VetoServerRecord {
+	RECORD_START,
+	RECORD_VOTING,
+	RECORD_COUNTER,
+	RECORD_FOR,
+	RECORD_AGAINST,
+	RECORD_ABSTAINED,
+	RECORD_RESULT,
+	RECORD_VETO,
+	RECORD_THE_END,
+	RECORD_WINNER,
+	RECORD_PLAYERS,
+	RECORD_JOIN,
+	RECORD_LEAVE,
+	RECORD_RECONNECT,
+	RECORD_COOKIE,
+	RECORD_NICK,
+	RECORD_SCORE,
+	RECORD_END,
+	RECORD_CAN_VETO,
+	RECORD_OK,
+	RECORD_ERR,
+	RECORD_REJECTED,
+	RECORD_DEADLINE,
+	RECORD_CLOCK,
+	RECORD_TALLY,
+	RECORD_TIMESTAMP,
+	RECORD_COUNT,
+};
+
+// must match server/proto.js; superseded ones are those a newer one of makes the older one
+// pointless, same as SUPERSEDED in server/transport.js
+static const struct {
+	const char* text;
+	unsigned char opcode;
+	enum VetoServerPayload payload;
+	bool superseded;
+	int count; // of PAYLOAD_INTEGERS
+} ServerRecords[] = {
+	[RECORD_START] = {"S", 0x53, PAYLOAD_NONE},
+	[RECORD_VOTING] = {"V", 0x56, PAYLOAD_NONE},
+	[RECORD_COUNTER] = {"C", 0x43, PAYLOAD_INTEGER, true},
+	[RECORD_FOR] = {"F", 0x46, PAYLOAD_INTEGER},
+	[RECORD_AGAINST] = {"A", 0x41, PAYLOAD_INTEGER},
+	[RECORD_ABSTAINED] = {"N", 0x4e, PAYLOAD_INTEGER},
+	[RECORD_RESULT] = {"E", 0x45, PAYLOAD_RESULT},
+	[RECORD_VETO] = {"v", 0x76, PAYLOAD_STRING},
+	[RECORD_THE_END] = {"T", 0x54, PAYLOAD_STRING},
+	[RECORD_WINNER] = {"W", 0x57, PAYLOAD_WINNER},
+	[RECORD_PLAYERS] = {"P", 0x50, PAYLOAD_INTEGER, true},
+	[RECORD_JOIN] = {"J", 0x4a, PAYLOAD_STRING},
+	[RECORD_LEAVE] = {"L", 0x4c, PAYLOAD_STRING},
+	[RECORD_RECONNECT] = {"R", 0x52, PAYLOAD_STRING},
+	[RECORD_COOKIE] = {"cookie:", 0x6b, PAYLOAD_STRING},
+	[RECORD_NICK] = {"nick:", 0x6e, PAYLOAD_STRING},
+	[RECORD_SCORE] = {"score:", 0x73, PAYLOAD_INTEGER, true},
+	[RECORD_END] = {"end", 0x65, PAYLOAD_NONE},
+	[RECORD_CAN_VETO] = {"canVeto", 0x78, PAYLOAD_NONE},
+	[RECORD_OK] = {"ok", 0x6f, PAYLOAD_NONE},
+	[RECORD_ERR] = {"err", 0x21, PAYLOAD_NONE},
+	[RECORD_REJECTED] = {"X", 0x58, PAYLOAD_STRING},
+	[RECORD_DEADLINE] = {"D", 0x44, PAYLOAD_INTEGERS, true, 2},
+	[RECORD_CLOCK] = {"K", 0x4b, PAYLOAD_INTEGERS, false, 2},
+	[RECORD_TALLY] = {"Y", 0x59, PAYLOAD_INTEGERS, true, 3},
+	[RECORD_TIMESTAMP] = {"t", 0x74, PAYLOAD_INTEGER, true},
+};
+
+typedef enum {
+	COMMAND_UNKNOWN,
+	COMMAND_MONITOR,
+	COMMAND_START,
+	COMMAND_VOTING,
+	COMMAND_VETO,
+	COMMAND_JOIN,
+	COMMAND_RECONNECT,
+	COMMAND_VOTE,
+	COMMAND_CLOCK,
+} VETO_SERVER_COMMAND_TYPE;
+
+struct VetoServerCommand {
+	VETO_SERVER_COMMAND_TYPE type;
+	char str[VETO_NICK_LENGTH]; // nick or cookie
+	int choice; // 1 for, 0 against, -1 abstained
+	bool batch;
+	unsigned int flags; // VETO_MONITOR_* of a monitor registration
+	intptr_t time; // of a clock probe
+};
+
+struct VetoPlayer {
+	char name[VETO_NICK_LENGTH];
+	char cookie[VETO_COOKIE_LENGTH + 1];
+	int score;
+	int vote; // 1 for, 0 against, -1 abstained
+	bool vetoRight, ended, connected;
+	struct VetoPeer* peer; // latest connection, NULL once it's closed
+	struct VetoPlayer *rank_prev, *rank_next; // among the players with the same score, see BoardAdd
+};
+
+// The players with one score on the leaderboard, in the order they got it
+struct VetoScore {
+	int score;
+	struct VetoPlayer *first, *last;
+};
+
+struct VetoPeer {
+	// per-connection user data, allocated by lws
+	struct lws* wsi;
+	struct VetoPlayer* player;
+	bool binary, batch;
+	struct WebSocketBuffer* rx; // message being reassembled
+	struct WebSocketBuffer* tx; // LWS_PRE bytes of headroom, then the records already written and
+	                            // the ones waiting for the connection to become writeable
+	size_t tx_sent; // offset in tx of the first record that hasn't been written yet
+	struct {
+		size_t offset, length; // in tx, 0 length if there's none waiting
+	} waiting[RECORD_COUNT]; // the latest superseded record of each type
+	bool cutOff; // too far behind, being closed
+	struct VetoPeer *prev, *next;
+};
+
+struct VetoServer {
+	struct lws_vhost* vhost;
+	struct VetoPeer* peers;
+	struct VetoPlayer** players; // in the order they joined
+	size_t players_count, players_capacity;
+	struct VetoPlayer** cookies; // hash table of the same players by cookie, kept at most half full
+	size_t cookies_capacity;
+	struct VetoScore* scores; // the leaderboard: distinct scores in ascending order, as in server/leaderboard.js
+	size_t scores_count, scores_capacity;
+	int connected; // players whose latest connection is open, what P reports
+	int active; // connections that joined or reconnected, counted as voters
+	bool monitor; // whether the local monitor has registered
+	bool timestamps, live, leaderboard; // what it asked for, see RegisterMonitor
+	struct WebSocketBuffer* feed; // records for the local monitor, gathered during one iteration
+	bool board_due; // the leaderboard changed since the last B
+
+	bool started, voting, canVeto;
+	int round, vetos;
+	intptr_t deadline; // voting clock time when the voting closes, see Clock
+	bool counter; // veto/counter: broadcast C every second too, for clients that don't know D
+	int countdown; // the next C to broadcast, -1 if there are no more
+	struct VetoPlayer* vetoers[3];
+	int results[3];
+	char* winners[4];
+	int tally[2]; // running for/against totals of the current voting
+	intptr_t tally_interval; // ms between Y records, 0 for none (veto/live_tally_hz)
+	intptr_t tally_at; // voting clock time when the live tally is due, 0 if nothing changed
+
+	// backpressure, as in server/transport.js: a peer with more than high_water bytes waiting gets
+	// only the latest of the superseded records, one with more than budget bytes gets cut off
+	size_t high_water, budget; // veto/send_high_water, veto/send_budget
+};
+
+// Records
+
+static void AppendVarint(struct WebSocketBuffer* out, uintmax_t value) {
+	unsigned char bytes[10];
+	size_t length = 0;
+	while (value > 0x7f) {
+		bytes[length++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	bytes[length++] = value;
+	BufferAppend(out, bytes, length);
+}
+
+static void AppendString(struct WebSocketBuffer* out, const char* str) {
+	BufferAppend(out, str, strlen(str));
+}
+
+static void AppendZigzag(struct WebSocketBuffer* out, intptr_t number) {
+	AppendVarint(out, number >= 0 ? (uintmax_t)number * 2 : (uintmax_t)(-number) * 2 - 1);
+}
+
+// numbers holds as many as the payload takes, the first one otherwise
+static void AppendRecord(struct WebSocketBuffer* out, bool binary, enum VetoServerRecord type, const intptr_t* numbers, const char* str) {
+	intptr_t number = numbers[0];
+	char buf[32];
+
+	if (!binary) {
+		AppendString(out, ServerRecords[type].text);
+		switch (ServerRecords[type].payload) {
+			case PAYLOAD_NONE:
+				break;
+			case PAYLOAD_INTEGER:
+				snprintf(buf, sizeof(buf), "%ld", (long)number);
+				AppendString(out, buf);
+				break;
+			case PAYLOAD_INTEGERS:
+				for (int i = 0; i < ServerRecords[type].count; i++) {
+					snprintf(buf, sizeof(buf), i ? ",%ld" : "%ld", (long)numbers[i]);
+					AppendString(out, buf);
+				}
+				break;
+			case PAYLOAD_RESULT:
+				AppendString(out, number ? "F" : "A");
+				break;
+			case PAYLOAD_WINNER:
+				snprintf(buf, sizeof(buf), "%d", (int)number);
+				AppendString(out, buf);
+				// fallthrough
+			case PAYLOAD_STRING:
+				AppendString(out, str);
+				break;
+		}
+		return;
+	}
+
+	unsigned char byte = ServerRecords[type].opcode;
+	BufferAppend(out, &byte, 1);
+	switch (ServerRecords[type].payload) {
+		case PAYLOAD_NONE:
+			break;
+		case PAYLOAD_INTEGER:
+			AppendZigzag(out, number);
+			break;
+		case PAYLOAD_INTEGERS:
+			for (int i = 0; i < ServerRecords[type].count; i++) {
+				AppendZigzag(out, numbers[i]);
+			}
+			break;
+		case PAYLOAD_RESULT:
+			byte = number ? 1 : 0;
+			BufferAppend(out, &byte, 1);
+			break;
+		case PAYLOAD_WINNER:
+			byte = number;
+			BufferAppend(out, &byte, 1);
+			// fallthrough
+		case PAYLOAD_STRING:
+			AppendVarint(out, strlen(str));
+			AppendString(out, str);
+			break;
+	}
+}
+
+// Takes a record that's still waiting out of tx, along with the newline that separates it
+static void PeerDropRecord(struct VetoPeer* peer, size_t offset, size_t length) {
+	struct WebSocketBuffer* tx = peer->tx;
+	if (!peer->binary) {
+		if (offset > peer->tx_sent) {
+			offset--;
+			length++;
+		} else if (offset + length < tx->length) {
+			length++;
+		}
+	}
+	memmove(tx->data + offset, tx->data + offset + length, tx->length - offset - length + 1);
+	tx->length -= length;
+	for (int i = 0; i < RECORD_COUNT; i++) {
+		if (peer->waiting[i].length && peer->waiting[i].offset > offset) {
+			peer->waiting[i].offset -= length;
+		}
+	}
+}
+
+// The next length bytes of tx have been written. What's left gets moved back to right after the
+// headroom once it's no more than what's been written, so tx doesn't keep growing for a peer that
+// never quite catches up.
+static void PeerWritten(struct VetoPeer* peer, size_t length) {
+	struct WebSocketBuffer* tx = peer->tx;
+	size_t sent = peer->tx_sent + length;
+	size_t shift = 0;
+	if (sent - LWS_PRE >= tx->length - sent) {
+		shift = sent - LWS_PRE;
+		memmove(tx->data + LWS_PRE, tx->data + sent, tx->length - sent + 1);
+		tx->length -= shift;
+	}
+	for (int i = 0; i < RECORD_COUNT; i++) {
+		if (peer->waiting[i].offset < sent) {
+			peer->waiting[i].length = 0;
+		} else {
+			peer->waiting[i].offset -= shift;
+		}
+	}
+	peer->tx_sent = sent - shift;
+}
+
+static void PeerSendNumbers(struct Game* game, struct VetoPeer* peer, enum VetoServerRecord type, const intptr_t* numbers, const char* str) {
+	static const char headroom[LWS_PRE];
+	struct VetoServer* server = game->data->ws_server;
+	if (!peer || peer->cutOff) {
+		return;
+	}
+	if (!peer->tx) {
+		peer->tx = BufferAcquire(&game->data->ws_pool);
+		BufferAppend(peer->tx, headroom, LWS_PRE);
+		peer->tx_sent = LWS_PRE;
+	}
+	if (peer->waiting[type].length && peer->tx->length - peer->tx_sent > server->high_water) {
+		PeerDropRecord(peer, peer->waiting[type].offset, peer->waiting[type].length);
+	}
+	if (!peer->binary && peer->tx->length > peer->tx_sent) {
+		AppendString(peer->tx, "\n");
+	}
+	size_t offset = peer->tx->length;
+	AppendRecord(peer->tx, peer->binary, type, numbers, str);
+	if (ServerRecords[type].superseded) {
+		peer->waiting[type].offset = offset;
+		peer->waiting[type].length = peer->tx->length - offset;
+	}
+
+	if (peer->tx->length - peer->tx_sent > server->budget) {
+		PrintConsole(game, "[server] cutting off a connection %zu bytes behind", peer->tx->length - peer->tx_sent);
+		peer->cutOff = true;
+		BufferRelease(&game->data->ws_pool, peer->tx);
+		peer->tx = NULL;
+		lws_set_timeout(peer->wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+		return;
+	}
+	lws_callback_on_writable(peer->wsi);
+}
+
+static void PeerSend(struct Game* game, struct VetoPeer* peer, enum VetoServerRecord type, intptr_t number, const char* str) {
+	PeerSendNumbers(game, peer, type, &number, str);
+}
+
+// The feed, ready for one more record to be appended. What gets gathered during one iteration is
+// one frame to the monitor, so a new feed starts with the t record if it asked for timestamps.
+static struct WebSocketBuffer* MonitorFeed(struct Game* game, struct VetoServer* server) {
+	if (!server->feed) {
+		server->feed = BufferAcquire(&game->data->ws_pool);
+		if (server->timestamps) {
+			intptr_t now = llround(al_get_time() * 1000 + game->data->ws_wallclock_offset);
+			AppendRecord(server->feed, false, RECORD_TIMESTAMP, &now, NULL);
+		}
+	}
+	if (server->feed->length) {
+		AppendString(server->feed, "\n");
+	}
+	return server->feed;
+}
+
+static void MonitorSendNumbers(struct Game* game, struct VetoServer* server, enum VetoServerRecord type, const intptr_t* numbers, const char* str) {
+	if (!server->monitor) {
+		return;
+	}
+	AppendRecord(MonitorFeed(game, server), false, type, numbers, str);
+}
+
+static void MonitorSend(struct Game* game, struct VetoServer* server, enum VetoServerRecord type, intptr_t number, const char* str) {
+	MonitorSendNumbers(game, server, type, &number, str);
+}
+
+static void BroadcastNumbers(struct Game* game, struct VetoServer* server, enum VetoServerRecord type, const intptr_t* numbers, const char* str) {
+	for (struct VetoPeer* peer = server->peers; peer; peer = peer->next) {
+		if (peer->player && !peer->player->ended) {
+			PeerSendNumbers(game, peer, type, numbers, str);
+		}
+	}
+	MonitorSendNumbers(game, server, type, numbers, str);
+}
+
+static void Broadcast(struct Game* game, struct VetoServer* server, enum VetoServerRecord type, intptr_t number, const char* str) {
+	BroadcastNumbers(game, server, type, &number, str);
+}
+
+// Game logic, following server/room.js
+
+// The voting clock: ms on a monotonic clock, which is what the D records count in. Clients get its
+// readings from the clock command to estimate their offset to it.
+static intptr_t Clock(void) {
+	return llround(al_get_time() * 1000);
+}
+
+// Seconds left, as the C records count them: VETO_VOTING_TIME down to 0
+static int Counter(struct VetoServer* server) {
+	int counter = ceil((server->deadline - Clock()) / 1000.0) - 1;
+	return counter < 0 ? 0 : (counter > VETO_VOTING_TIME ? VETO_VOTING_TIME : counter);
+}
+
+// To one player, or the monitor if peer is NULL
+static void SendDeadline(struct Game* game, struct VetoServer* server, struct VetoPeer* peer) {
+	intptr_t left = server->deadline - Clock();
+	intptr_t numbers[2] = {server->deadline, left > 0 ? left : 0};
+	if (peer) {
+		PeerSendNumbers(game, peer, RECORD_DEADLINE, numbers, NULL);
+	} else {
+		MonitorSendNumbers(game, server, RECORD_DEADLINE, numbers, NULL);
+	}
+}
+
+// Leaderboard, as in server/leaderboard.js. Scores only move by small steps, so there are far fewer
+// distinct scores than players; each one has a list of its players, in the order they got it.
+// player->score is owned by the leaderboard, change it with SetScore only.
+
+static size_t BoardSearch(struct VetoServer* server, int score) {
+	size_t low = 0, high = server->scores_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (server->scores[mid].score < score) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static void BoardAdd(struct VetoServer* server, struct VetoPlayer* player) {
+	size_t i = BoardSearch(server, player->score);
+	if (i == server->scores_count || server->scores[i].score != player->score) {
+		if (server->scores_count == server->scores_capacity) {
+			server->scores_capacity = server->scores_capacity ? server->scores_capacity * 2 : 16;
+			server->scores = realloc(server->scores, server->scores_capacity * sizeof(struct VetoScore));
+		}
+		memmove(&server->scores[i + 1], &server->scores[i], (server->scores_count - i) * sizeof(struct VetoScore));
+		server->scores_count++;
+		server->scores[i] = (struct VetoScore){.score = player->score};
+	}
+	struct VetoScore* bucket = &server->scores[i];
+	player->rank_prev = bucket->last;
+	player->rank_next = NULL;
+	if (bucket->last) {
+		bucket->last->rank_next = player;
+	} else {
+		bucket->first = player;
+	}
+	bucket->last = player;
+}
+
+static void BoardRemove(struct VetoServer* server, struct VetoPlayer* player) {
+	size_t i = BoardSearch(server, player->score);
+	struct VetoScore* bucket = &server->scores[i];
+	if (player->rank_prev) {
+		player->rank_prev->rank_next = player->rank_next;
+	} else {
+		bucket->first = player->rank_next;
+	}
+	if (player->rank_next) {
+		player->rank_next->rank_prev = player->rank_prev;
+	} else {
+		bucket->last = player->rank_prev;
+	}
+	if (!bucket->first) {
+		server->scores_count--;
+		memmove(&server->scores[i], &server->scores[i + 1], (server->scores_count - i) * sizeof(struct VetoScore));
+	}
+}
+
+static void SetScore(struct VetoServer* server, struct VetoPlayer* player, int score) {
+	if (player->score == score) {
+		return;
+	}
+	BoardRemove(server, player);
+	player->score = score;
+	BoardAdd(server, player);
+}
+
+// Top 10 for a monitor that asked for it with the leaderboard flag, sent once per iteration after
+// any change, see EmbeddedServerFlush.
+static void SendBoard(struct Game* game, struct VetoServer* server) {
+	server->board_due = false;
+	if (!server->monitor || !server->leaderboard) {
+		return;
+	}
+	struct WebSocketBuffer* feed = MonitorFeed(game, server);
+	AppendString(feed, "B");
+	int count = 0;
+	for (size_t i = server->scores_count; i-- > 0 && count < VETO_BOARD_SIZE;) {
+		for (struct VetoPlayer* player = server->scores[i].first; player && count < VETO_BOARD_SIZE; player = player->rank_next) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "\x1f%d:", player->score);
+			AppendString(feed, buf);
+			AppendString(feed, player->name);
+			count++;
+		}
+	}
+}
+
+// Registry: every player ever seen, in the order they joined and by cookie for reconnects.
+
+static size_t CookieHash(const char* cookie) {
+	size_t hash = 2166136261u; // FNV-1a
+	for (; *cookie; cookie++) {
+		hash = (hash ^ (unsigned char)*cookie) * 16777619u;
+	}
+	return hash;
+}
+
+// The slot of the player with that cookie, or the empty one it would go in
+static struct VetoPlayer** CookieSlot(struct VetoServer* server, const char* cookie) {
+	size_t mask = server->cookies_capacity - 1;
+	size_t i = CookieHash(cookie) & mask;
+	while (server->cookies[i] && strcmp(server->cookies[i]->cookie, cookie) != 0) {
+		i = (i + 1) & mask;
+	}
+	return &server->cookies[i];
+}
+
+static struct VetoPlayer* FindPlayer(struct VetoServer* server, const char* cookie) {
+	return server->cookies_capacity ? *CookieSlot(server, cookie) : NULL;
+}
+
+static void Register(struct VetoServer* server, struct VetoPlayer* player) {
+	if (server->players_count == server->players_capacity) {
+		server->players_capacity = server->players_capacity ? server->players_capacity * 2 : 64;
+		server->players = realloc(server->players, server->players_capacity * sizeof(struct VetoPlayer*));
+	}
+	server->players[server->players_count++] = player;
+
+	if (server->players_count * 2 > server->cookies_capacity) {
+		free(server->cookies);
+		server->cookies_capacity = server->players_capacity * 2;
+		server->cookies = calloc(server->cookies_capacity, sizeof(struct VetoPlayer*));
+		for (size_t i = 0; i < server->players_count; i++) {
+			*CookieSlot(server, server->players[i]->cookie) = server->players[i];
+		}
+	} else {
+		*CookieSlot(server, player->cookie) = player;
+	}
+
+	BoardAdd(server, player);
+	server->board_due = true;
+}
+
+static void TallyChanged(struct VetoServer* server) {
+	if (server->tally_interval && server->voting && !server->tally_at) {
+		server->tally_at = Clock() + server->tally_interval;
+	}
+}
+
+static void ResetTally(struct VetoServer* server) {
+	server->tally[0] = 0;
+	server->tally[1] = 0;
+	server->tally_at = 0;
+}
+
+static void SetVote(struct VetoServer* server, struct VetoPlayer* player, int choice) {
+	if (player->vote == 1 || player->vote == 0) {
+		server->tally[!player->vote]--;
+	}
+	player->vote = choice;
+	if (player->vote == 1 || player->vote == 0) {
+		server->tally[!player->vote]++;
+	}
+	TallyChanged(server);
+}
+
+// Live tally for a monitor that asked for it with the live flag. Abstentions include the players
+// that dropped out since the voting started.
+static void SendTally(struct Game* game, struct VetoServer* server) {
+	server->tally_at = 0;
+	if (!server->voting || !server->monitor || !server->live) {
+		return;
+	}
+	intptr_t numbers[3] = {server->tally[0], server->tally[1], server->active - server->tally[0] - server->tally[1] - server->vetos};
+	MonitorSendNumbers(game, server, RECORD_TALLY, numbers, NULL);
+}
+
+static void CountVotes(struct Game* game, struct VetoServer* server) {
+	int allplayers = server->active;
+	int forvotes = server->tally[0], against = server->tally[1];
+	server->tally_at = 0;
+	int nonevotes = allplayers - forvotes - against;
+
+	Broadcast(game, server, RECORD_FOR, forvotes, NULL);
+	Broadcast(game, server, RECORD_AGAINST, against, NULL);
+	Broadcast(game, server, RECORD_ABSTAINED, nonevotes - server->vetos, NULL);
+	server->results[0] = forvotes;
+	server->results[1] = against;
+	server->results[2] = nonevotes - server->vetos;
+
+	bool result = forvotes > against;
+	Broadcast(game, server, RECORD_RESULT, result, NULL);
+
+	for (size_t i = 0; i < server->players_count; i++) {
+		struct VetoPlayer* player = server->players[i];
+		if (player->vote == result) { // points for voting like majority
+			SetScore(server, player, player->score + 1);
+		} else if (player->vote != -1) {
+			SetScore(server, player, player->score - 1);
+		}
+		PeerSend(game, player->peer, RECORD_SCORE, player->score, NULL);
+	}
+	server->board_due = true;
+
+	server->round++;
+}
+
+static void StartGame(struct Game* game, struct VetoServer* server) {
+	PrintConsole(game, "[server] %s", server->started ? "RESTART" : "START");
+	server->started = true;
+
+	server->deadline = 0;
+	server->voting = false;
+	server->countdown = -1;
+	server->vetos = 0;
+	server->canVeto = false;
+	for (int i = 0; i < 3; i++) {
+		server->results[i] = 0;
+	}
+	for (int i = 0; i < 4; i++) {
+		free(server->winners[i]);
+		server->winners[i] = NULL;
+	}
+
+	ResetTally(server);
+	for (size_t i = 0; i < server->players_count; i++) {
+		struct VetoPlayer* player = server->players[i];
+		player->vote = -1;
+		player->vetoRight = false;
+		SetScore(server, player, 0);
+		player->ended = false;
+		PeerSend(game, player->peer, RECORD_SCORE, 0, NULL);
+	}
+	server->board_due = true;
+
+	server->round = 1;
+
+	Broadcast(game, server, RECORD_START, 0, NULL);
+}
+
+// With veto/counter, C goes out every second too, each one due at a whole number of seconds
+// before the deadline.
+static void Countdown(struct Game* game, struct VetoServer* server) {
+	while (server->countdown >= 0 && Clock() >= server->deadline - (server->countdown + 1) * 1000) {
+		Broadcast(game, server, RECORD_COUNTER, server->countdown, NULL);
+		server->countdown--;
+	}
+}
+
+static void StartVote(struct Game* game, struct VetoServer* server) {
+	if (server->voting) {
+		return;
+	}
+
+	PrintConsole(game, "[server] VOTE round %d", server->round);
+
+	server->canVeto = (server->round % 5 == 0);
+
+	ResetTally(server);
+	for (size_t i = 0; i < server->players_count; i++) {
+		server->players[i]->vote = -1;
+		server->players[i]->vetoRight = false;
+	}
+
+	server->voting = true;
+	server->deadline = Clock() + (VETO_VOTING_TIME + 1) * 1000;
+	Broadcast(game, server, RECORD_VOTING, 0, NULL);
+	intptr_t deadline[2] = {server->deadline, server->deadline - Clock()};
+	BroadcastNumbers(game, server, RECORD_DEADLINE, deadline, NULL);
+
+	if (server->canVeto) {
+		// the two lowest scores still in the game, and everyone tied with the third one
+		int rank = 0, third = 0;
+		bool done = false;
+		for (size_t i = 0; i < server->scores_count && !done; i++) {
+			for (struct VetoPlayer* player = server->scores[i].first; player && !done; player = player->rank_next) {
+				if (player->ended) {
+					continue;
+				}
+				if (rank == 2) {
+					third = player->score;
+				}
+				if (rank >= 2 && player->score != third) {
+					done = true;
+					continue;
+				}
+				player->vetoRight = true;
+				PeerSend(game, player->peer, RECORD_CAN_VETO, 0, NULL);
+				rank++;
+			}
+		}
+	}
+
+	// closed by EmbeddedServerService once the deadline passes
+	server->countdown = server->counter ? VETO_VOTING_TIME : -1;
+	Countdown(game, server);
+}
+
+static char* FormatWinner(const char* name, int score) {
+	size_t size = strlen(name) + 16;
+	char* str = malloc(size);
+	snprintf(str, size, "%s (%d)", name, score);
+	return str;
+}
+
+static void AnnounceWinners(struct Game* game, struct VetoServer* server) {
+	struct VetoScore* best = &server->scores[server->scores_count - 1];
+	size_t size = 16;
+	for (struct VetoPlayer* player = best->first; player; player = player->rank_next) {
+		size += strlen(player->name) + 2;
+	}
+	char* thebests = malloc(size);
+	thebests[0] = '\0';
+	for (struct VetoPlayer* player = best->first; player; player = player->rank_next) {
+		if (player != best->first) {
+			strcat(thebests, ", ");
+		}
+		strcat(thebests, player->name);
+	}
+	free(server->winners[0]);
+	server->winners[0] = FormatWinner(thebests, best->score);
+	free(thebests);
+
+	// by score, ties in the order they vetoed
+	struct VetoPlayer* vetoers[3] = {server->vetoers[0], server->vetoers[1], server->vetoers[2]};
+	for (int i = 1; i < 3; i++) {
+		for (int j = i; j > 0 && vetoers[j - 1]->score > vetoers[j]->score; j--) {
+			struct VetoPlayer* player = vetoers[j];
+			vetoers[j] = vetoers[j - 1];
+			vetoers[j - 1] = player;
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		free(server->winners[i + 1]);
+		server->winners[i + 1] = FormatWinner(vetoers[i]->name, vetoers[i]->score);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		Broadcast(game, server, RECORD_WINNER, i, server->winners[i]);
+	}
+}
+
+static void Veto(struct Game* game, struct VetoServer* server, struct VetoPeer* peer) {
+	struct VetoPlayer* player = peer->player;
+	if (!player || !server->voting || !player->vetoRight || !server->canVeto || server->vetos >= 3) {
+		return;
+	}
+
+	server->canVeto = false;
+	PrintConsole(game, "[server] %s said VETO!", player->name);
+	server->voting = false;
+	server->countdown = -1;
+	server->vetoers[server->vetos++] = player;
+	server->round++;
+	SetScore(server, player, player->score - (VETO_VOTING_TIME - Counter(server)) * 2);
+	server->board_due = true;
+	PeerSend(game, peer, RECORD_SCORE, player->score, NULL);
+	PeerSend(game, peer, RECORD_END, 0, NULL);
+	player->ended = true;
+
+	if (server->vetos == 3) {
+		AnnounceWinners(game, server);
+		Broadcast(game, server, RECORD_THE_END, 0, player->name);
+		PrintConsole(game, "[server] THE END");
+	} else {
+		Broadcast(game, server, RECORD_VETO, 0, player->name);
+	}
+}
+
+static void RegisterMonitor(struct Game* game, struct VetoServer* server, unsigned int flags) {
+	server->monitor = true;
+	server->timestamps = flags & VETO_MONITOR_TIMESTAMPS;
+	server->live = flags & VETO_MONITOR_LIVE;
+	server->leaderboard = flags & VETO_MONITOR_LEADERBOARD;
+	server->board_due = true;
+	PrintConsole(game, "[server] monitor registered");
+
+	MonitorSend(game, server, RECORD_PLAYERS, server->connected, NULL);
+
+	struct WebSocketBuffer* feed = MonitorFeed(game, server);
+	char buf[64];
+	snprintf(buf, sizeof(buf), "Z%d,%d,%d,%d,%d,%d,%d,%d,%d", server->connected, server->round, server->started,
+		server->voting, server->voting ? Counter(server) : 0, server->results[0], server->results[1], server->results[2], server->vetos);
+	AppendString(feed, buf);
+	for (int i = 0; i < 4; i++) {
+		AppendString(feed, "\x1f");
+		AppendString(feed, server->winners[i] ? server->winners[i] : "");
+	}
+	if (server->voting) {
+		SendDeadline(game, server, NULL);
+	}
+}
+
+static void Join(struct Game* game, struct VetoServer* server, struct VetoPeer* peer, struct VetoServerCommand* command) {
+	if (peer->player) {
+		return;
+	}
+	peer->batch = peer->binary || command->batch;
+
+	struct VetoPlayer* player = calloc(1, sizeof(struct VetoPlayer));
+	strcpy(player->name, command->str);
+	player->vote = -1;
+	player->connected = true;
+	player->peer = peer;
+	static const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	for (int i = 0; i < VETO_COOKIE_LENGTH; i++) {
+		player->cookie[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+	}
+	peer->player = player;
+	server->connected++;
+	server->active++;
+
+	Register(server, player);
+	TallyChanged(server);
+	PrintConsole(game, "[server] %s joined", player->name);
+
+	MonitorSend(game, server, RECORD_PLAYERS, server->connected, NULL);
+	MonitorSend(game, server, RECORD_JOIN, 0, player->name);
+	PeerSend(game, peer, RECORD_COOKIE, 0, player->cookie);
+}
+
+// False if the player stays online, having reconnected on another connection since.
+static bool Detach(struct VetoServer* server, struct VetoPeer* peer) {
+	server->active--;
+	TallyChanged(server);
+	if (peer->player->peer != peer) {
+		return false;
+	}
+	server->connected--;
+	peer->player->connected = false;
+	peer->player->peer = NULL;
+	return true;
+}
+
+static void Reconnect(struct Game* game, struct VetoServer* server, struct VetoPeer* peer, struct VetoServerCommand* command) {
+	peer->batch = peer->binary || command->batch;
+	struct VetoPlayer* player = FindPlayer(server, command->str);
+	if (player && peer->player && peer->player != player) {
+		// a connection that joined as someone else becomes this one
+		if (Detach(server, peer)) {
+			MonitorSend(game, server, RECORD_LEAVE, 0, peer->player->name);
+		}
+		peer->player = NULL;
+	}
+	bool active = peer->player;
+	if (player) {
+		peer->player = player;
+	}
+
+	if (!peer->player) {
+		PeerSend(game, peer, RECORD_ERR, 0, NULL);
+		return;
+	}
+	PeerSend(game, peer, RECORD_OK, 0, NULL);
+	if (!active) {
+		server->active++;
+	}
+	if (!peer->player->connected) {
+		server->connected++;
+	}
+	peer->player->connected = true;
+	peer->player->peer = peer;
+	TallyChanged(server);
+
+	MonitorSend(game, server, RECORD_PLAYERS, server->connected, NULL);
+	MonitorSend(game, server, RECORD_RECONNECT, 0, peer->player->name);
+	PeerSend(game, peer, RECORD_SCORE, peer->player->score, NULL);
+	PeerSend(game, peer, RECORD_NICK, 0, peer->player->name);
+	if (peer->player->ended) {
+		PeerSend(game, peer, RECORD_END, 0, NULL);
+	} else if (server->voting) {
+		SendDeadline(game, server, peer);
+	}
+}
+
+// Commands
+
+// Just enough JSON for what the clients send: finds "key" followed by a colon and returns
+// whatever comes after it.
+static const char* JsonValue(const char* msg, const char* key) {
+	size_t length = strlen(key);
+	for (const char* pos = strchr(msg, '"'); pos; pos = strchr(pos + 1, '"')) {
+		if (strncmp(pos + 1, key, length) != 0 || pos[length + 1] != '"') {
+			continue;
+		}
+		const char* value = pos + length + 2;
+		value += strspn(value, " \t\r\n");
+		if (*value == ':') {
+			value++;
+			return value + strspn(value, " \t\r\n");
+		}
+	}
+	return NULL;
+}
+
+static void Utf8Append(char* out, size_t* length, size_t size, unsigned long codepoint) {
+	unsigned char bytes[4];
+	size_t count;
+	if (codepoint < 0x80) {
+		bytes[0] = codepoint;
+		count = 1;
+	} else if (codepoint < 0x800) {
+		bytes[0] = 0xc0 | (codepoint >> 6);
+		bytes[1] = 0x80 | (codepoint & 0x3f);
+		count = 2;
+	} else if (codepoint < 0x10000) {
+		bytes[0] = 0xe0 | (codepoint >> 12);
+		bytes[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+		bytes[2] = 0x80 | (codepoint & 0x3f);
+		count = 3;
+	} else {
+		bytes[0] = 0xf0 | (codepoint >> 18);
+		bytes[1] = 0x80 | ((codepoint >> 12) & 0x3f);
+		bytes[2] = 0x80 | ((codepoint >> 6) & 0x3f);
+		bytes[3] = 0x80 | (codepoint & 0x3f);
+		count = 4;
+	}
+	if (*length + count < size) {
+		memcpy(out + *length, bytes, count);
+		*length += count;
+	}
+}
+
+// Copies a JSON string into out, cut to fit.
+static bool JsonString(const char* value, char* out, size_t size) {
+	size_t length = 0;
+	if (!value || *value != '"') {
+		return false;
+	}
+	for (value++; *value && *value != '"'; value++) {
+		unsigned long codepoint = (unsigned char)*value;
+		if (*value == '\\') {
+			value++;
+			switch (*value) {
+				case 'b':
+					codepoint = '\b';
+					break;
+				case 'f':
+					codepoint = '\f';
+					break;
+				case 'n':
+					codepoint = '\n';
+					break;
+				case 'r':
+					codepoint = '\r';
+					break;
+				case 't':
+					codepoint = '\t';
+					break;
+				case 'u': {
+					char hex[5] = {0};
+					strncpy(hex, value + 1, 4);
+					codepoint = strtoul(hex, NULL, 16);
+					value += strlen(hex);
+					if (codepoint >= 0xd800 && codepoint < 0xdc00 && value[1] == '\\' && value[2] == 'u') {
+						strncpy(hex, value + 3, 4);
+						unsigned long low = strtoul(hex, NULL, 16);
+						if (low >= 0xdc00 && low < 0xe000) {
+							codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+							value += 2 + strlen(hex);
+						}
+					}
+					Utf8Append(out, &length, size, codepoint);
+					continue;
+				}
+				case '\0':
+					value--;
+					continue;
+				default:
+					codepoint = (unsigned char)*value;
+					break;
+			}
+		}
+		if (length + 1 < size) {
+			out[length++] = codepoint;
+		}
+	}
+	out[length] = '\0';
+	return true;
+}
+
+// Same as the nick sanitizing in server.js: control characters would break batched framing.
+static void SanitizeNick(char* nick) {
+	size_t length = 0;
+	for (char* pos = nick; *pos; pos++) {
+		if ((unsigned char)*pos >= 0x20) {
+			nick[length++] = *pos;
+		}
+	}
+	nick[length] = '\0';
+	while (length && nick[length - 1] == ' ') {
+		nick[--length] = '\0';
+	}
+	size_t start = strspn(nick, " ");
+	memmove(nick, nick + start, length - start + 1);
+
+	// don't leave a UTF-8 sequence cut in half by JsonString
+	length = strlen(nick);
+	if (length && ((unsigned char)nick[length - 1] & 0x80)) {
+		size_t lead = length - 1;
+		while (lead && ((unsigned char)nick[lead] & 0xc0) == 0x80) {
+			lead--;
+		}
+		unsigned char byte = nick[lead];
+		size_t expected = (byte >= 0xf0) ? 4 : (byte >= 0xe0) ? 3 : (byte >= 0xc0) ? 2 : 1;
+		if (length - lead < expected) {
+			nick[lead] = '\0';
+		}
+	}
+}
+
+// Returns false if it's not a command at all.
+static bool ParseTextCommand(const char* msg, struct VetoServerCommand* command) {
+	static const struct {
+		const char* name;
+		VETO_SERVER_COMMAND_TYPE type;
+	} types[] = {
+		{"monitor", COMMAND_MONITOR},
+		{"start", COMMAND_START},
+		{"voting", COMMAND_VOTING},
+		{"veto", COMMAND_VETO},
+		{"join", COMMAND_JOIN},
+		{"reconnect", COMMAND_RECONNECT},
+		{"vote", COMMAND_VOTE},
+		{"clock", COMMAND_CLOCK},
+	};
+	char type[16];
+
+	memset(command, 0, sizeof(struct VetoServerCommand));
+	if (!JsonString(JsonValue(msg, "type"), type, sizeof(type))) {
+		return false;
+	}
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (strcmp(type, types[i].name) == 0) {
+			command->type = types[i].type;
+		}
+	}
+
+	const char* batch = JsonValue(msg, "batch");
+	command->batch = batch && strncmp(batch, "true", 4) == 0;
+
+	const char* choice = JsonValue(msg, "choice");
+	command->choice = -1;
+	if (choice && strncmp(choice, "true", 4) == 0) {
+		command->choice = 1;
+	}
+	if (choice && strncmp(choice, "false", 5) == 0) {
+		command->choice = 0;
+	}
+
+	if (command->type == COMMAND_JOIN) {
+		const char* nick = JsonValue(msg, "nick");
+		if (!JsonString(nick, command->str, sizeof(command->str))) {
+			// String(data.nick) in server.js
+			snprintf(command->str, sizeof(command->str), "%.*s", nick ? (int)strcspn(nick, ",}") : 9, nick ? nick : "undefined");
+		}
+		SanitizeNick(command->str);
+	}
+	if (command->type == COMMAND_RECONNECT) {
+		JsonString(JsonValue(msg, "cookie"), command->str, sizeof(command->str));
+	}
+	if (command->type == COMMAND_MONITOR) {
+		static const struct {
+			const char* key;
+			unsigned int flag;
+		} flags[] = {
+			{"timestamps", VETO_MONITOR_TIMESTAMPS},
+			{"live", VETO_MONITOR_LIVE},
+			{"leaderboard", VETO_MONITOR_LEADERBOARD},
+		};
+		for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+			const char* value = JsonValue(msg, flags[i].key);
+			if (value && strncmp(value, "true", 4) == 0) {
+				command->flags |= flags[i].flag;
+			}
+		}
+	}
+	if (command->type == COMMAND_CLOCK) {
+		// Math.round(Number(data.time)) || 0
+		const char* time = JsonValue(msg, "time");
+		double value = time ? strtod(time + (*time == '"'), NULL) : 0;
+		command->time = isfinite(value) ? llround(value) : 0;
+	}
+	return true;
+}
+
+static const unsigned char* ParseVarint(const unsigned char* pos, const unsigned char* end, uintmax_t* value) {
+	unsigned int shift = 0;
+	*value = 0;
+	do {
+		if (pos >= end || shift >= 64) {
+			return NULL;
+		}
+		*value |= (uintmax_t)(*pos & 0x7f) << shift;
+		shift += 7;
+	} while (*pos++ & 0x80);
+	return pos;
+}
+
+// Reads one veto-bin command, see server/proto.js. Returns NULL if malformed.
+static const unsigned char* ParseBinaryCommand(const unsigned char* pos, const unsigned char* end, struct VetoServerCommand* command) {
+	memset(command, 0, sizeof(struct VetoServerCommand));
+	command->batch = true;
+	command->choice = -1;
+
+	uintmax_t length;
+	switch (*pos++) {
+		case 0x01:
+			command->type = COMMAND_MONITOR;
+			return pos;
+		case 0x0a:
+			// unknown flags are ignored, so a newer monitor still registers
+			command->type = COMMAND_MONITOR;
+			pos = ParseVarint(pos, end, &length);
+			command->flags = length;
+			return pos;
+		case 0x0d:
+			command->type = COMMAND_CLOCK;
+			pos = ParseVarint(pos, end, &length);
+			command->time = (intptr_t)(length >> 1) ^ -(intptr_t)(length & 1); // zigzag
+			return pos;
+		case 0x02:
+			command->type = COMMAND_START;
+			return pos;
+		case 0x03:
+			command->type = COMMAND_VOTING;
+			return pos;
+		case 0x04:
+			command->type = COMMAND_VETO;
+			return pos;
+		case 0x05:
+			command->type = COMMAND_JOIN;
+			break;
+		case 0x06:
+			command->type = COMMAND_RECONNECT;
+			break;
+		case 0x07:
+		case 0x08:
+		case 0x09:
+			command->type = COMMAND_VOTE;
+			command->choice = (pos[-1] == 0x07) ? 1 : (pos[-1] == 0x08) ? 0 : -1;
+			return pos;
+		default:
+			return NULL;
+	}
+
+	if (!(pos = ParseVarint(pos, end, &length)) || length > (uintmax_t)(end - pos)) {
+		return NULL;
+	}
+	snprintf(command->str, sizeof(command->str), "%.*s", (int)length, pos);
+	if (command->type == COMMAND_JOIN) {
+		SanitizeNick(command->str);
+	}
+	return pos + length;
+}
+
+static void HandleCommand(struct Game* game, struct VetoServer* server, struct VetoPeer* peer, struct VetoServerCommand* command) {
+	if (command->type == COMMAND_CLOCK) {
+		intptr_t numbers[2] = {command->time, Clock()};
+		if (peer) {
+			PeerSendNumbers(game, peer, RECORD_CLOCK, numbers, NULL);
+		} else {
+			MonitorSendNumbers(game, server, RECORD_CLOCK, numbers, NULL);
+		}
+		return;
+	}
+
+	if (!peer) {
+		// the local monitor
+		switch (command->type) {
+			case COMMAND_MONITOR:
+				RegisterMonitor(game, server, command->flags);
+				break;
+			case COMMAND_START:
+				StartGame(game, server);
+				break;
+			case COMMAND_VOTING:
+				StartVote(game, server);
+				break;
+			default:
+				break;
+		}
+		return;
+	}
+
+	switch (command->type) {
+		case COMMAND_JOIN:
+			Join(game, server, peer, command);
+			break;
+		case COMMAND_RECONNECT:
+			Reconnect(game, server, peer, command);
+			break;
+		case COMMAND_VOTE:
+			if (peer->player && !peer->player->ended && server->voting) {
+				SetVote(server, peer->player, command->choice);
+			}
+			break;
+		case COMMAND_VETO:
+			Veto(game, server, peer);
+			break;
+		default:
+			// the monitor is local, so remote monitor commands are ignored
+			break;
+	}
+}
+
+static void HandleMessage(struct Game* game, struct VetoServer* server, struct VetoPeer* peer, struct WebSocketBuffer* message) {
+	struct VetoServerCommand command;
+
+	if (!message->binary) {
+		if (ParseTextCommand(message->data, &command)) {
+			HandleCommand(game, server, peer, &command);
+		} else {
+			PeerSend(game, peer, RECORD_REJECTED, 0, "undecodable message");
+		}
+		return;
+	}
+
+	const unsigned char* pos = (unsigned char*)message->data;
+	const unsigned char* end = pos + message->length;
+	while (pos < end && (pos = ParseBinaryCommand(pos, end, &command))) {
+		HandleCommand(game, server, peer, &command);
+	}
+	if (!pos) {
+		PeerSend(game, peer, RECORD_REJECTED, 0, "undecodable message");
+	}
+}
+
+// lws
+
+static int ServerCallback(struct lws* wsi, enum lws_callback_reasons reason, void* user, void* in, size_t len) {
+	struct Game* game = lws_context_user(lws_get_context(wsi));
+	struct VetoServer* server = game ? game->data->ws_server : NULL;
+	struct VetoPeer* peer = user;
+
+	if (!server) {
+		return 0;
+	}
+
+	switch (reason) {
+		case LWS_CALLBACK_HTTP:
+			return 1; // websockets only
+
+		case LWS_CALLBACK_ESTABLISHED:
+			peer->wsi = wsi;
+			peer->binary = (strcmp(lws_get_protocol(wsi)->name, "veto-bin") == 0);
+			peer->batch = peer->binary;
+			peer->next = server->peers;
+			if (server->peers) {
+				server->peers->prev = peer;
+			}
+			server->peers = peer;
+			break;
+
+		case LWS_CALLBACK_RECEIVE:
+			if (!peer->rx) {
+				peer->rx = BufferAcquire(&game->data->ws_pool);
+			}
+			BufferAppend(peer->rx, in, len);
+			if (lws_is_final_fragment(wsi) && !lws_remaining_packet_payload(wsi)) {
+				peer->rx->binary = lws_frame_is_binary(wsi);
+				HandleMessage(game, server, peer, peer->rx);
+				peer->rx->length = 0;
+			}
+			break;
+
+		case LWS_CALLBACK_SERVER_WRITEABLE: {
+			if (!peer->tx || peer->tx->length == peer->tx_sent) {
+				break;
+			}
+			// batched connections get everything in one frame, the rest one record per frame
+			char* frame = peer->tx->data + peer->tx_sent;
+			size_t length = peer->tx->length - peer->tx_sent;
+			if (!peer->batch) {
+				char* separator = memchr(frame, '\n', length);
+				if (separator) {
+					length = separator - frame;
+				}
+			}
+			// written in place: the frame header goes in the LWS_PRE bytes before it, which are
+			// either the headroom or records that have been written already
+			int written = lws_write(wsi, (unsigned char*)frame, length, peer->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+			if (written < 0) {
+				return -1;
+			}
+			if (peer->tx_sent + length < peer->tx->length) {
+				PeerWritten(peer, length + 1);
+				lws_callback_on_writable(wsi);
+			} else {
+				PeerWritten(peer, length);
+			}
+			break;
+		}
+
+		case LWS_CALLBACK_CLOSED:
+			if (peer->prev) {
+				peer->prev->next = peer->next;
+			} else if (server->peers == peer) {
+				server->peers = peer->next;
+			}
+			if (peer->next) {
+				peer->next->prev = peer->prev;
+			}
+			if (peer->rx) {
+				BufferRelease(&game->data->ws_pool, peer->rx);
+			}
+			if (peer->tx) {
+				BufferRelease(&game->data->ws_pool, peer->tx);
+			}
+			if (peer->player && Detach(server, peer)) {
+				MonitorSend(game, server, RECORD_PLAYERS, server->connected, NULL);
+				MonitorSend(game, server, RECORD_LEAVE, 0, peer->player->name);
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+static struct lws_protocols ServerProtocols[] = {
+	// the first one is also used when a client doesn't ask for any
+	{.name = "veto", .callback = ServerCallback, .per_session_data_size = sizeof(struct VetoPeer), .rx_buffer_size = 1024},
+	{.name = "veto-bin", .callback = ServerCallback, .per_session_data_size = sizeof(struct VetoPeer), .rx_buffer_size = 1024},
+	{.callback = NULL} /* terminator */
+};
+
+// Interface for common.c
+
+struct VetoServer* EmbeddedServerCreate(struct Game* game, struct lws_context* context) {
+	struct lws_context_creation_info info = {};
+	info.port = strtol(GetConfigOptionDefault(game, "veto", "port", "8889"), NULL, 10);
+	info.protocols = ServerProtocols;
+	info.vhost_name = "veto-server";
+
+	struct VetoServer* server = calloc(1, sizeof(struct VetoServer));
+	server->high_water = strtoul(GetConfigOptionDefault(game, "veto", "send_high_water", "65536"), NULL, 10);
+	server->budget = strtoul(GetConfigOptionDefault(game, "veto", "send_budget", "1048576"), NULL, 10);
+	server->counter = strtol(GetConfigOptionDefault(game, "veto", "counter", "0"), NULL, 10);
+	double hz = strtod(GetConfigOptionDefault(game, "veto", "live_tally_hz", "10"), NULL);
+	server->tally_interval = hz > 0 ? llround(1000 / hz) : 0;
+	if (hz > 0 && !server->tally_interval) {
+		server->tally_interval = 1;
+	}
+	server->countdown = -1;
+	server->vhost = lws_create_vhost(context, &info);
+	if (!server->vhost) {
+		PrintConsole(game, "[server] Failed to listen on port %d!", info.port);
+		free(server);
+		return NULL;
+	}
+	PrintConsole(game, "[server] Listening on port %d", info.port);
+	return server;
+}
+
+// Only after the context is gone, as closing the connections still needs the server.
+void EmbeddedServerDestroy(struct Game* game, struct VetoServer* server) {
+	if (server->feed) {
+		BufferRelease(&game->data->ws_pool, server->feed);
+	}
+	for (size_t i = 0; i < server->players_count; i++) {
+		free(server->players[i]);
+	}
+	free(server->players);
+	free(server->cookies);
+	free(server->scores);
+	for (int i = 0; i < 4; i++) {
+		free(server->winners[i]);
+	}
+	free(server);
+}
+
+void EmbeddedServerMonitorCommand(struct Game* game, const void* data, size_t length, bool binary) {
+	struct WebSocketBuffer* message = BufferAcquire(&game->data->ws_pool);
+	BufferAppend(message, data, length);
+	message->binary = binary;
+	HandleMessage(game, game->data->ws_server, NULL, message);
+	BufferRelease(&game->data->ws_pool, message);
+}
+
+void EmbeddedServerDetachMonitor(struct Game* game) {
+	struct VetoServer* server = game->data->ws_server;
+	server->monitor = false;
+	if (server->feed) {
+		BufferRelease(&game->data->ws_pool, server->feed);
+		server->feed = NULL;
+	}
+}
+
+// Runs what's due and returns how many ms lws_service may wait at most.
+int EmbeddedServerService(struct Game* game, int timeout) {
+	struct VetoServer* server = game->data->ws_server;
+	if (!server->voting) {
+		return timeout;
+	}
+	Countdown(game, server);
+	intptr_t now = Clock();
+	if (now >= server->deadline) {
+		server->voting = false;
+		server->countdown = -1;
+		CountVotes(game, server);
+		return timeout;
+	}
+	if (server->tally_at && now >= server->tally_at) {
+		SendTally(game, server);
+	}
+
+	intptr_t due = server->deadline;
+	if (server->countdown >= 0 && server->deadline - (server->countdown + 1) * 1000 < due) {
+		due = server->deadline - (server->countdown + 1) * 1000;
+	}
+	if (server->tally_at && server->tally_at < due) {
+		due = server->tally_at;
+	}
+	if (due - now < timeout) {
+		timeout = due > now ? due - now : 0;
+	}
+	return timeout;
+}
+
+// Hands everything gathered for the monitor over to the render thread in one go, with the
+// leaderboard at the end if it changed meanwhile.
+void EmbeddedServerFlush(struct Game* game) {
+	struct VetoServer* server = game->data->ws_server;
+	if (server->board_due) {
+		SendBoard(game, server);
+	}
+	if (!server->feed || !server->feed->length) {
+		return;
+	}
+	server->feed->binary = false;
+	server->feed->received = al_get_time();
+	ReceiveQueuePush(game, server->feed);
+	server->feed = NULL;
+}
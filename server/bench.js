@@ -0,0 +1,216 @@
+/* Benchmarks of the game logic in rooms of synthetic players.
+
+ usage: node bench.js [--sizes 100,1000,10000,100000] [--out results.json]
+                      [--baseline bench-baseline.json] [--tolerance 0.25] [--save]
+
+ Builds a room (room.js) for each size with mock sockets standing in for the connections and
+ times, as the server runs them:
+   join - all the players connecting and joining, from connection() to the cookie
+   reconnect - all of them connecting again and reconnecting with their cookies
+   broadcast - one record to all the players, encoded and batched until the sockets get it
+   startVote - V and D to all, and picking who can veto in a fifth round
+   countVotes - the results and everyone's new score
+   veto - the third veto, ending the game and announcing the winners
+ The median of several runs is what counts. Results go to --out as JSON, or stdout.
+
+ With a baseline (bench-baseline.json by default, if it exists) every result more than --tolerance
+ slower than it is reported and the exit code is 1. --save writes the results as the new baseline;
+ record it on the machine the comparisons are going to run on. npm test runs this against the
+ committed baseline with --tolerance 1, loose enough for a busy machine but not for a result that
+ doubled.
+*/
+
+delete process.env.VETO_JOURNAL_DIR; // nothing goes to disk
+
+const fs = require('fs');
+const path = require('path');
+const EventEmitter = require('events');
+const performance = require('perf_hooks').performance;
+const WebSocket = require('ws');
+const proto = require('./proto');
+const room = require('./room');
+
+let option = function(name, value) {
+  let i = process.argv.indexOf('--' + name);
+  return i >= 0 ? process.argv[i + 1] : value;
+};
+
+const SIZES = option('sizes', '100,1000,10000,100000').split(',').map(function(n) { return parseInt(n, 10); });
+const OUT = option('out', null);
+const BASELINE = option('baseline', path.join(__dirname, 'bench-baseline.json'));
+const TOLERANCE = parseFloat(option('tolerance', '0.25'));
+const NOISE = 0.5; // ms; differences below this are GC and scheduling noise, whatever the ratio
+
+// Connection as far as room.js and transport.js use it; a third of them speak veto-bin
+let MockSocket = function(i) {
+  EventEmitter.call(this);
+  this.protocol = i % 3 == 2 ? proto.PROTOCOL_BINARY : proto.PROTOCOL_TEXT;
+  this.readyState = WebSocket.OPEN;
+  this.bufferedAmount = 0;
+  this.sent = 0;
+};
+MockSocket.prototype = Object.create(EventEmitter.prototype);
+MockSocket.prototype.constructor = MockSocket;
+MockSocket.prototype.send = function() { this.sent++; };
+MockSocket.prototype.close = function() {};
+MockSocket.prototype.terminate = function() {};
+
+// Batched records are sent on the next tick
+let flushed = function() {
+  return new Promise(setImmediate);
+};
+
+let median = function(times) {
+  let sorted = times.slice().sort(function(a, b) { return a - b; });
+  return sorted[Math.floor(sorted.length / 2)];
+};
+
+// Runs setup() and then op() the given number of times, timing op and what it sends
+let measure = async function(runs, setup, op) {
+  let times = [];
+  for (let i = 0; i < runs; i++) {
+    if (setup) setup(i);
+    let started = performance.now();
+    op(i);
+    await flushed();
+    times.push(performance.now() - started);
+  }
+  return { median: median(times), min: Math.min.apply(null, times), runs: runs };
+};
+
+let command = function(ws, data) {
+  ws.emit('commands', [data]);
+};
+
+let benchmark = async function(size) {
+  let results = {};
+  let runs = Math.max(5, Math.min(50, Math.ceil(100000 / size)));
+  let game, internals, sockets;
+
+  // the whole room joining and reconnecting, in a new room every run; the last one stays for the rest
+  let joins = [], reconnects = [];
+  for (let run = 0; run < runs; run++) {
+    if (game) game.destroy();
+    game = room.create('/bench', { sharded: false, onEmpty: function() {}, onMonitor: function() {} });
+    internals = game.internals;
+    sockets = [];
+
+    let started = performance.now();
+    for (let i = 0; i < size; i++) {
+      let ws = new MockSocket(i);
+      game.connection(ws);
+      command(ws, { type: 'join', nick: 'player' + i, batch: true });
+      sockets.push(ws);
+    }
+    await flushed();
+    joins.push(performance.now() - started);
+
+    sockets.forEach(function(ws) {
+      ws.readyState = WebSocket.CLOSED;
+      ws.emit('close');
+    });
+    started = performance.now();
+    sockets = sockets.map(function(old, i) {
+      let ws = new MockSocket(i);
+      game.connection(ws);
+      command(ws, { type: 'reconnect', cookie: old.data.cookie, batch: true });
+      return ws;
+    });
+    await flushed();
+    reconnects.push(performance.now() - started);
+  }
+  results.join = { median: median(joins), min: Math.min.apply(null, joins), runs: joins.length };
+  results.reconnect = { median: median(reconnects), min: Math.min.apply(null, reconnects), runs: reconnects.length };
+
+  internals.startGame();
+  await flushed();
+
+  results.broadcast = await measure(runs, null, function() {
+    internals.broadcast('P', size);
+  });
+
+  results.startVote = await measure(runs, function() {
+    internals.stopClock();
+    internals.state.voting = false;
+    internals.state.round = 5; // with the vetos
+  }, function() {
+    internals.startVote();
+  });
+  internals.stopClock();
+
+  results.countVotes = await measure(runs, function(run) {
+    internals.state.voting = true;
+    sockets.forEach(function(ws, i) {
+      command(ws, { type: 'vote', choice: (i + run) % 3 == 0 ? null : (i + run) % 3 == 1 });
+    });
+    internals.state.voting = false;
+  }, function() {
+    internals.countVotes();
+  });
+
+  // the third veto, from players that haven't ended yet
+  let vetoers = internals.players.slice(0, 2);
+  results.veto = await measure(Math.min(runs, size - 2), function(run) {
+    internals.state.vetos = 2;
+    internals.state.vetoers = vetoers.slice();
+    internals.state.voting = true;
+    internals.state.canVeto = true;
+    sockets[2 + run].data.vetoRight = true;
+  }, function(run) {
+    command(sockets[2 + run], { type: 'veto' });
+  });
+
+  game.destroy();
+  return results;
+};
+
+let compare = function(results, baseline) {
+  let regressions = [];
+  Object.keys(results).forEach(function(key) {
+    if (!baseline[key]) return;
+    let now = results[key].median, then = baseline[key].median;
+    if (now > then * (1 + TOLERANCE) && now - then > NOISE) {
+      regressions.push(key + ': ' + now.toFixed(3) + ' ms, was ' + then.toFixed(3) + ' ms (+' +
+                       Math.round((now / then - 1) * 100) + '%)');
+    }
+  });
+  return regressions;
+};
+
+(async function() {
+  let log = console.log;
+  let results = {};
+  console.log = function() {}; // the game's own logging isn't what's measured
+  await benchmark(SIZES[0]); // not counted, it's there to get the code compiled
+  for (let i = 0; i < SIZES.length; i++) {
+    console.log = function() {};
+    let measured = await benchmark(SIZES[i]);
+    console.log = log;
+    Object.keys(measured).forEach(function(name) {
+      let key = name + '/' + SIZES[i];
+      results[key] = measured[name];
+      console.error(key + '\t' + measured[name].median.toFixed(3) + ' ms');
+    });
+  }
+
+  let report = JSON.stringify({ node: process.version, date: new Date().toISOString(), results: results }, null, 2);
+  if (OUT) fs.writeFileSync(OUT, report + '\n');
+  else console.log(report);
+
+  if (process.argv.indexOf('--save') >= 0) {
+    fs.writeFileSync(BASELINE, report + '\n');
+    console.error('saved as the baseline in ' + BASELINE);
+    return;
+  }
+  if (!fs.existsSync(BASELINE)) {
+    console.error('no baseline in ' + BASELINE + ', run with --save to make one');
+    return;
+  }
+  let regressions = compare(results, JSON.parse(fs.readFileSync(BASELINE, 'utf8')).results);
+  if (regressions.length) {
+    console.error('slower than the baseline by more than ' + Math.round(TOLERANCE * 100) + '%:\n  ' + regressions.join('\n  '));
+    process.exitCode = 1;
+  } else {
+    console.error('no regressions against ' + BASELINE);
+  }
+})();
@@ -0,0 +1,214 @@
+/* Broadcast fan-out benchmark for the sharded mode.
+
+ usage: node fanout.js [connections] [rounds] [workers...]
+   defaults: 2000 connections, 3 rounds, worker counts 1, 2, 4... up to the number of cores
+
+ For each worker count it starts server.js with VETO_WORKERS set, joins the players from
+ client processes (one per core) and has a monitor start a few votings. The latency is the
+ time from the monitor sending "voting" to a player getting the V; deliveries/s is the number
+ of players over the time the last one of them waited. The CPU columns are what the coordinator
+ and the busiest worker used per round, from the V to the last E (from /proc, so Linux only).
+ The coordinator's share is the part that doesn't spread over more cores.
+
+ On a single core (so the workers, the clients and the game all share it), 3 rounds:
+   workers  players  V p50 ms  V p99 ms  V max ms  deliveries/s  coord CPU ms  worker CPU ms
+   0        5000     535.8     733.9     735.4     6799          687           0
+   1        5000     421.2     640.3     642.1     7788          17            623
+   2        5000     716.7     832.8     834.3     5993          13            397
+   4        5000     753.4     867.0     868.6     5756          10            277
+ The latencies can't improve there, as all the processes take turns on the one core. The CPU
+ split is what counts. The coordinator spends 10-17 ms a round whatever the worker count, under
+ 3% of the work, while the workers share the fan-out about evenly: their total stays at
+ 600-800 ms a round, noise included. So the coordinator and its IPC aren't what limits scaling.
+ On a host with a core for each worker, the V latency should come down towards coordinator plus
+ busiest worker. That hasn't been measured yet; only one core was available for these numbers.
+*/
+
+const child_process = require('child_process');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const performance = require('perf_hooks').performance;
+const WebSocket = require('ws');
+
+const PORT = parseInt(process.env.VETO_PORT || '8890', 10);
+const URL = 'ws://127.0.0.1:' + PORT + '/';
+
+let now = function() {
+  return performance.timeOrigin + performance.now();
+};
+
+// Client process: node fanout.js --clients count prefix
+let clients = function(count, prefix) {
+  let sockets = [];
+  let arrivals = [];
+  let ended = 0;
+  let joined = 0;
+  let next = 0;
+
+  let open = function(i) {
+    let ws = new WebSocket(URL, 'veto');
+    ws.on('open', function() {
+      ws.send(JSON.stringify({ type: 'join', nick: prefix + i, batch: true }));
+    });
+    ws.on('message', function(data) {
+      data.split('\n').forEach(function(record) {
+        if (record.startsWith('cookie:')) {
+          if (++joined == count) process.send({ type: 'ready' });
+          else if (next < count) open(next++);
+        } else if (record == 'V') {
+          arrivals[i] = now();
+        } else if (record[0] == 'E' && ++ended == count) {
+          ended = 0;
+          process.send({ type: 'round', arrivals: arrivals });
+          arrivals = [];
+        }
+      });
+    });
+    ws.on('error', function(e) {
+      console.log(prefix + i + ': ' + e.message);
+      process.exit(1);
+    });
+    sockets.push(ws);
+  };
+
+  // at most 100 handshakes at a time
+  while (next < Math.min(count, 100)) open(next++);
+};
+
+// ms of CPU time used so far by the server and each of its workers, by pid; from /proc, so empty
+// anywhere but on Linux
+let clockTicks = 0;
+let cpuTimes = function(pid) {
+  let times = {};
+  let read = function(pid) {
+    try {
+      let stat = fs.readFileSync('/proc/' + pid + '/stat', 'utf8');
+      let fields = stat.slice(stat.lastIndexOf(')') + 2).split(' '); // from the third field on
+      times[pid] = (parseInt(fields[11], 10) + parseInt(fields[12], 10)) * 1000 / clockTicks; // utime + stime
+    } catch (e) {}
+  };
+  try {
+    if (!clockTicks) clockTicks = parseInt(child_process.execSync('getconf CLK_TCK').toString(), 10) || 100;
+    read(pid);
+    fs.readFileSync('/proc/' + pid + '/task/' + pid + '/children', 'utf8').split(' ').forEach(function(child) {
+      if (child.trim()) read(child.trim());
+    });
+  } catch (e) {}
+  return times;
+};
+
+let percentile = function(sorted, p) {
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+};
+
+let connectMonitor = function(callback) {
+  let ws = new WebSocket(URL, 'veto');
+  ws.on('open', function() {
+    ws.send(JSON.stringify({ type: 'monitor', batch: true }));
+    ws.send(JSON.stringify({ type: 'start' }));
+    callback(ws);
+  });
+  ws.on('error', function() {
+    setTimeout(connectMonitor, 200, callback); // not listening yet
+  });
+};
+
+// One server run with the given number of workers
+let run = function(workers, connections, rounds, callback) {
+  let server = child_process.spawn(process.execPath, [path.join(__dirname, 'server.js')], {
+    env: Object.assign({}, process.env, {
+      VETO_WORKERS: workers, VETO_PORT: PORT, VETO_AUDIT_INTERVAL: 0, VETO_LIVE_TALLY_HZ: 0
+    }),
+    stdio: 'ignore'
+  });
+
+  connectMonitor(function(monitor) {
+    let processes = os.cpus().length;
+    let children = [];
+    let ready = 0, reported = 0, round = 0;
+    let started, latencies = [], results = [];
+    let cpu, cpuStarted;
+
+    let vote = function() {
+      latencies = [];
+      reported = 0;
+      cpuStarted = cpuTimes(server.pid);
+      started = now();
+      monitor.send(JSON.stringify({ type: 'voting' }));
+    };
+
+    let finish = function() {
+      children.forEach(function(child) { child.kill(); });
+      monitor.close();
+      server.on('exit', function() { callback(results); });
+      server.kill();
+    };
+
+    for (let i = 0; i < processes; i++) {
+      let count = Math.floor(connections / processes) + (i < connections % processes ? 1 : 0);
+      if (!count) continue;
+      let child = child_process.fork(__filename, ['--clients', count, 'p' + i + '_']);
+      child.on('message', function(message) {
+        if (message.type == 'ready') {
+          if (++ready == children.length) vote();
+        } else if (message.type == 'round') {
+          message.arrivals.forEach(function(time) { latencies.push(time - started); });
+          if (++reported < children.length) return;
+          latencies.sort(function(a, b) { return a - b; });
+          // what the coordinator and each worker spent on the round, from V to the last E
+          cpu = {};
+          let times = cpuTimes(server.pid);
+          Object.keys(times).forEach(function(pid) {
+            cpu[pid == server.pid ? 'coordinator' : pid] = times[pid] - (cpuStarted[pid] || 0);
+          });
+          results.push({ latencies: latencies, cpu: cpu });
+          if (++round < rounds) vote();
+          else finish();
+        }
+      });
+      children.push(child);
+    }
+  });
+};
+
+let report = function(workers, connections, results) {
+  let p50 = 0, p99 = 0, max = 0, coordinator = 0, busiest = 0;
+  results.forEach(function(result) {
+    let latencies = result.latencies;
+    p50 += percentile(latencies, 0.5) / results.length;
+    p99 += percentile(latencies, 0.99) / results.length;
+    max += latencies[latencies.length - 1] / results.length;
+    coordinator += (result.cpu.coordinator || 0) / results.length;
+    let worker = 0;
+    Object.keys(result.cpu).forEach(function(pid) {
+      if (pid != 'coordinator') worker = Math.max(worker, result.cpu[pid]);
+    });
+    busiest += worker / results.length;
+  });
+  console.log([workers, connections, p50.toFixed(1), p99.toFixed(1), max.toFixed(1),
+               Math.round(connections / (max / 1000)), Math.round(coordinator), Math.round(busiest)].join('\t'));
+};
+
+if (process.argv[2] == '--clients') {
+  clients(parseInt(process.argv[3], 10), process.argv[4]);
+} else {
+  let connections = parseInt(process.argv[2] || '2000', 10);
+  let rounds = parseInt(process.argv[3] || '3', 10);
+  let counts = process.argv.slice(4).map(function(n) { return parseInt(n, 10); });
+  if (!counts.length) {
+    for (let n = 1; n < os.cpus().length; n *= 2) counts.push(n);
+    counts.push(os.cpus().length);
+  }
+
+  console.log('workers\tplayers\tV p50 ms\tV p99 ms\tV max ms\tdeliveries/s\tcoord CPU ms\tworker CPU ms');
+  let next = function() {
+    if (!counts.length) return;
+    let workers = counts.shift();
+    run(workers, connections, rounds, function(results) {
+      report(workers, connections, results);
+      setTimeout(next, 500); // let the port go
+    });
+  };
+  next();
+}
@@ -0,0 +1,187 @@
+/* Append-only journal of the game events of a room, so a restarted server picks up where the
+ last one stopped and players can still reconnect with their cookies.
+
+ Every room has a snapshot and the journal of the events since it, in VETO_JOURNAL_DIR:
+   <room>.snapshot - {"gen": g, "state": ...}, replaced atomically
+   <room>.<g>.journal - one JSON array per line, appended
+ Taking a snapshot starts the journal of the next generation right away and deletes the old
+ one only after the snapshot has been written, so if the server dies in between, the older
+ snapshot and both journals still hold everything.
+
+ Appending only queues the event. Whatever got queued meanwhile is written (and fdatasync'ed,
+ unless VETO_JOURNAL_SYNC=0) in one go once the previous write is done, from the thread pool,
+ so the game never waits for the disk. Writes happen strictly in order, each to the journal of
+ the generation its events belong to; close() calls back once they're all on disk.
+*/
+
+const fs = require('fs');
+const path = require('path');
+const transport = require('./transport');
+
+const DIR = process.env.VETO_JOURNAL_DIR || ''; // no journal if not set
+const SYNC = transport.env('VETO_JOURNAL_SYNC', 1);
+const SNAPSHOT_EVERY = transport.env('VETO_JOURNAL_SNAPSHOT_EVERY', 5000); // events
+
+let Journal = function(room) {
+  this.base = path.join(DIR, encodeURIComponent(room));
+  this.gen = 0;
+  this.count = 0; // events since the snapshot
+  this.queue = []; // lines for the journal of the current generation
+  this.sealed = []; // {fd, data} of older generations still to be written, the fd closed after
+  this.writing = false;
+  this.saving = false; // a snapshot is being taken
+  this.fd = null; // of the current generation, null once closed
+  this.closed = null; // callback of close(), once everything is written
+};
+
+Journal.prototype.file = function(gen) {
+  return this.base + '.' + gen + '.journal';
+};
+
+// Reads back what was saved: {state: snapshot state or null, events: [...]}
+Journal.prototype.load = function() {
+  let result = { state: null, events: [] };
+  try {
+    let snapshot = JSON.parse(fs.readFileSync(this.base + '.snapshot', 'utf8'));
+    this.gen = snapshot.gen;
+    result.state = snapshot.state;
+  } catch (e) {
+    if (e.code != 'ENOENT') console.log('journal: bad snapshot ' + this.base + '.snapshot: ' + e.message);
+  }
+  // the next generation too, in case a snapshot didn't make it
+  for (let gen = this.gen; fs.existsSync(this.file(gen)); gen++) {
+    let lines = fs.readFileSync(this.file(gen), 'utf8').split('\n');
+    for (let i = 0; i < lines.length; i++) {
+      if (!lines[i]) continue;
+      try {
+        result.events.push(JSON.parse(lines[i]));
+      } catch (e) {
+        // the last line may have been cut short by a crash, nothing after it is trustworthy
+        console.log('journal: ' + this.file(gen) + ' ends at line ' + (i + 1));
+        break;
+      }
+    }
+    this.gen = gen;
+  }
+  this.count = result.events.length;
+  this.fd = fs.openSync(this.file(this.gen), 'a');
+  return result;
+};
+
+Journal.prototype.append = function(event) {
+  this.queue.push(JSON.stringify(event) + '\n');
+  this.count++;
+  if (this.queue.length == 1) setImmediate(this.flush.bind(this));
+};
+
+// Writes the next batch: what's left of older generations first, then the current one
+Journal.prototype.flush = function() {
+  if (this.writing) return;
+  let batch = this.sealed.shift();
+  if (!batch && this.queue.length && this.fd !== null) {
+    batch = { fd: this.fd, data: this.queue.join(''), close: false };
+    this.queue = [];
+  }
+  if (!batch) {
+    if (this.closed && this.fd === null && !this.queue.length) {
+      let closed = this.closed;
+      this.closed = null;
+      closed();
+    }
+    return;
+  }
+
+  let journal = this;
+  let done = function() {
+    if (batch.close) fs.close(batch.fd, function() {});
+    journal.writing = false;
+    journal.flush();
+  };
+  this.writing = true;
+  if (!batch.data) return done();
+  fs.write(batch.fd, batch.data, function(err) {
+    if (err) console.log('journal: writing ' + journal.base + ' failed: ' + err.message);
+    if (SYNC && !err) fs.fdatasync(batch.fd, done);
+    else done();
+  });
+};
+
+// The events queued so far go to the current journal, which then gets closed
+Journal.prototype.seal = function() {
+  this.sealed.push({ fd: this.fd, data: this.queue.join(''), close: true });
+  this.queue = [];
+  this.fd = null;
+};
+
+// Whether enough events piled up to make a snapshot worth it
+Journal.prototype.due = function() {
+  return this.count >= SNAPSHOT_EVERY && !this.saving && !this.closed;
+};
+
+// Takes a snapshot of dump() on the next tick, out of the way of whatever made it due
+Journal.prototype.snapshot = function(dump) {
+  let journal = this;
+  this.saving = true;
+  setImmediate(function() {
+    if (journal.closed) {
+      journal.saving = false;
+      return;
+    }
+    journal.save(dump());
+  });
+};
+
+Journal.prototype.save = function(state) {
+  let journal = this;
+  let old = this.file(this.gen);
+  let data = JSON.stringify({ gen: this.gen + 1, state: state });
+
+  // everything up to now belongs to the old generation, which the snapshot covers
+  this.seal();
+  this.gen++;
+  this.count = 0;
+  this.fd = fs.openSync(this.file(this.gen), 'w');
+  this.flush();
+
+  let tmp = this.base + '.snapshot.tmp';
+  let failed = function(err) {
+    console.log('journal: writing ' + tmp + ' failed: ' + err.message);
+    journal.saving = false; // the old snapshot and the journals since still have it all
+  };
+  fs.open(tmp, 'w', function(err, fd) {
+    if (err) return failed(err);
+    fs.write(fd, data, function(err) {
+      let close = function(err) {
+        fs.close(fd, function() {
+          if (err) return failed(err);
+          fs.rename(tmp, journal.base + '.snapshot', function(err) {
+            if (err) return failed(err);
+            journal.saving = false;
+            fs.unlink(old, function() {});
+          });
+        });
+      };
+      if (SYNC && !err) fs.fsync(fd, close);
+      else close(err);
+    });
+  });
+};
+
+// Writes whatever is still queued, after what's being written already, and calls back once it's
+// all on disk
+Journal.prototype.close = function(callback) {
+  this.closed = callback || function() {};
+  if (this.fd !== null) this.seal();
+  this.flush();
+};
+
+// null if journaling is off
+let open = function(room) {
+  if (!DIR) return null;
+  fs.mkdirSync(DIR, { recursive: true });
+  return new Journal(room);
+};
+
+module.exports = {
+  open: open
+};
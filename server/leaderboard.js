@@ -0,0 +1,92 @@
+/* Players grouped by score, for ranked lookups without sorting all of them.
+
+ Scores only move by small steps, so there are far fewer distinct scores than
+ players: a sorted array of the distinct scores plus a Set of players for each
+ one is enough. Adding, removing and rescoring a player costs a binary search
+ and, when a score appears or disappears, a splice of the score array. Walking
+ from either end reaches the top-k after k players. Players with equal scores
+ stay in the order they got that score.
+
+ player.score is owned by the leaderboard - change it with setScore only.
+*/
+
+let create = function() {
+  let scores = []; // ascending
+  let buckets = new Map(); // score -> Set of players
+
+  let search = function(score) {
+    let low = 0, high = scores.length;
+    while (low < high) {
+      let mid = (low + high) >> 1;
+      if (scores[mid] < score) low = mid + 1;
+      else high = mid;
+    }
+    return low;
+  };
+
+  let insert = function(player) {
+    let bucket = buckets.get(player.score);
+    if (!bucket) {
+      bucket = new Set();
+      buckets.set(player.score, bucket);
+      scores.splice(search(player.score), 0, player.score);
+    }
+    bucket.add(player);
+  };
+
+  let remove = function(player) {
+    let bucket = buckets.get(player.score);
+    if (!bucket || !bucket.delete(player)) return;
+    if (!bucket.size) {
+      buckets.delete(player.score);
+      scores.splice(search(player.score), 1);
+    }
+  };
+
+  let setScore = function(player, score) {
+    if (player.score === score) return;
+    remove(player);
+    player.score = score;
+    insert(player);
+  };
+
+  // Calls fn for players from the lowest score up (or from the highest down) until it returns false.
+  let each = function(ascending, fn) {
+    for (let i = 0; i < scores.length; i++) {
+      let bucket = buckets.get(scores[ascending ? i : scores.length - 1 - i]);
+      for (let player of bucket) {
+        if (fn(player) === false) return;
+      }
+    }
+  };
+
+  // All the players with the highest score
+  let best = function() {
+    return scores.length ? Array.from(buckets.get(scores[scores.length - 1])) : [];
+  };
+
+  // [score, name] of the first count players from the top
+  let top = function(count) {
+    let result = [];
+    if (count > 0) {
+      each(false, function(player) {
+        result.push([player.score, player.name]);
+        return result.length < count;
+      });
+    }
+    return result;
+  };
+
+  return {
+    add: insert,
+    remove: remove,
+    setScore: setScore,
+    each: each,
+    best: best,
+    top: top
+  };
+};
+
+module.exports = {
+  create: create
+};
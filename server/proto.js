@@ -0,0 +1,248 @@
+/* veto-bin - compact binary subprotocol, negotiated next to the text "veto" one
+
+ Every binary frame holds one or more records: an opcode byte followed by
+ a payload whose shape is fixed by the opcode. Integers are zigzag-encoded
+ little-endian base-128 varints, strings are a varint byte length followed
+ by UTF-8 bytes.
+
+ server -> client, opcodes are the characters used by the text protocol:
+   S, V, end, canVeto, ok, err - no payload
+   C, F, A, N, P, t, score - integer
+   j, l, r - integer, the id of a player that joined, left or reconnected
+   E - one byte, 1 for passed, 0 for rejected
+   v, T, J, L, R, cookie, nick - string
+   X - string, why a message from this connection was rejected (it couldn't be decoded)
+   W - one byte with the award number, then string
+   Z - nine integers followed by four strings, see snapshot below
+   Y - three integers
+   D, K - two integers
+   B - integer count, then that many pairs of an integer score and a string nick
+   I - integer player id, then string with its nick; sent before the first j, l or r about it
+
+ client -> server:
+   0x01 monitor, 0x02 start, 0x03 voting, 0x04 veto - no payload
+   0x05 join, 0x06 reconnect - string (nick/cookie)
+   0x07 vote for, 0x08 vote against, 0x09 abstain - no payload
+   0x0a monitor with options - varint flags: 1 server timestamps (t), 2 live tally (Y),
+        4 leaderboard (B); unknown flags are ignored, so a newer monitor still registers
+   0x0d clock - integer (time)
+
+ New monitor options get a flag, not an opcode: an opcode a server doesn't know makes it reject the
+ whole message (with an X), while a flag it doesn't know just doesn't get that monitor the extra.
+*/
+
+const NONE = 0, INTEGER = 1, RESULT = 2, STRING = 3, WINNER = 4, SNAPSHOT = 5, PLAYER = 6, INTEGERS = 7, BOARD = 8;
+
+// name -> [text prefix, opcode, payload]
+const messages = {
+  S: ['S', 0x53, NONE],
+  V: ['V', 0x56, NONE],
+  C: ['C', 0x43, INTEGER],
+  F: ['F', 0x46, INTEGER],
+  A: ['A', 0x41, INTEGER],
+  N: ['N', 0x4e, INTEGER],
+  E: ['E', 0x45, RESULT],
+  v: ['v', 0x76, STRING],
+  T: ['T', 0x54, STRING],
+  W: ['W', 0x57, WINNER],
+  P: ['P', 0x50, INTEGER],
+  J: ['J', 0x4a, STRING],
+  L: ['L', 0x4c, STRING],
+  R: ['R', 0x52, STRING],
+  I: ['I', 0x49, PLAYER],
+  j: ['j', 0x6a, INTEGER],
+  l: ['l', 0x6c, INTEGER],
+  r: ['r', 0x72, INTEGER],
+  t: ['t', 0x74, INTEGER],
+  Z: ['Z', 0x5a, SNAPSHOT],
+  Y: ['Y', 0x59, INTEGERS],
+  D: ['D', 0x44, INTEGERS],
+  K: ['K', 0x4b, INTEGERS],
+  B: ['B', 0x42, BOARD],
+  X: ['X', 0x58, STRING],
+  cookie: ['cookie:', 0x6b, STRING],
+  nick: ['nick:', 0x6e, STRING],
+  score: ['score:', 0x73, INTEGER],
+  end: ['end', 0x65, NONE],
+  canVeto: ['canVeto', 0x78, NONE],
+  ok: ['ok', 0x6f, NONE],
+  err: ['err', 0x21, NONE]
+};
+
+const commands = {
+  0x01: { type: 'monitor' },
+  0x02: { type: 'start' },
+  0x03: { type: 'voting' },
+  0x04: { type: 'veto' },
+  0x05: 'join',
+  0x06: 'reconnect',
+  0x0a: 'monitor',
+  0x0d: 'clock',
+  0x07: { type: 'vote', choice: true },
+  0x08: { type: 'vote', choice: false },
+  0x09: { type: 'vote', choice: null }
+};
+
+// flags of 0x0a
+const MONITOR_TIMESTAMPS = 1, MONITOR_LIVE = 2, MONITOR_LEADERBOARD = 4;
+
+let encodeText = function(name, arg) {
+  let message = messages[name];
+  switch (message[2]) {
+    case NONE: return message[0];
+    case RESULT: return message[0] + (arg ? 'F' : 'A');
+    case WINNER: return message[0] + arg[0] + arg[1];
+    case SNAPSHOT: return message[0] + arg[0].join(',') + arg[1].map(function(str) { return '\x1f' + str; }).join('');
+    case PLAYER: return message[0] + arg[0] + ':' + arg[1];
+    case INTEGERS: return message[0] + arg.join(',');
+    case BOARD: return message[0] + arg.map(function(entry) { return '\x1f' + entry[0] + ':' + entry[1]; }).join('');
+    default: return message[0] + arg;
+  }
+};
+
+let varintLength = function(value) {
+  let length = 1;
+  while (value > 0x7f) {
+    value = Math.floor(value / 128);
+    length++;
+  }
+  return length;
+};
+
+let writeVarint = function(buffer, offset, value) {
+  while (value > 0x7f) {
+    buffer[offset++] = (value & 0x7f) | 0x80;
+    value = Math.floor(value / 128);
+  }
+  buffer[offset++] = value;
+  return offset;
+};
+
+let zigzag = function(value) {
+  return value >= 0 ? value * 2 : -value * 2 - 1;
+};
+
+let encodeBinary = function(name, arg) {
+  let message = messages[name];
+  let buffer, offset, str;
+  switch (message[2]) {
+    case NONE:
+      buffer = Buffer.allocUnsafe(1);
+      buffer[0] = message[1];
+      return buffer;
+    case INTEGER:
+      arg = zigzag(arg);
+      buffer = Buffer.allocUnsafe(1 + varintLength(arg));
+      buffer[0] = message[1];
+      writeVarint(buffer, 1, arg);
+      return buffer;
+    case RESULT:
+      buffer = Buffer.allocUnsafe(2);
+      buffer[0] = message[1];
+      buffer[1] = arg ? 1 : 0;
+      return buffer;
+    case STRING:
+      str = Buffer.from(String(arg));
+      buffer = Buffer.allocUnsafe(1 + varintLength(str.length) + str.length);
+      buffer[0] = message[1];
+      str.copy(buffer, writeVarint(buffer, 1, str.length));
+      return buffer;
+    case WINNER:
+      str = Buffer.from(String(arg[1]));
+      buffer = Buffer.allocUnsafe(2 + varintLength(str.length) + str.length);
+      buffer[0] = message[1];
+      buffer[1] = arg[0];
+      str.copy(buffer, writeVarint(buffer, 2, str.length));
+      return buffer;
+    case PLAYER:
+      str = Buffer.from(String(arg[1]));
+      offset = varintLength(zigzag(arg[0]));
+      buffer = Buffer.allocUnsafe(1 + offset + varintLength(str.length) + str.length);
+      buffer[0] = message[1];
+      str.copy(buffer, writeVarint(buffer, writeVarint(buffer, 1, zigzag(arg[0])), str.length));
+      return buffer;
+    case INTEGERS:
+      arg = arg.map(zigzag);
+      offset = 1;
+      arg.forEach(function(value) { offset += varintLength(value); });
+      buffer = Buffer.allocUnsafe(offset);
+      buffer[0] = message[1];
+      offset = 1;
+      arg.forEach(function(value) { offset = writeVarint(buffer, offset, value); });
+      return buffer;
+    case BOARD:
+      let entries = arg.map(function(entry) { return [zigzag(entry[0]), Buffer.from(String(entry[1]))]; });
+      offset = 1 + varintLength(entries.length);
+      entries.forEach(function(entry) { offset += varintLength(entry[0]) + varintLength(entry[1].length) + entry[1].length; });
+      buffer = Buffer.allocUnsafe(offset);
+      buffer[0] = message[1];
+      offset = writeVarint(buffer, 1, entries.length);
+      entries.forEach(function(entry) {
+        offset = writeVarint(buffer, offset, entry[0]);
+        offset = writeVarint(buffer, offset, entry[1].length);
+        offset += entry[1].copy(buffer, offset);
+      });
+      return buffer;
+    case SNAPSHOT:
+      let numbers = arg[0].map(zigzag);
+      let strings = arg[1].map(function(str) { return Buffer.from(String(str)); });
+      let length = 1;
+      numbers.forEach(function(value) { length += varintLength(value); });
+      strings.forEach(function(str) { length += varintLength(str.length) + str.length; });
+      buffer = Buffer.allocUnsafe(length);
+      buffer[0] = message[1];
+      offset = 1;
+      numbers.forEach(function(value) { offset = writeVarint(buffer, offset, value); });
+      strings.forEach(function(str) {
+        offset = writeVarint(buffer, offset, str.length);
+        offset += str.copy(buffer, offset);
+      });
+      return buffer;
+  }
+};
+
+// Decodes all the records in an incoming binary frame into objects shaped like the JSON ones.
+// Returns null if the frame is malformed.
+let decodeCommands = function(buffer) {
+  let result = [];
+  let offset = 0;
+  while (offset < buffer.length) {
+    let command = commands[buffer[offset++]];
+    if (!command) return null;
+    if (typeof command == 'object') {
+      result.push(command);
+      continue;
+    }
+    let length = 0, shift = 1, byte;
+    do {
+      if (offset >= buffer.length) return null;
+      byte = buffer[offset++];
+      length += (byte & 0x7f) * shift;
+      shift *= 128;
+    } while (byte & 0x80);
+    if (command == 'clock') {
+      // not a length but the zigzag-encoded time
+      result.push({ type: 'clock', time: length % 2 ? -(length + 1) / 2 : length / 2 });
+      continue;
+    }
+    if (command == 'monitor') {
+      // not a length but the flags
+      result.push({ type: 'monitor', timestamps: !!(length & MONITOR_TIMESTAMPS), live: !!(length & MONITOR_LIVE),
+                   leaderboard: !!(length & MONITOR_LEADERBOARD) });
+      continue;
+    }
+    if (offset + length > buffer.length) return null;
+    let str = buffer.toString('utf8', offset, offset + length);
+    offset += length;
+    result.push(command == 'join' ? { type: 'join', nick: str } : { type: 'reconnect', cookie: str });
+  }
+  return result;
+};
+
+module.exports = {
+  PROTOCOL_TEXT: 'veto',
+  PROTOCOL_BINARY: 'veto-bin',
+  encodeText: encodeText,
+  encodeBinary: encodeBinary,
+  decodeCommands: decodeCommands
+};
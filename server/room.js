@@ -0,0 +1,760 @@
+/* One game: its players, rounds, voting, vetos and monitor. server.js keeps one per URL path.
+*/
+
+const VOTING_TIME = 5;
+
+const performance = require('perf_hooks').performance;
+
+const WebSocket = require('ws');
+const randomstring = require('randomstring');
+const proto = require('./proto');
+const leaderboard = require('./leaderboard');
+const transport = require('./transport');
+const shards = require('./shards');
+const journal = require('./journal');
+
+const env = transport.env;
+
+const AUDIT_INTERVAL = env('VETO_AUDIT_INTERVAL', 30000); // ms, 0 to disable
+const LIVE_TALLY_HZ = env('VETO_LIVE_TALLY_HZ', 10); // 0 disables the live tally
+const BOARD_SIZE = 10;
+const COUNTER = env('VETO_COUNTER', 0); // 1 to broadcast C every second too, for clients that don't know D
+
+// The voting clock: ms on a monotonic clock, so it doesn't jump with the system time. Clients get
+// its readings from the clock command to estimate their offset to it.
+let clock = function() {
+  return Math.round(performance.now());
+};
+
+// Sockets of workers in the sharded mode do their own batching, see transport.js
+let sendEncoded = function(ws, data, name) {
+  if (ws.remote) ws.sendEncoded(data, name);
+  else transport.sendEncoded(ws, data, name);
+};
+
+// options:
+//   sharded - broadcasts go to the workers, see shards.js
+//   onEmpty() - called when the last connection closes
+//   onMonitor() - called when a monitor registers
+let create = function(roomName, options) {
+  let players = [];
+  let board = leaderboard.create(); // the same players, ranked by score
+
+  // Every player ever seen in this room, by cookie for O(1) reconnects, and by a numeric id that's
+  // stable for the lifetime of the room and lets veto-bin monitors refer to players without their
+  // nicks.
+  let registry = {
+    nextId: 1,
+    byId: new Map(),
+    byCookie: new Map()
+  };
+
+  let register = function(player) {
+    player.id = registry.nextId++;
+    registry.byId.set(player.id, player);
+    registry.byCookie.set(player.cookie, player);
+    players.push(player);
+    board.add(player);
+    boardChanged();
+  };
+
+  // Kept up to date on join, reconnect and close instead of recounting all the clients every time.
+  // connected - players whose latest connection is open, their count is what P reports
+  // active - open connections that joined or reconnected, counted as voters in countVotes
+  // recipients - the active connections of players still in the game, who get the broadcasts
+  let connected = new Set();
+  let active = new Set();
+  let recipients = new Set();
+
+  let updateRecipient = function(ws) {
+    let recipient = active.has(ws) && !ws.data.ended;
+    if (recipient == recipients.has(ws)) return;
+    if (recipient) recipients.add(ws);
+    else recipients.delete(ws);
+    if (ws.remote) ws.setRecipient(recipient);
+  };
+
+  let attach = function(ws) {
+    active.add(ws);
+    updateRecipient(ws);
+    tallyChanged();
+    ws.data.connected = true;
+    ws.data.ws = ws;
+    connected.add(ws.data);
+  };
+
+  // false if the player stays online: an older connection of a player that has already
+  // reconnected doesn't take it offline
+  let detach = function(ws) {
+    active.delete(ws);
+    recipients.delete(ws);
+    tallyChanged();
+    if (ws.data.ws !== ws) return false;
+    ws.data.connected = false;
+    connected.delete(ws.data);
+    return true;
+  };
+
+  // Recounts from scratch now and then; a mismatch means a missed update somewhere, so log it and heal.
+  let audit = function() {
+    let expectedConnected = new Set();
+    let expectedActive = new Set();
+    let expectedRecipients = new Set();
+    sockets.forEach(function each(client) {
+      if (client.readyState === WebSocket.OPEN && client.data) {
+        expectedActive.add(client);
+        if (client.data.connected && client.data.ws === client) {
+          expectedConnected.add(client.data);
+        }
+        if (!client.data.ended) {
+          expectedRecipients.add(client);
+        }
+      }
+    });
+    if (expectedConnected.size != connected.size || expectedActive.size != active.size ||
+        expectedRecipients.size != recipients.size) {
+      console.log(roomName + ': player count drift: ' + connected.size + '/' + active.size + '/' + recipients.size + ' tracked, ' +
+                  expectedConnected.size + '/' + expectedActive.size + '/' + expectedRecipients.size + ' counted');
+      connected = expectedConnected;
+      active = expectedActive;
+      recipients = expectedRecipients;
+      sockets.forEach(function each(client) {
+        if (client.remote) client.setRecipient(recipients.has(client));
+      });
+      if (state.monitor) send(state.monitor, 'P', connected.size);
+    }
+  };
+
+  // All the connections in the room, joined or not
+  let sockets = new Set();
+
+  let metrics = {
+    connections: 0, // ever
+    commands: 0,
+    broadcasts: 0
+  };
+
+  let state = {
+    monitor: null,
+    voting: false,
+    deadline: 0, // voting clock time when the voting closes
+    started: false,
+    round: 0,
+    canVeto: false,
+    vetos: 0,
+    vetoers: [],
+    results: [0, 0, 0],
+    winners: ['', '', '', '']
+  };
+
+  let send = function(ws, name, arg) {
+    if (!ws) return; // a player restored from the journal that hasn't reconnected yet
+    sendEncoded(ws, ws.binary ? proto.encodeBinary(name, arg) : proto.encodeText(name, arg), name);
+  };
+
+  // J, L and R go to veto-bin monitors as j, l and r with the player id, preceded by an I with the
+  // nick the first time the connection hears about that player.
+  let sendPlayer = function(ws, name, player) {
+    if (!ws.binary) {
+      send(ws, name, player.name);
+      return;
+    }
+    if (!ws.known.has(player.id)) {
+      ws.known.add(player.id);
+      send(ws, 'I', [player.id, player.name]);
+    }
+    send(ws, name.toLowerCase(), player.id);
+  };
+
+  // Running totals of the current voting, kept up to date by setVote so the deadline doesn't have
+  // to go through all the players before it can announce the result.
+  let tally = {
+    for: 0,
+    against: 0,
+    timer: null
+  };
+
+
+  // Live tally for monitors that asked for it with "live": true, coalesced to VETO_LIVE_TALLY_HZ.
+  // Abstentions include the players that dropped out since the voting started.
+  let sendTally = function() {
+    tally.timer = null;
+    if (!state.voting || !state.monitor || !state.monitor.live) return;
+    send(state.monitor, 'Y', [tally.for, tally.against, active.size - tally.for - tally.against - state.vetoers.length]);
+  };
+
+  let tallyChanged = function() {
+    if (!LIVE_TALLY_HZ || !state.voting || tally.timer) return;
+    tally.timer = setTimeout(sendTally, 1000 / LIVE_TALLY_HZ);
+  };
+
+  let resetTally = function() {
+    tally.for = 0;
+    tally.against = 0;
+    clearTimeout(tally.timer);
+    tally.timer = null;
+  };
+
+  // choice is true, false or null (abstained)
+  let setVote = function(player, choice) {
+    if (player.vote === true) tally.for--;
+    if (player.vote === false) tally.against--;
+    player.vote = choice;
+    if (player.vote === true) tally.for++;
+    if (player.vote === false) tally.against++;
+    tallyChanged();
+  };
+
+  // Top 10 for a monitor that asked for it with "leaderboard": true, sent once per tick after
+  // any change.
+  let boardScheduled = false;
+
+  let sendBoard = function() {
+    boardScheduled = false;
+    if (!state.monitor || !state.monitor.leaderboard) return;
+    send(state.monitor, 'B', board.top(BOARD_SIZE));
+  };
+
+  let boardChanged = function() {
+    if (boardScheduled) return;
+    boardScheduled = true;
+    setImmediate(sendBoard);
+  };
+
+  let countVotes = function() {
+      let allplayers = active.size;
+      let forvotes = tally.for; let against = tally.against;
+      let nonevotes = allplayers - forvotes - against;
+      clearTimeout(tally.timer);
+      tally.timer = null;
+
+      broadcast('F', forvotes);
+      broadcast('A', against);
+      broadcast('N', nonevotes - state.vetoers.length);
+      state.results = [forvotes, against, nonevotes - state.vetoers.length];
+
+      let result = 'A';
+      if (forvotes > against) {
+        result = 'F'
+      }
+
+      broadcast('E', result == 'F');
+
+      let scores = [];
+      players.forEach(function(player) {
+        if (player.vote === (result == 'F')) { // points for voting like majority
+          board.setScore(player, player.score + 1);
+        } else if (player.vote != null) {
+          board.setScore(player, player.score - 1);
+        }
+        if (player.vote != null) scores.push([player.id, player.score]);
+        send(player.ws, 'score', player.score);
+
+      });
+      boardChanged();
+
+      state.round++;
+      record(['round', state.results, scores]);
+
+  };
+
+  // What survives a restart, see journal.js. Events are recorded after they've changed the state,
+  // a snapshot taken right after one includes it:
+  //   ['join', id, nick, cookie]
+  //   ['start']
+  //   ['round', [for, against, abstained], [[id, score] of the players that voted, ...]]
+  //   ['veto', id, score, winners or null if the game goes on]
+  // A voting in progress isn't recorded, after a restart the monitor starts it again.
+  let log = journal.open(roomName);
+
+  let record = function(event) {
+    if (!log) return;
+    log.append(event);
+    if (log.due()) log.snapshot(dump); // taken on the next tick, not in the middle of a handler
+  };
+
+  let dump = function() {
+    return {
+      nextId: registry.nextId,
+      players: players.map(function(player) {
+        return [player.id, player.name, player.cookie, player.score, player.ended];
+      }),
+      started: state.started,
+      round: state.round,
+      vetos: state.vetos,
+      vetoers: state.vetoers.map(function(player) { return player.id; }),
+      results: state.results,
+      winners: state.winners
+    };
+  };
+
+  let restorePlayer = function(id, name, cookie) {
+    let player = {
+      name: name,
+      score: 0,
+      vote: null,
+      vetoRight: false,
+      ended: false,
+      cookie: cookie,
+      connected: false,
+      ws: null
+    };
+    registry.nextId = id;
+    register(player);
+    return player;
+  };
+
+  let replay = function(event) {
+    let player = registry.byId.get(event[1]);
+    if (event[0] == 'join') {
+      restorePlayer(event[1], event[2], event[3]);
+    } else if (event[0] == 'start') {
+      state.started = true;
+      state.round = 1;
+      state.vetos = 0;
+      state.vetoers = [];
+      state.results = [0, 0, 0];
+      state.winners = ['', '', '', ''];
+      players.forEach(function(player) {
+        board.setScore(player, 0);
+        player.ended = false;
+      });
+    } else if (event[0] == 'round') {
+      state.results = event[1];
+      event[2].forEach(function(score) {
+        board.setScore(registry.byId.get(score[0]), score[1]);
+      });
+      state.round++;
+    } else if (event[0] == 'veto' && player) {
+      board.setScore(player, event[2]);
+      player.ended = true;
+      state.vetoers.push(player);
+      state.vetos++;
+      state.round++;
+      if (event[3]) state.winners = event[3];
+    }
+  };
+
+  let restore = function() {
+    if (!log) return;
+    let started = clock();
+    let saved = log.load();
+    if (saved.state) {
+      saved.state.players.forEach(function(p) {
+        let player = restorePlayer(p[0], p[1], p[2]);
+        board.setScore(player, p[3]);
+        player.ended = p[4];
+      });
+      registry.nextId = saved.state.nextId;
+      state.started = saved.state.started;
+      state.round = saved.state.round;
+      state.vetos = saved.state.vetos;
+      state.vetoers = saved.state.vetoers.map(function(id) { return registry.byId.get(id); });
+      state.results = saved.state.results;
+      state.winners = saved.state.winners;
+    }
+    saved.events.forEach(replay);
+    if (saved.state || saved.events.length) {
+      console.log(roomName + ': restored ' + players.length + ' players, round ' + state.round + ' from ' +
+                  (saved.state ? 'a snapshot and ' : '') + saved.events.length + ' events in ' +
+                  (clock() - started) + ' ms');
+    }
+  };
+
+  // The voting ends on a single timer set for the deadline, rather than after a chain of one second
+  // timers that drifts by the event loop lag of each of them.
+  let timers = {
+    close: null,
+    counter: null
+  };
+
+  let stopClock = function() {
+    clearTimeout(timers.close);
+    clearTimeout(timers.counter);
+    timers.close = null;
+    timers.counter = null;
+  };
+
+  // Seconds left, as the C records count them: VOTING_TIME down to 0
+  let counter = function() {
+    return Math.min(VOTING_TIME, Math.max(0, Math.ceil((state.deadline - clock()) / 1000) - 1));
+  };
+
+  let sendDeadline = function(ws) {
+    send(ws, 'D', [state.deadline, Math.max(0, state.deadline - clock())]);
+  };
+
+  let startGame = function() {
+    if (state.started) {
+      console.log(roomName + ': RESTART');
+    } else {
+      console.log(roomName + ': START');
+    }
+    state.started = true;
+
+    state.vetoers = [];
+    state.deadline = 0;
+    state.voting = false;
+    stopClock();
+    state.vetos = 0;
+    state.canVeto = false;
+    state.results = [0, 0, 0];
+    state.winners = ['', '', '', ''];
+
+    resetTally();
+    players.forEach(function(player) {
+        player.vote = null;
+        player.vetoRight = false;
+        board.setScore(player, 0);
+        player.ended = false;
+        send(player.ws, 'score', 0);
+    });
+    active.forEach(updateRecipient);
+    boardChanged();
+
+    state.round=1;
+    record(['start']);
+
+    broadcast('S');
+
+  };
+
+  let startVote = function() {
+
+      if (state.voting) return;
+
+      console.log(roomName + ': VOTE round ' + state.round);
+
+      if (state.round % 5 == 0) {
+          state.canVeto = true;
+      } else {
+          state.canVeto = false;
+      }
+
+    resetTally();
+    players.forEach(function(player) {
+      player.vote = null;
+      player.vetoRight = false;
+    });
+
+    state.voting = true;
+    state.deadline = clock() + (VOTING_TIME + 1) * 1000;
+    broadcast('V');
+    broadcast('D', [state.deadline, state.deadline - clock()]);
+
+    if (state.canVeto) {
+      // the two lowest scores still in the game, and everyone tied with the third one
+      let rank = 0, third = null;
+      board.each(true, function(player) {
+        if (player.ended) return;
+        if (rank == 2) third = player.score;
+        if (rank >= 2 && player.score != third) return false;
+        player.vetoRight = true;
+        send(player.ws, 'canVeto');
+        rank++;
+      });
+    }
+
+    let close = function() {
+      let left = state.deadline - clock();
+      if (left > 0) { // timers may fire a bit early
+        timers.close = setTimeout(close, left);
+        return;
+      }
+      stopClock();
+      state.voting = false;
+      countVotes();
+    };
+    timers.close = setTimeout(close, state.deadline - clock());
+
+    if (COUNTER) {
+      // each one due at a whole number of seconds since the start, whenever the previous one ran
+      let value = VOTING_TIME;
+      let count = function() {
+        broadcast('C', value);
+        if (value-- > 0) timers.counter = setTimeout(count, state.deadline - (value + 1) * 1000 - clock());
+      };
+      count();
+    }
+  };
+
+  // Broadcast to the players still in the game and the monitor. Encoded at most once per protocol;
+  // workers get both encodings, as they can't tell which ones their recipients need.
+  let broadcast = function(name, arg) {
+    metrics.broadcasts++;
+    if (options.sharded) {
+      shards.broadcast(roomName, name, proto.encodeText(name, arg), proto.encodeBinary(name, arg));
+    } else {
+      transport.broadcast(recipients, name, function(binary) {
+        return binary ? proto.encodeBinary(name, arg) : proto.encodeText(name, arg);
+      });
+    }
+    if (state.monitor) send(state.monitor, name, arg);
+  };
+
+  // ws is a WebSocket, or a worker's socket seen through shards.js
+  let connection = function(ws) {
+
+    //broadcast("connected");
+
+    sockets.add(ws);
+    metrics.connections++;
+
+    if (ws.protocol == proto.PROTOCOL_BINARY) {
+      ws.binary = true;
+      ws.batch = true;
+    }
+
+    ws.on('close', function() {
+      sockets.delete(ws);
+      if (!sockets.size) options.onEmpty();
+      if (ws==state.monitor) {
+        state.monitor = null;
+        return;
+      }
+      if (!ws.data) return;
+      detach(ws);
+      if (state.monitor) {
+        send(state.monitor, 'P', connected.size);
+        sendPlayer(state.monitor, 'L', ws.data);
+      }
+    });
+
+    ws.on('message', function incoming(data) {
+      // Broadcast to everyone.
+      //broadcast(data);
+
+      if (typeof data == 'string') console.log('got ' + data + ' from ' + (ws.data ? ws.data.name : null))
+
+      let commands = transport.decode(data);
+      if (!commands) {
+        console.log('error decoding ' + (typeof data == 'string' ? data : 'binary message') + ' - ' +
+                    (ws.data ? ws.data.name : null));
+        send(ws, 'X', 'undecodable message');
+        return;
+      }
+      commands.forEach(handle);
+    });
+
+    // already decoded by a worker
+    ws.on('commands', function(commands) {
+      commands.forEach(handle);
+    });
+
+    let handle = function(data) {
+      metrics.commands++;
+
+      if (data.type == 'monitor') {
+        state.monitor = ws;
+        ws.batch = ws.binary || !!data.batch;
+        ws.timestamps = !!data.timestamps;
+        ws.known = new Set(); // player ids this connection has been told the nicks of
+        ws.live = !!data.live;
+        ws.leaderboard = !!data.leaderboard;
+        boardChanged();
+        console.log(roomName + ': monitor registered');
+        options.onMonitor();
+
+      send(state.monitor, 'P', connected.size);
+      send(state.monitor, 'Z', [[connected.size, state.round, state.started ? 1 : 0, state.voting ? 1 : 0,
+                                 state.voting ? counter() : 0, state.results[0], state.results[1], state.results[2],
+                                 state.vetos], state.winners]);
+        if (state.voting) sendDeadline(state.monitor);
+
+      }
+
+      if (data.type == 'join') {
+        if (ws.data) return;
+        ws.batch = ws.binary || !!data.batch;
+        ws.data = {
+          // control characters would break batched framing
+          name: String(data.nick).replace(/[\x00-\x1f]/g, '').trim(),
+          score: 0,
+          vote: null,
+          vetoRight: false,
+          ended: false,
+          cookie: randomstring.generate(),
+          connected: true,
+          ws: ws
+        };
+        register(ws.data);
+        record(['join', ws.data.id, ws.data.name, ws.data.cookie]);
+        attach(ws);
+        console.log(roomName + ': ' + ws.data.name + ' joined');
+
+        if (state.monitor) {
+          send(state.monitor, 'P', connected.size);
+          sendPlayer(state.monitor, 'J', ws.data);
+        }
+        send(ws, 'cookie', ws.data.cookie);
+      }
+
+      if (data.type == 'reconnect') {
+        ws.batch = ws.binary || !!data.batch;
+        let player = registry.byCookie.get(String(data.cookie));
+        if (player && ws.data && ws.data !== player) {
+          // a connection that joined as someone else becomes this one
+          if (detach(ws) && state.monitor) sendPlayer(state.monitor, 'L', ws.data);
+        }
+        if (player) ws.data = player;
+
+        if (!ws.data) {
+            send(ws, 'err');
+            return;
+        } else {
+            send(ws, 'ok');
+        }
+        attach(ws);
+
+        if (state.monitor) {
+          send(state.monitor, 'P', connected.size);
+          sendPlayer(state.monitor, 'R', ws.data);
+        }
+        send(ws, 'score', ws.data.score);
+        send(ws, 'nick', ws.data.name);
+        if (ws.data.ended) send(ws, 'end');
+        else if (state.voting) sendDeadline(ws);
+      }
+
+      if (data.type == 'vote') {
+        if (!ws.data) return;
+        if (ws.data.ended) return;
+        if (state.voting) {
+          console.log(roomName + ': ' + ws.data.name + ' voted ' + data.choice)
+          setVote(ws.data, data.choice == true ? true : data.choice == false ? false : null);
+        }
+      }
+
+      if (data.type == 'veto') {
+        if (!ws.data) return;
+        if (state.voting) {
+          if ((ws.data.vetoRight) && (state.canVeto)) {
+            state.canVeto = false;
+            console.log(roomName + ': ' + ws.data.name + ' said VETO!')
+            state.voting = false;
+            stopClock();
+            state.vetos++;
+            state.round++;
+            board.setScore(ws.data, ws.data.score - (VOTING_TIME - counter()) * 2);
+            boardChanged();
+            state.vetoers.push(ws.data);
+            send(ws, 'score', ws.data.score);
+            send(ws, 'end');
+            ws.data.ended = true;
+            updateRecipient(ws);
+
+            if (state.vetos == 3) {
+
+              let thebests = board.best();
+              state.winners[0] = thebests.map(function(player) { return player.name; }).join(', ') +
+                                 ' ('+thebests[0].score+')';
+
+              let vetoers = state.vetoers.slice().sort(function(a, b) { return a.score - b.score; });
+              for (let i = 0; i < 3; i++) {
+                state.winners[i + 1] = vetoers[i] ? vetoers[i].name + ' ('+vetoers[i].score+')' : '';
+              }
+
+              state.winners.forEach(function(winner, i) {
+                broadcast('W', [i, winner]);
+              });
+
+
+              broadcast('T', ws.data.name);
+
+              console.log(roomName + ': THE END');
+            } else {
+              broadcast('v', ws.data.name);
+            }
+            record(['veto', ws.data.id, ws.data.score, state.vetos == 3 ? state.winners : null]);
+
+          }
+        }
+      }
+
+      if (data.type == 'clock') {
+        send(ws, 'K', [Math.round(Number(data.time)) || 0, clock()]);
+      }
+
+      if (data.type == 'start') {
+        if (ws == state.monitor) {
+          startGame();
+        }
+      }
+      if (data.type == 'voting') {
+        if (ws == state.monitor) {
+          startVote();
+        }
+      }
+
+      if (data.type == 'debug') {
+  sendEncoded(ws, JSON.stringify(players, function(key, value) {
+      if (key==='ws') return;
+      return value;
+  }));
+
+  sendEncoded(ws, JSON.stringify(state, function(key, value) {
+      if (key==='monitor') return;
+      if (key==='ws') return;
+      return value;
+  }));
+
+  sendEncoded(ws, JSON.stringify(status()));
+
+
+      }
+
+    };
+  };
+
+  // Counts for the debug command and the server log
+  let status = function() {
+    return {
+      room: roomName,
+      sockets: sockets.size,
+      players: players.length,
+      connected: connected.size,
+      round: state.round,
+      voting: state.voting,
+      connections: metrics.connections,
+      commands: metrics.commands,
+      broadcasts: metrics.broadcasts,
+      send: options.sharded ? shards.metrics() : transport.metrics() // of the whole server
+    };
+  };
+
+  // Stops the timers of a room that's being dropped, calls back once its journal is written
+  let destroy = function(callback) {
+    state.voting = false;
+    stopClock();
+    clearTimeout(tally.timer);
+    tally.timer = null;
+    if (log) log.close(callback);
+    else if (callback) setImmediate(callback);
+  };
+
+  restore();
+
+  return {
+    name: roomName,
+    connection: connection,
+    audit: audit,
+    status: status,
+    destroy: destroy,
+    sockets: sockets,
+    // for bench.js, which drives the game without the timers
+    internals: {
+      state: state,
+      players: players,
+      startGame: startGame,
+      startVote: startVote,
+      countVotes: countVotes,
+      broadcast: broadcast,
+      stopClock: stopClock
+    }
+  };
+};
+
+module.exports = {
+  AUDIT_INTERVAL: AUDIT_INTERVAL,
+  create: create
+};
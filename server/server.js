@@ -2,7 +2,10 @@
  broadcasted events:
    S - game starts
    V - voting starts
-   C{1} - voting counter, {1} secs left
+   D{1},{2} - the voting closes at {1} ms on the server's voting clock, which is {2} ms after this
+     was sent; right after V, count down locally from it. Also sent to a player reconnecting and
+     a monitor registering during a voting
+   C{1} - voting counter, {1} secs left; only with VETO_COUNTER=1, for clients that don't know D
    F{1} - {1} players voted for
    A{1} - {1} players voted against
    N{1} - {1} players didn't vote
@@ -21,6 +24,23 @@
    J{1} - player with nick {1} joined
    L{1} - player with nick {1} left
    R{1} - player with nick {1} reconnected
+     (veto-bin monitors get these as j, l and r with the player id instead of the nick,
+     see proto.js)
+
+   t{1} - {1} is the server time in ms at which the following records were sent; starts every
+     frame for a monitor that asked for it with "timestamps": true, so it can measure delays
+
+   B\x1f{1}:{2}\x1f{3}:{4}... - top 10 players, {1} is the score of the best one and {2} their nick
+     and so on; sent after scores change to a monitor that asked for it with "leaderboard": true
+
+   Y{1},{2},{3} - live tally during the voting: {1} for, {2} against, {3} not voted yet; sent
+     at most VETO_LIVE_TALLY_HZ times a second to a monitor that asked for it with "live": true
+
+   Z{1},{2},{3},{4},{5},{6},{7},{8},{9}\x1f{10}\x1f{11}\x1f{12}\x1f{13} - state snapshot sent
+     right after the monitor registers, so a reconnecting monitor can resync in one step:
+     {1} players connected, {2} round, {3} game started (0/1), {4} voting in progress (0/1),
+     {5} counter, {6}/{7}/{8} last voting results (for/against/abstained), {9} vetos used,
+     {10}-{13} winners W0-W3, empty if not announced yet
 
  events sent only to players:
    cookie:{1} - cookie for reconnecting
@@ -30,413 +50,173 @@
    canVeto - player can veto in this round
    err - if reconnection didn't succeed
    ok - if reconnection did succeed
-   
+
+ events sent only to the connection that asked:
+   K{1},{2} - reply to clock, {1} is the time it sent and {2} the voting clock in ms. The voting
+     clock of the connection is then about {2} + round trip / 2 - its own time at receiving K;
+     the sample with the shortest round trip is the most accurate one
+   X{1} - a message of the connection was rejected, {1} says why; a monitor that gets this
+     instead of its Z wasn't registered
+
+ batching:
+   connections that asked for it with "batch": true get all the events produced
+   during a single tick of the event loop coalesced into one frame, separated by \n
+
+ slow connections:
+   a connection that's behind (VETO_SEND_HIGH_WATER bytes not written to its socket yet) gets
+   only the latest of the C, D, P, Y, B, t and score records sent to it in the meantime, the
+   rest of the events in order; one more than VETO_SEND_BUDGET bytes behind gets cut off
+
+ rooms:
+   every URL path is a separate game with its own players, rounds and monitor - ws://host:8889/stage2
+   and ws://host:8889/stage3 don't see each other's events, / is a room too. At most VETO_MAX_ROOMS
+   of them at a time; a room is dropped VETO_ROOM_IDLE ms after its last connection closes, along
+   with the cookies of its players unless it's journaled. With VETO_ROOMS set (a comma-separated
+   list of paths, e.g. "/,/stage2") no other path is accepted. A room no monitor has registered
+   in within VETO_ROOM_UNCLAIMED ms of being created is dropped with its connections, and right
+   away once they're all closed, so stray paths don't hold on to the room slots.
+
+ journal:
+   with VETO_JOURNAL_DIR set, the players, cookies, scores, round, vetoers and winners of every
+   room are journaled there and restored when the room is opened again, after a restart too, so
+   players reconnect with their cookies as usual; a voting in progress is lost. On SIGINT or
+   SIGTERM the server waits up to VETO_SHUTDOWN_TIMEOUT ms for the journals to be written.
+   See journal.js
+
+ sharding:
+   with VETO_WORKERS=n the connections are spread over n worker processes on the same port,
+   this one keeps the game and talks to them over IPC, see shards.js
+
+ subprotocols:
+   "veto" - the text protocol described here
+   "veto-bin" - the same events and commands as compact binary records, see proto.js;
+                always batched
+
 --------------------------------------------------
 monitor can send:
-  {"type": "monitor"} - to become a monitor (there can be only one)
+  {"type": "monitor", "batch": bool, "timestamps": bool, "live": bool, "leaderboard": bool} - to become a monitor (there can be only one per room)
   {"type": "start"} - to start the game
   {"type": "voting"} - to start the voting
 player can send:
-  {"type": "join", "nick": string} - to join
-  {"type": "reconnect", "cookie": string} - to reconnect
+  {"type": "join", "nick": string, "batch": bool} - to join
+  {"type": "reconnect", "cookie": string, "batch": bool} - to reconnect
   {"type": "vote", "choice": choice} - to vote. can be changed before the voting ends; choice: true/false/null
   {"type": "veto"} - to veto.
+anyone can send:
+  {"type": "clock", "time": number} - to get a K with the voting clock; time is any number it
+    wants back, usually its own clock in ms
   
 debug:
-  TODO: {"type": "debug"} - returns data of all players and state
+  TODO: {"type": "debug"} - returns data of all players and state of the room, and its counters
   
 TODO: test reconnect, start vs. voting; implement veto and debug monitor
 */
 
-const VOTING_TIME = 5;
-
-const WebSocket = require('ws');
-const randomstring = require('randomstring');
-
-const wss = new WebSocket.Server({ port: 8889 });
-
-let players = [];
-
-let state = {
-  monitor: null,
-  voting: false,
-  counter: null,
-  started: false,
-  round: 0,
-  canVeto: false,
-  vetos: 0,
-  vetoers: []
-};
-
-let countVotes = function() {
-    let allplayers = 0;
-    wss.clients.forEach(function each(client) {
-      if (client.readyState === WebSocket.OPEN) {
-        if (client.data) {
-          allplayers++;
-        }
-      }
-    });
-
-
-    let forvotes = 0; let against = 0;
-    players.forEach(function(player) {
-      if (player.vote == true) {
-        forvotes++;
-      }
-      if (player.vote == false) {
-        against++;
-      }
-    });
-    let nonevotes = allplayers - forvotes - against;
-
-    wss.broadcast('F' + forvotes);
-    wss.broadcast('A' + against);
-    wss.broadcast('N' + (nonevotes - state.vetoers.length));
- 
-    let result = 'A';
-    if (forvotes > against) {
-      result = 'F'
-    }
-
-    wss.broadcast('E' + result);
-
-    players.forEach(function(player) {
-      if (player.vote == (result == 'F')) { // points for voting like majority
-        player.score++;
-      } else if (player.vote != null) {
-        player.score--;
-      }
-      if (player.ws.readyState == WebSocket.OPEN) {
-        player.ws.send('score:'+player.score);
-      }
-
-    });
-    
-    state.round++;
-
-};
-
-let startGame = function() {
-  if (state.started) {
-    console.log('RESTART');
-  } else {
-    console.log('START');
-  }
-  state.started = true;
-  
-  state.vetoers = [];
-  state.counter = 0;
-  state.voting = false;
-  state.vetos = 0;
-  state.canVeto = false;
-  
-  players.forEach(function(player) {
-      player.vote = null;
-      player.vetoRight = false;
-      player.score = 0;
-      player.ended = false;
-      if (player.ws.readyState == WebSocket.OPEN) {
-        player.ws.send('score:0');
-      }
-  });
-  
-  state.round=1;
-  
-  wss.broadcast('S');
-
-};
+const transport = require('./transport');
+const shards = require('./shards');
+const room = require('./room');
 
-function dynamicSort(property) {
-    var sortOrder = 1;
-    if(property[0] === "-") {
-        sortOrder = -1;
-        property = property.substr(1);
-    }
-    return function (a,b) {
-        var result = (a[property] < b[property]) ? -1 : (a[property] > b[property]) ? 1 : 0;
-        return result * sortOrder;
-    }
-}
+const env = transport.env;
 
-let startVote = function() {
-    
-    if (state.voting) return;
-    
-    console.log('VOTE round ' + state.round);
-
-    if (state.round % 5 == 0) {
-        state.canVeto = true;
-    } else {
-        state.canVeto = false;
-    }
-    
-  players.forEach(function(player) {
-    player.vote = null;
-    player.vetoRight = false;
-  });
-  
-  state.voting = true;
-  wss.broadcast('V');
-
-  let splayers = players.sort(dynamicSort("score")).filter(function(user) {
-      return !user.ended;
-  });
-  
-  if (state.canVeto) {
-    if (splayers[2]) {
-        let i = 2;
-        while ((splayers[i]) && (splayers[i].score == splayers[2].score)) {
-            splayers[i].vetoRight = true;
-            if (splayers[i].ws.readyState == WebSocket.OPEN) {
-              splayers[i].ws.send('canVeto');
-            }
-            i++;
-        }
-    }
-    if (splayers[1]) {
-        splayers[1].vetoRight = true;
-            if (splayers[1].ws.readyState == WebSocket.OPEN) {
-            splayers[1].ws.send('canVeto'); }
-    }
-    if (splayers[0]) {
-        splayers[0].vetoRight = true;
-            if (splayers[0].ws.readyState == WebSocket.OPEN) {
-            splayers[0].ws.send('canVeto');}
-    }
-  }
+// 0 - one process owning all the connections, n - n worker processes owning them (see shards.js)
+const WORKERS = env('VETO_WORKERS', 0);
 
-  state.counter = VOTING_TIME + 1;
+const MAX_ROOMS = env('VETO_MAX_ROOMS', 16);
+const ROOM_IDLE = env('VETO_ROOM_IDLE', 10 * 60 * 1000); // ms
+const ROOM_UNCLAIMED = env('VETO_ROOM_UNCLAIMED', 30 * 1000); // ms
+const ROOMS = process.env.VETO_ROOMS ? process.env.VETO_ROOMS.split(',') : null; // any if not set
 
-  var tick = function() {
-      if (!state.voting) return;
-    if (state.counter > 0) {
-      state.counter--;
-      wss.broadcast('C' + state.counter);
-      setTimeout(tick, 1000);
-    } else {
-      state.voting = false;
-      countVotes();
-    }
-  };
+let rooms = new Map();
 
-  tick();
+let dropRoom = function(game) {
+  if (rooms.get(game.name) !== game) return;
+  console.log('room ' + game.name + ' dropped: ' + JSON.stringify(game.status()));
+  clearTimeout(game.idle);
+  clearTimeout(game.unclaimed);
+  game.destroy();
+  rooms.delete(game.name);
 };
 
-// Broadcast to all.
-wss.broadcast = function broadcast(data) {
-  wss.clients.forEach(function each(client) {
-    if (client.readyState === WebSocket.OPEN) {
-      if ((client.data) || (client == state.monitor)) {
-        if ((!client.data) || (!client.data.ended)) {
-            client.send(data);
-    }
-      }
-    }
-  });
+// No monitor registered in time, so nobody is going to run a game here
+let dropUnclaimed = function(game) {
+  console.log('room ' + game.name + ' got no monitor in ' + ROOM_UNCLAIMED + ' ms');
+  dropRoom(game);
+  game.sockets.forEach(function(ws) { ws.close(1008, 'no monitor'); });
 };
 
-wss.on('connection', function connection(ws) {
-
-  //wss.broadcast("connected");
-
-  ws.on('close', function() {
-    if (ws==state.monitor) {
-      state.monitor = null;
+let connection = function(ws, req) {
+  let name = ws.remote ? ws.room : transport.roomName(req || ws.upgradeReq);
+  let game = rooms.get(name);
+  if (!game) {
+    if (ROOMS && ROOMS.indexOf(name) < 0) {
+      console.log('refusing room ' + name + ', not in VETO_ROOMS');
+      ws.close(1008, 'no such room');
       return;
     }
-    if (!ws.data) return;
-    let playerCount = 0;
-    ws.data.connected = false;
-    wss.clients.forEach(function each(client) {
-      if (client.readyState === WebSocket.OPEN) {
-        if ((client.data) && (client.data.connected)) {
-          playerCount++;
-        }
-      }
-    });
-    if (state.monitor) {
-      state.monitor.send('P' + playerCount);
-      state.monitor.send('L' + ws.data.name);
-    }
-  });
-
-  ws.on('message', function incoming(data) {
-    // Broadcast to everyone.
-    //wss.broadcast(data);
-
-    console.log('got ' + data + ' from ' + (ws.data ? ws.data.name : null))
-
-    //if (data.startsWith('{')) {
-    try {
-      data = JSON.parse(data);
-    } catch(e) {
-      console.log('error parsing ' + data + ' - ' + (ws.data ? ws.data.name : null))
+    if (rooms.size >= MAX_ROOMS) {
+      console.log('refusing room ' + name + ', there are ' + rooms.size + ' already');
+      ws.close(1013, 'too many rooms');
       return;
     }
-    //}
-
-    if (data.type == 'monitor') {
-      state.monitor = ws;
-      console.log('monitor registered');
-      
-     let playerCount = 0;
-      wss.clients.forEach(function each(client) {
-        if (client.readyState === WebSocket.OPEN) {
-          if ((client.data) && (client.data.connected)) {
-            playerCount++;
-          }
-        }
-      });
-    state.monitor.send('P' + playerCount);
-
-    }
-
-    if (data.type == 'join') {
-      if (ws.data) return;
-      ws.data = {
-        name: data.nick.trim(),
-        score: 0,
-        vote: null,
-        vetoRight: false,
-        ended: false,
-        cookie: randomstring.generate(),
-        connected: true,
-        ws: ws
-      };
-      players.push(ws.data);
-      console.log(ws.data.name + ' joined');
-
-      let playerCount = 0;
-      wss.clients.forEach(function each(client) {
-        if (client.readyState === WebSocket.OPEN) {
-          if ((client.data) && (client.data.connected)) {
-            playerCount++;
-          }
-        }
-      });
-      if (state.monitor) {
-        state.monitor.send('P' + playerCount);
-        state.monitor.send('J' + ws.data.name);
-      }
-      ws.send('cookie:' + ws.data.cookie);
-    }
-
-    if (data.type == 'reconnect') {
-      // TODO: FIXME: search for cookie and reattach
-      players.forEach(function(player) {
-        if (data.cookie == player.cookie) {
-          ws.data = player;
-        }
-      });
-      
-      if (!ws.data) {
-          ws.send('err');
-          return;
-      } else {
-          ws.send('ok');
-      }
-      ws.data.connected = true;
-      ws.data.ws = ws;
-        
-      let playerCount = 0;
-      wss.clients.forEach(function each(client) {
-        if (client.readyState === WebSocket.OPEN) {
-          if ((client.data) && (client.data.connected)) {
-            playerCount++;
-          }
-        }
-      });
-      if (state.monitor) {
-        state.monitor.send('P' + playerCount);
-        state.monitor.send('R' + ws.data.name);
-      }
-      ws.send('score:' + ws.data.score);
-      ws.send('nick:' + ws.data.name);
-      if (ws.data.ended) ws.send('end');
-    }
-
-    if (data.type == 'vote') {
-      if (!ws.data) return;
-      if (ws.data.ended) return;
-      if (state.voting) {
-        console.log(ws.data.name + ' voted ' + data.choice)
-        ws.data.vote = data.choice;
-      }
-    }
-
-    if (data.type == 'veto') {
-      if (!ws.data) return;
-      if (state.voting) {
-        if ((ws.data.vetoRight) && (state.canVeto)) {
-          state.canVeto = false;
-          console.log(ws.data.name + ' said VETO!')
-          state.voting = false;
-          state.vetos++;
-          state.round++;
-          ws.data.score -= (VOTING_TIME - state.counter) * 2;
-          state.vetoers.push(ws.data);
-          ws.send('score:'+ws.data.score);
-          ws.send('end');
-          ws.data.ended = true;
-          
-          if (state.vetos == 3) {
-              
-            players.sort(dynamicSort('-score'));
-            
-            var bestscore = players[0].score;
-            let i = 1;
-            let thebests = [players[0].name];
-            while (players[i].score == bestscore) {
-                thebests.push(players[i].name);
-                i++;
-            }
-            
-            wss.broadcast('W0' + thebests.join(', ') + ' ('+bestscore+')');
-
-            state.vetoers.sort(dynamicSort('score'));
-            
-            wss.broadcast('W1' + state.vetoers[0].name + ' ('+state.vetoers[0].score+')');
-            wss.broadcast('W2' + state.vetoers[1].name + ' ('+state.vetoers[1].score+')');
-            wss.broadcast('W3' + state.vetoers[2].name + ' ('+state.vetoers[2].score+')');
-            
-
-            wss.broadcast('T' + ws.data.name);
-            
-            console.log("THE END");
-          } else {
-            wss.broadcast('v' + ws.data.name);
-          }
-
-        }
-      }
-    }
-
-    if (data.type == 'start') {
-      if (ws == state.monitor) {
-        startGame();
-      }
-    }
-    if (data.type == 'voting') {
-      if (ws == state.monitor) {
-        startVote();
+    game = room.create(name, {
+      sharded: WORKERS > 0,
+      onEmpty: function() {
+        if (game.claimed) game.idle = setTimeout(dropRoom, ROOM_IDLE, game);
+        else dropRoom(game);
+      },
+      onMonitor: function() {
+        game.claimed = true;
+        clearTimeout(game.unclaimed);
       }
-    }
-
-    if (data.type == 'debug') {
-ws.send(JSON.stringify(players, function(key, value) {
-    if (key==='ws') return;
-    return value;
-}));
-
-ws.send(JSON.stringify(state, function(key, value) {
-    if (key==='monitor') return;
-    if (key==='ws') return;
-    return value;
-}));
+    });
+    game.claimed = false;
+    game.unclaimed = setTimeout(dropUnclaimed, ROOM_UNCLAIMED, game);
+    rooms.set(name, game);
+    console.log('room ' + name + ' created');
+  }
+  clearTimeout(game.idle);
+  game.connection(ws);
+};
 
+// Send queues in the log, whenever there's something to tell
+const METRICS_INTERVAL = env('VETO_METRICS_INTERVAL', 10000); // ms, 0 to disable
+let lastCutOff = 0;
+if (METRICS_INTERVAL) {
+  setInterval(function() {
+    let send = WORKERS ? shards.metrics() : transport.metrics();
+    if (!send.behind && (send.cutOff || 0) == lastCutOff) return;
+    lastCutOff = send.cutOff || 0;
+    console.log('send queues: ' + JSON.stringify(send));
+  }, METRICS_INTERVAL);
+}
 
-    }
+if (room.AUDIT_INTERVAL) {
+  setInterval(function() {
+    rooms.forEach(function(game) { game.audit(); });
+  }, room.AUDIT_INTERVAL);
+}
 
+// what's still queued for the journals gets written before going down, after the writes that
+// are already under way
+const SHUTDOWN_TIMEOUT = env('VETO_SHUTDOWN_TIMEOUT', 5000); // ms
+['SIGINT', 'SIGTERM'].forEach(function(signal) {
+  process.on(signal, function() {
+    let left = rooms.size + 1;
+    let done = function() {
+      if (--left == 0) process.exit(0);
+    };
+    rooms.forEach(function(game) { game.destroy(done); });
+    rooms.clear();
+    setTimeout(function() {
+      console.log('journals not written in ' + SHUTDOWN_TIMEOUT + ' ms, going down anyway');
+      process.exit(1);
+    }, SHUTDOWN_TIMEOUT).unref();
+    done();
   });
 });
+
+if (WORKERS) {
+  shards.start(WORKERS, connection);
+} else {
+  transport.createServer().on('connection', connection);
+}
@@ -0,0 +1,179 @@
+/* Coordinator side of the sharded mode (VETO_WORKERS > 0).
+
+ The connections are spread over worker processes (worker.js) listening on the
+ same port; cluster hands each accepted socket to one of them. This process
+ keeps all the game state and sees every connection as a proxy with the parts
+ of the WebSocket interface server.js uses. Messages go both ways over the
+ cluster IPC channels (Unix domain sockets), batched per tick:
+
+ worker -> coordinator, an array of
+   ['open', cid, protocol, room] - new connection, room is its URL path
+   ['commands', cid, [command, ...]] - commands it sent, already parsed
+   ['close', cid]
+   ['metrics', 0, metrics] - its send queues, see transport.metrics; every VETO_METRICS_INTERVAL
+
+ coordinator -> worker, an array of
+   ['send', cid, data, name] - encoded record for one connection, name is what it was encoded from
+   ['set', cid, name, value] - batch or timestamps changed
+   ['recipient', cid, bool] - whether it gets the broadcasts of its room
+   ['close', cid, code, reason]
+   ['broadcast', room, name, text, binary] - the same record in both encodings, for all its
+     recipients in the room
+*/
+
+const cluster = require('cluster');
+const path = require('path');
+const EventEmitter = require('events');
+const WebSocket = require('ws');
+
+// Buffers arrive as Uint8Arrays with advanced serialization, and as {type, data} with JSON.
+let toBuffer = function(data) {
+  if (typeof data == 'string' || Buffer.isBuffer(data)) return data;
+  if (data.type == 'Buffer') return Buffer.from(data.data);
+  return Buffer.from(data.buffer, data.byteOffset, data.byteLength);
+};
+
+let shards = [];
+
+let Shard = function(index, connection) {
+  this.index = index;
+  this.connection = connection;
+  this.sockets = new Map(); // cid -> proxy
+  this.ops = [];
+  this.metrics = null;
+  this.fork();
+};
+
+Shard.prototype.fork = function() {
+  let shard = this;
+  let listening = false;
+  shard.worker = cluster.fork({ VETO_SHARD: shard.index });
+  shard.worker.on('listening', function() { listening = true; });
+  shard.metrics = null;
+  shard.worker.on('message', function(events) {
+    events.forEach(function(event) { shard.receive(event); });
+  });
+  shard.worker.on('exit', function(code, signal) {
+    console.log('shard ' + shard.index + ' exited (' + (signal || code) + '), ' +
+                shard.sockets.size + ' connections lost');
+    shard.ops = [];
+    shard.sockets.forEach(function(ws) { shard.close(ws); });
+    // one that couldn't even start listening would just fail again
+    if (listening) shard.fork();
+  });
+};
+
+Shard.prototype.receive = function(event) {
+  if (event[0] == 'metrics') {
+    this.metrics = event[2];
+    return;
+  }
+  let ws = this.sockets.get(event[1]);
+  if (event[0] == 'open') {
+    ws = new RemoteSocket(this, event[1], event[2], event[3]);
+    this.sockets.set(ws.cid, ws);
+    this.connection(ws);
+  } else if (!ws) {
+    return;
+  } else if (event[0] == 'commands') {
+    ws.emit('commands', event[2]);
+  } else if (event[0] == 'close') {
+    this.close(ws);
+  }
+};
+
+Shard.prototype.close = function(ws) {
+  this.sockets.delete(ws.cid);
+  ws.readyState = WebSocket.CLOSED;
+  ws.emit('close');
+};
+
+Shard.prototype.push = function(op) {
+  if (!this.worker.isConnected()) return;
+  this.ops.push(op);
+  if (this.ops.length == 1) setImmediate(this.flush.bind(this));
+};
+
+Shard.prototype.flush = function() {
+  let ops = this.ops;
+  this.ops = [];
+  if (ops.length && this.worker.isConnected()) this.worker.send(ops);
+};
+
+// Stands in for a connection owned by a worker
+let RemoteSocket = function(shard, cid, protocol, room) {
+  EventEmitter.call(this);
+  this.shard = shard;
+  this.cid = cid;
+  this.protocol = protocol;
+  this.room = room;
+  this.remote = true;
+  this.readyState = WebSocket.OPEN;
+  this._batch = false;
+  this._timestamps = false;
+};
+RemoteSocket.prototype = Object.create(EventEmitter.prototype);
+RemoteSocket.prototype.constructor = RemoteSocket;
+
+['batch', 'timestamps'].forEach(function(name) {
+  Object.defineProperty(RemoteSocket.prototype, name, {
+    get: function() { return this['_' + name]; },
+    set: function(value) {
+      if (this['_' + name] === value) return;
+      this['_' + name] = value;
+      this.shard.push(['set', this.cid, name, value]);
+    }
+  });
+});
+
+RemoteSocket.prototype.sendEncoded = function(data, name) {
+  if (this.readyState !== WebSocket.OPEN) return;
+  this.shard.push(['send', this.cid, data, name]);
+};
+
+RemoteSocket.prototype.setRecipient = function(recipient) {
+  if (this.readyState !== WebSocket.OPEN) return;
+  this.shard.push(['recipient', this.cid, recipient]);
+};
+
+RemoteSocket.prototype.close = function(code, reason) {
+  if (this.readyState !== WebSocket.OPEN) return;
+  this.shard.push(['close', this.cid, code, reason]);
+};
+
+// Forks count workers; connection(ws) is called with a proxy for every new connection.
+let start = function(count, connection) {
+  (cluster.setupPrimary || cluster.setupMaster).call(cluster, {
+    exec: path.join(__dirname, 'worker.js'),
+    serialization: 'advanced'
+  });
+  for (let i = 0; i < count; i++) {
+    shards.push(new Shard(i, connection));
+  }
+};
+
+// Sends the record to the recipients in the room on all the workers
+let broadcast = function(room, name, text, binary) {
+  shards.forEach(function(shard) {
+    shard.push(['broadcast', room, name, text, binary]);
+  });
+};
+
+// Send queues of all the workers as they last reported them, summed up
+let metrics = function() {
+  let result = {};
+  shards.forEach(function(shard) {
+    if (!shard.metrics) return;
+    Object.keys(shard.metrics).forEach(function(key) {
+      result[key] = (result[key] || 0) + shard.metrics[key];
+    });
+  });
+  return result;
+};
+
+module.exports = {
+  start: start,
+  broadcast: broadcast,
+  metrics: metrics,
+  toBuffer: toBuffer
+};
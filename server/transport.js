@@ -0,0 +1,281 @@
+/* Sending to the actual sockets: batching, timestamps, shared broadcast frames and backpressure.
+
+ Used by server.js when it owns the connections itself, and by worker.js when
+ they're spread over several processes (see shards.js).
+*/
+
+const WebSocket = require('ws');
+const proto = require('./proto');
+
+const env = function(name, value) {
+  return process.env[name] !== undefined ? parseInt(process.env[name], 10) : value;
+};
+
+// permessage-deflate, for batched monitor updates and debug dumps that grow with the player count.
+// Context takeover stays on; window and memLevel limit the zlib state kept for every connection
+// (roughly 2^(windowBits+2) + 2^(memLevel+9) bytes each way). Set VETO_DEFLATE=0 to turn it off.
+const perMessageDeflate = env('VETO_DEFLATE', 1) ? {
+  threshold: env('VETO_DEFLATE_THRESHOLD', 256), // bytes; smaller frames aren't worth it
+  serverMaxWindowBits: env('VETO_DEFLATE_WINDOW_BITS', 11),
+  clientMaxWindowBits: env('VETO_DEFLATE_WINDOW_BITS', 11),
+  memLevel: env('VETO_DEFLATE_MEM_LEVEL', 4)
+} : false;
+
+let createServer = function() {
+  return new WebSocket.Server({
+    port: env('VETO_PORT', 8889),
+    perMessageDeflate: perMessageDeflate,
+    handleProtocols: function(protocols) {
+      if (protocols.indexOf(proto.PROTOCOL_BINARY) >= 0) return proto.PROTOCOL_BINARY;
+      if (protocols.indexOf(proto.PROTOCOL_TEXT) >= 0) return proto.PROTOCOL_TEXT;
+      return false;
+    }
+  });
+};
+
+// The room a connection asked for, by its URL path: '/stage2/?x=1' -> '/stage2'
+let roomName = function(req) {
+  let path = ((req && req.url) || '/').split('?')[0].replace(/\/+$/, '');
+  return path.slice(0, 64) || '/';
+};
+
+// Backpressure. A connection with more than VETO_SEND_HIGH_WATER bytes waiting in its socket is
+// behind: what it's sent gets held back until it catches up, and a record of a kind that's
+// superseded by the next one (counters, tallies, player counts...) replaces the one held before,
+// so a phone on bad Wi-Fi gets the latest state instead of a backlog of stale one. Once what's
+// buffered and held goes over VETO_SEND_BUDGET bytes the connection is cut off.
+const HIGH_WATER = env('VETO_SEND_HIGH_WATER', 64 * 1024);
+const BUDGET = env('VETO_SEND_BUDGET', 1024 * 1024);
+const RETRY_INTERVAL = 100; // ms between checks whether the connections behind caught up
+
+const SUPERSEDED = new Set(['C', 'D', 'P', 'Y', 'B', 't', 'score']);
+
+let lagging = new Set(); // connections with records held back
+let retryTimer = null;
+let counters = {
+  coalesced: 0, // held records replaced by a newer one
+  cutOff: 0
+};
+
+let cutOff = function(ws) {
+  console.log('cutting off a connection ' + (ws.bufferedAmount + ws.heldBytes) + ' bytes behind');
+  counters.cutOff++;
+  lagging.delete(ws);
+  ws.held = null;
+  ws.heldBytes = 0;
+  ws.terminate();
+};
+
+let hold = function(ws, data, name) {
+  if (!ws.held) {
+    ws.held = [];
+    ws.heldBytes = 0;
+    lagging.add(ws);
+    if (!retryTimer) retryTimer = setTimeout(retry, RETRY_INTERVAL);
+  }
+  if (name && SUPERSEDED.has(name)) {
+    for (let i = 0; i < ws.held.length; i++) {
+      if (ws.held[i].name === name) {
+        ws.heldBytes -= ws.held[i].data.length;
+        ws.held.splice(i, 1);
+        counters.coalesced++;
+        break; // there's never more than one
+      }
+    }
+  }
+  ws.held.push({ name: name, data: data });
+  ws.heldBytes += data.length;
+  if (ws.bufferedAmount + ws.heldBytes > BUDGET) cutOff(ws);
+};
+
+// Sends what's held for the connections that caught up, the usual way
+let retry = function() {
+  retryTimer = null;
+  lagging.forEach(function(ws) {
+    if (ws.readyState !== WebSocket.OPEN) {
+      lagging.delete(ws);
+      ws.held = null;
+    } else if (ws.bufferedAmount <= HIGH_WATER) {
+      let held = ws.held;
+      lagging.delete(ws);
+      ws.held = null;
+      ws.heldBytes = 0;
+      held.forEach(function(record) { sendEncoded(ws, record.data, record.name); });
+    }
+  });
+  if (lagging.size && !retryTimer) retryTimer = setTimeout(retry, RETRY_INTERVAL);
+};
+
+// Send queue depths of this process
+let metrics = function() {
+  let result = { behind: lagging.size, heldRecords: 0, heldBytes: 0, buffered: 0,
+                 coalesced: counters.coalesced, cutOff: counters.cutOff };
+  lagging.forEach(function(ws) {
+    result.heldRecords += ws.held.length;
+    result.heldBytes += ws.heldBytes;
+    result.buffered += ws.bufferedAmount;
+  });
+  return result;
+};
+
+// Batched sending - records queued for each connection during this tick
+let pendingSockets = [];
+let flushScheduled = false;
+
+// Server send time, for connections measuring their delay
+let timestamp = function(ws) {
+  return ws.binary ? proto.encodeBinary('t', Date.now()) : proto.encodeText('t', Date.now());
+};
+
+// Broadcast frames are built once and the same buffers written to every socket, instead of ws
+// framing the same payload again for each of them. That bypasses ws.send, so it's only done for
+// sockets with nothing queued in their sender (a compression in progress), otherwise ws.send it is.
+// It relies on ws internals, so only with the exact version pinned in package.json (SHARED_FRAMES_WS)
+// and only for senders that still look the way they do in it; anything else gets ws.send.
+const SHARED_FRAMES_WS = '3.0.0';
+const canShareFrames = (function() {
+  let version;
+  try {
+    version = require('ws/package.json').version;
+  } catch (e) {
+    version = null;
+  }
+  if (version !== SHARED_FRAMES_WS) {
+    console.warn('ws ' + (version || '?') + ' instead of ' + SHARED_FRAMES_WS + ', broadcast frames are not shared');
+    return false;
+  }
+  return typeof WebSocket.Sender == 'function' && typeof WebSocket.Sender.frame == 'function';
+})();
+
+let knownSender = function(sender) {
+  return !!sender && typeof sender.sendFrame == 'function' && typeof sender._deflating == 'boolean' &&
+         Array.isArray(sender._queue);
+};
+
+let frame = function(data) {
+  if (!canShareFrames) return null;
+  let binary = typeof data != 'string';
+  return WebSocket.Sender.frame(binary ? data : Buffer.from(data), {
+    fin: true, rsv1: false, opcode: binary ? 2 : 1, mask: false, readOnly: false
+  });
+};
+
+let sendFrame = function(ws, list, data) {
+  let sender = ws._sender;
+  if (list && knownSender(sender) && !sender._deflating && !sender._queue.length) {
+    sender.sendFrame(list);
+  } else {
+    ws.send(data);
+  }
+};
+
+// Broadcast records encoded during this tick, per protocol. A batched socket that got nothing but
+// a run of them up to the last one sends the same frame as every other such socket.
+let tickRecords = { text: [], binary: [] };
+
+let flush = function() {
+  flushScheduled = false;
+  let shared = new Map();
+  pendingSockets.forEach(function(ws) {
+    if (ws.readyState === WebSocket.OPEN) {
+      let records = ws.binary ? tickRecords.binary : tickRecords.text;
+      if (!ws.pendingPrivate && ws.pendingStart + ws.pending.length == records.length) {
+        let key = (ws.binary ? 'b' : 't') + ws.pendingStart;
+        let entry = shared.get(key);
+        if (!entry) {
+          let data = ws.binary ? Buffer.concat(ws.pending) : ws.pending.join('\n');
+          entry = { data: data, frame: frame(data) };
+          shared.set(key, entry);
+        }
+        sendFrame(ws, entry.frame, entry.data);
+      } else {
+        if (ws.timestamps) ws.pending.unshift(timestamp(ws));
+        ws.send(ws.binary ? Buffer.concat(ws.pending) : ws.pending.join('\n'));
+      }
+    }
+    ws.pending = [];
+    ws.pendingPrivate = false;
+  });
+  pendingSockets = [];
+  tickRecords.text = [];
+  tickRecords.binary = [];
+};
+
+// Sends an already encoded record. name is what it was encoded from, if it's one record and not
+// a debug dump; record is passed for broadcasts, see broadcast below.
+let sendEncoded = function(ws, data, name, record) {
+  if (ws.readyState !== WebSocket.OPEN) return;
+  if (ws.held || ws.bufferedAmount > HIGH_WATER) {
+    hold(ws, data, name);
+    return;
+  }
+  if (!ws.batch || (ws.binary && typeof data == 'string')) {
+    // text (debug dumps) is never batched into binary frames
+    if (ws.timestamps && typeof data != 'string') data = Buffer.concat([timestamp(ws), data]);
+    else if (ws.timestamps && !ws.binary) data = timestamp(ws) + '\n' + data;
+    else if (record) {
+      if (record.frame === undefined) record.frame = frame(data);
+      sendFrame(ws, record.frame, data);
+      return;
+    }
+    ws.send(data);
+    return;
+  }
+  if (!ws.pending) ws.pending = [];
+  if (!record || ws.timestamps) {
+    ws.pendingPrivate = true;
+  } else if (!ws.pending.length) {
+    ws.pendingStart = record.index;
+  } else if (record.index != ws.pendingStart + ws.pending.length) {
+    ws.pendingPrivate = true; // missed one
+  }
+  ws.pending.push(data);
+  if (ws.pending.length == 1) {
+    pendingSockets.push(ws);
+    if (!flushScheduled) {
+      flushScheduled = true;
+      setImmediate(flush);
+    }
+  }
+};
+
+// Sends the same record to all the sockets in recipients. encode(binary) is called at most once
+// per protocol.
+let broadcast = function(recipients, name, encode) {
+  let text = null, binary = null;
+  recipients.forEach(function each(client) {
+    if (client.binary) {
+      if (!binary) {
+        binary = { data: encode(true), index: tickRecords.binary.length };
+        tickRecords.binary.push(binary.data);
+      }
+      sendEncoded(client, binary.data, name, binary);
+    } else {
+      if (!text) {
+        text = { data: encode(false), index: tickRecords.text.length };
+        tickRecords.text.push(text.data);
+      }
+      sendEncoded(client, text.data, name, text);
+    }
+  });
+};
+
+// Turns an incoming message into command objects, or null if it's malformed.
+let decode = function(data) {
+  if (typeof data != 'string') return proto.decodeCommands(data);
+  try {
+    return [JSON.parse(data)];
+  } catch(e) {
+    return null;
+  }
+};
+
+module.exports = {
+  env: env,
+  createServer: createServer,
+  roomName: roomName,
+  sendEncoded: sendEncoded,
+  broadcast: broadcast,
+  metrics: metrics,
+  decode: decode
+};
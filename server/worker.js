@@ -0,0 +1,98 @@
+/* Worker process of the sharded mode, forked by shards.js.
+
+ Owns a share of the connections: parses what they send, passes the commands on
+ to the coordinator and does the sending, batching and broadcast fan-out for
+ them. Knows nothing about the game.
+*/
+
+const proto = require('./proto');
+const transport = require('./transport');
+const shards = require('./shards');
+
+const wss = transport.createServer();
+
+let sockets = new Map(); // cid -> ws
+let recipients = new Map(); // room -> Set of ws
+let nextCid = 1;
+
+// Events for the coordinator, sent once per tick
+let events = [];
+let report = function(event) {
+  events.push(event);
+  if (events.length == 1) {
+    setImmediate(function() {
+      let batch = events;
+      events = [];
+      process.send(batch);
+    });
+  }
+};
+
+let apply = function(op) {
+  if (op[0] == 'broadcast') {
+    let text = op[3], binary = shards.toBuffer(op[4]);
+    if (recipients.has(op[1])) {
+      transport.broadcast(recipients.get(op[1]), op[2], function(isBinary) { return isBinary ? binary : text; });
+    }
+    return;
+  }
+  let ws = sockets.get(op[1]);
+  if (!ws) return; // closed in the meantime
+  if (op[0] == 'send') {
+    transport.sendEncoded(ws, shards.toBuffer(op[2]), op[3]);
+  } else if (op[0] == 'set') {
+    ws[op[2]] = op[3];
+  } else if (op[0] == 'recipient') {
+    if (!recipients.has(ws.room)) recipients.set(ws.room, new Set());
+    if (op[2]) recipients.get(ws.room).add(ws);
+    else recipients.get(ws.room).delete(ws);
+  } else if (op[0] == 'close') {
+    ws.close(op[2], op[3]);
+  }
+};
+
+process.on('message', function(ops) {
+  ops.forEach(apply);
+});
+
+const METRICS_INTERVAL = transport.env('VETO_METRICS_INTERVAL', 10000); // ms
+if (METRICS_INTERVAL) {
+  setInterval(function() {
+    report(['metrics', 0, transport.metrics()]);
+  }, METRICS_INTERVAL);
+}
+
+// the coordinator is gone, so is the game
+process.on('disconnect', function() {
+  process.exit(1);
+});
+
+wss.on('connection', function connection(ws, req) {
+  ws.cid = nextCid++;
+  ws.room = transport.roomName(req || ws.upgradeReq);
+  if (ws.protocol == proto.PROTOCOL_BINARY) {
+    ws.binary = true;
+    ws.batch = true;
+  }
+  sockets.set(ws.cid, ws);
+  report(['open', ws.cid, ws.protocol, ws.room]);
+
+  ws.on('close', function() {
+    sockets.delete(ws.cid);
+    if (recipients.has(ws.room)) {
+      recipients.get(ws.room).delete(ws);
+      if (!recipients.get(ws.room).size) recipients.delete(ws.room);
+    }
+    report(['close', ws.cid]);
+  });
+
+  ws.on('message', function incoming(data) {
+    let commands = transport.decode(data);
+    if (!commands) {
+      console.log('error decoding message from connection ' + ws.cid + ' of shard ' + process.env.VETO_SHARD);
+      transport.sendEncoded(ws, ws.binary ? proto.encodeBinary('X', 'undecodable message') : proto.encodeText('X', 'undecodable message'), 'X');
+      return;
+    }
+    report(['commands', ws.cid, commands]);
+  });
+});